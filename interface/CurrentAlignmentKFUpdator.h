@@ -4,11 +4,16 @@
 /// Update trajectory state by combining predicted state and measurement 
 /// as prescribed in the Kalman Filter algorithm plus including the current
 /// estimate on the misalignment (if available).
+/// While a snapshot is in use (see useSnapshot), the current estimate is taken from
+/// the snapshot instead of the alignables, which then can be updated concurrently.
+/// The snapshot is selected per thread.
 
 #include "TrackingTools/PatternTools/interface/TrajectoryStateUpdator.h"
 
 #include "Alignment/CommonAlignment/interface/AlignableNavigator.h"
 
+#include <map>
+
 class AlignmentParameters;
 
 class CurrentAlignmentKFUpdator : public TrajectoryStateUpdator
@@ -16,6 +21,45 @@ class CurrentAlignmentKFUpdator : public TrajectoryStateUpdator
 
 public:
 
+  /// Copies of the alignment parameters that apply to a set of AlignableDets (either their
+  /// own or those of the closest higher level alignable).
+  class Snapshot
+  {
+
+  public:
+
+    Snapshot( void ) {}
+    ~Snapshot( void ) { clear(); }
+
+    /// Add the parameters that apply to the AlignableDet of the given GeomDet.
+    void add( AlignableNavigator* navigator, const GeomDet* det );
+
+    /// The parameters that apply to the AlignableDet (0 if there are none or it is unknown).
+    AlignmentParameters* parameters( const Alignable* alignableDet ) const;
+
+    /// True if the parameters and covariances that apply to the AlignableDets of the snapshot
+    /// have not changed since they were added.
+    bool upToDate( void ) const;
+
+    void clear( void );
+
+  private:
+
+    Snapshot( const Snapshot& );
+    Snapshot& operator=( const Snapshot& );
+
+    std::map< const Alignable*, AlignmentParameters* > theParameters;
+    std::map< const AlignmentParameters*, AlignmentParameters* > theCopies;
+
+  };
+
+  /// Read the alignment parameters from the snapshot (0 = from the alignables), for all updators
+  /// used on the calling thread. Must not be changed while tracks are refitted on this thread.
+  static void useSnapshot( const Snapshot* snapshot ) { theSnapshot = snapshot; }
+
+  /// The snapshot used on the calling thread.
+  static const Snapshot* snapshot( void ) { return theSnapshot; }
+
   CurrentAlignmentKFUpdator( void ) : theAlignableNavigator( 0 ) {}
   CurrentAlignmentKFUpdator( AlignableNavigator* navigator ) : theAlignableNavigator( navigator ) {}
   ~CurrentAlignmentKFUpdator( void ) {}
@@ -35,11 +79,14 @@ private:
 					typename AlgebraicROOTObject<D>::Vector & vecR,
 					typename AlgebraicROOTObject<D>::SymMatrix & matV ) const;
 
-  AlignmentParameters* getAlignmentParameters( const AlignableDetOrUnitPtr alignableDet ) const;
-  AlignmentParameters* getHigherLevelParameters( const Alignable* aAlignable ) const;
+  static AlignmentParameters* getAlignmentParameters( const AlignableDetOrUnitPtr alignableDet );
+  static AlignmentParameters* getCurrentParameters( const Alignable* alignableDet );
+  static AlignmentParameters* getHigherLevelParameters( const Alignable* aAlignable );
 
   AlignableNavigator* theAlignableNavigator;
 
+  static thread_local const Snapshot* theSnapshot;
+
 };
 
 #endif
@@ -0,0 +1,75 @@
+#ifndef Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentCheckpoint_h
+#define Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentCheckpoint_h
+
+#include "Alignment/CommonAlignment/interface/Alignable.h"
+#include "DataFormats/CLHEP/interface/AlgebraicObjects.h"
+
+#include <istream>
+#include <ostream>
+#include <map>
+#include <vector>
+
+/// Helper for writing the state of the KalmanAlignmentAlgorithm to a compact binary file and
+/// reading it back (see KalmanAlignmentAlgorithm::writeCheckpoint). Alignables are identified by
+/// their index in the list given to the constructor, which must be the same (same geometry and
+/// selection of alignables) when the checkpoint is read.
+
+class KalmanAlignmentCheckpoint
+{
+
+public:
+
+  KalmanAlignmentCheckpoint( const std::vector< Alignable* >& alignables );
+
+  ~KalmanAlignmentCheckpoint( void ) {}
+
+  /// Index of the alignable (-1 if it is unknown).
+  int index( Alignable* alignable ) const;
+
+  /// Alignable with the given index (0 if the index is out of range).
+  Alignable* alignable( int index ) const;
+
+  inline const std::vector< Alignable* >& alignables( void ) const { return theAlignables; }
+
+  /// Write/read the header of a checkpoint file. readHeader returns false for foreign files
+  /// and files written by an incompatible version.
+  static void writeHeader( std::ostream& out );
+  static bool readHeader( std::istream& in );
+
+  template< class T > static void write( std::ostream& out, const T& value )
+    { out.write( reinterpret_cast< const char* >( &value ), sizeof( T ) ); }
+
+  template< class T > static void read( std::istream& in, T& value )
+    { in.read( reinterpret_cast< char* >( &value ), sizeof( T ) ); }
+
+  template< class T > static void write( std::ostream& out, const std::vector< T >& values )
+  {
+    write( out, static_cast< unsigned int >( values.size() ) );
+    if ( !values.empty() ) out.write( reinterpret_cast< const char* >( &values[0] ), values.size()*sizeof( T ) );
+  }
+
+  template< class T > static void read( std::istream& in, std::vector< T >& values )
+  {
+    unsigned int size = 0;
+    read( in, size );
+    values.resize( size );
+    if ( size > 0 ) in.read( reinterpret_cast< char* >( &values[0] ), size*sizeof( T ) );
+  }
+
+  static void write( std::ostream& out, const AlgebraicVector& vector );
+  static void write( std::ostream& out, const AlgebraicSymMatrix& matrix );
+  static void write( std::ostream& out, const AlgebraicMatrix& matrix );
+
+  static void read( std::istream& in, AlgebraicVector& vector );
+  static void read( std::istream& in, AlgebraicSymMatrix& matrix );
+  static void read( std::istream& in, AlgebraicMatrix& matrix );
+
+private:
+
+  std::vector< Alignable* > theAlignables;
+  std::map< Alignable*, int > theIndices;
+
+};
+
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentChi2Probability_h
+#define Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentChi2Probability_h
+
+#include <vector>
+
+/// Checks the chi2-probability of tracks against a window [minProb,maxProb].
+/// The window is translated into cuts on the chi2 itself, which are precomputed for each
+/// number of degrees of freedom up to a maximum. Hence, the acceptance of a track requires
+/// only two comparisons. If the window is the full interval [0,1], every track is accepted.
+
+
+class KalmanAlignmentChi2Probability
+{
+
+public:
+
+  KalmanAlignmentChi2Probability( double minProb = 0., double maxProb = 1., unsigned int maxCachedNdof = 200 );
+
+  ~KalmanAlignmentChi2Probability( void ) {}
+
+  /// Return true if the chi2-probability lies within the configured window.
+  inline bool accept( double chi2, unsigned int ndof ) const
+  {
+    if ( theFullWindowFlag ) return true;
+    if ( ndof < theMinChi2.size() ) return ( chi2 >= theMinChi2[ndof] ) && ( chi2 <= theMaxChi2[ndof] );
+    return ( chi2 >= minChi2( ndof ) ) && ( chi2 <= maxChi2( ndof ) );
+  }
+
+  inline double minProbability( void ) const { return theMinProb; }
+  inline double maxProbability( void ) const { return theMaxProb; }
+
+private:
+
+  /// Smallest chi2 with a chi2-probability not above maxProb.
+  double minChi2( unsigned int ndof ) const;
+  /// Largest chi2 with a chi2-probability not below minProb.
+  double maxChi2( unsigned int ndof ) const;
+
+  double theMinProb;
+  double theMaxProb;
+  bool theFullWindowFlag;
+
+  std::vector< double > theMinChi2;
+  std::vector< double > theMaxChi2;
+};
+
+
+#endif
@@ -3,17 +3,60 @@
 
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 
+#include <chrono>
+#include <cstdio>
 #include <vector>
 #include <map>
 #include <string>
 
 /// A simple class that allows fast and easy histograming and the production of graphs.
+/// Histograms are binned when they are filled, so their memory does not grow with the
+/// number of entries. The binning is taken from the configuration ('NBins', 'XMin', 'XMax')
+/// and can be overridden for histograms whose names start with a given prefix (VPSet
+/// 'HistogramBinning'). Storing the raw values in addition ('StoreRawHistogramData')
+/// is optional.
+/// Histograms and graphs that are filled often should be registered once. The returned
+/// handle can then be passed to the fill functions, which avoids building and looking up
+/// the name for every single entry.
+/// Each thread fills its own shard of the data without locking. The shards are merged when
+/// the data is written: histograms are added, graphs and ntuples are concatenated in the
+/// order of the shards (the shards of threads that did not call useShard in the order of
+/// their creation, followed by the shards selected via useShard in the order of their index).
+/// Writing and clearing must not happen while other threads are filling.
+/// Graph and ntuple data can be spilled to a temporary binary file of the shard as soon as a
+/// shard buffers more than 'SpillBufferSize' points (0 keeps everything in memory). The spilled
+/// chunks are read back directly into the final arrays when the data is written.
+/// The number of points of a graph can be limited by a sampling policy, selected via the name
+/// of the graph (VPSet 'GraphSampling', first matching shell pattern wins): keep every N-th
+/// point, keep a uniform random sample of N points (reservoir sampling) or reduce the graph to
+/// N points that preserve its shape (largest-triangle-three-buckets, LTTB). The sampling is
+/// done per shard and is deterministic.
+/// Ntuples with several columns are registered with their column names and filled row by row.
+/// Each column is kept in a contiguous buffer and the ntuple is written as a TTree with one
+/// float branch per column.
+/// The output of several jobs can be merged with hadd: histograms keep their bin contents and
+/// moments, graphs and ntuples are concatenated. The number of points offered to each graph
+/// before sampling is stored in the labeled histogram 'DataCollector_GraphEntries'.
+/// Optionally, a small monitoring file ('MonitorFileName') in the text format of Prometheus is
+/// rewritten atomically every 'MonitorInterval' seconds. It contains the values set via
+/// setMonitorValue and the resident memory of the process.
 
 class KalmanAlignmentDataCollector
 {
 
 public:
 
+  /// Categories of instrumentation. The categories are enabled at run time via the untracked
+  /// vstring 'Instrumentation' (default: all). Defining KAA_NO_INSTRUMENTATION at build time
+  /// disables all of them; the checks are then constant and the guarded fills are compiled away.
+  enum InstrumentationCategory { TrackQA = 1, AlignableEvolution = 2, Timing = 4 };
+
+#ifdef KAA_NO_INSTRUMENTATION
+  static inline bool instrumented( InstrumentationCategory ) { return false; }
+#else
+  static inline bool instrumented( InstrumentationCategory category ) { return ( theInstrumentation & category ) != 0; }
+#endif
+
   KalmanAlignmentDataCollector( void );
   KalmanAlignmentDataCollector( const edm::ParameterSet& config );
   ~KalmanAlignmentDataCollector( void );
@@ -22,30 +65,186 @@ public:
 
   static void configure( const edm::ParameterSet& config );
 
+  /// Register a histogram and return its handle. Registering a name twice returns the same handle.
+  static int registerHistogram( const std::string& histo_name );
+  /// Register a graph and return its handle. Registering a name twice returns the same handle.
+  static int registerGraph( const std::string& graph_name );
+
   static void fillHistogram( std::string histo_name, float data );
   static void fillHistogram( std::string histo_name, int histo_number, float data );
+  static void fillHistogram( int histo_handle, float data );
 
   static void fillGraph( std::string graph_name, float x_data, float y_data );
   static void fillGraph( std::string graph_name, int graph_number, float x_data, float y_data );
+  static void fillGraph( int graph_handle, float x_data, float y_data );
 
   static void fillNtuple( std::string ntuple_name, float data );
 
+  /// Register an ntuple with the given columns and return its handle. Registering a name twice
+  /// returns the same handle, provided that the columns are the same.
+  static int registerNtuple( const std::string& ntuple_name, const std::vector< std::string >& columns );
+
+  /// Fill a row of a registered ntuple: one value per column, in the order of the registration.
+  /// Throws if the handle is unknown or, for a vector, its size differs from the number of columns.
+  static void fillNtuple( int ntuple_handle, const float* row );
+  static void fillNtuple( int ntuple_handle, const std::vector< float >& row );
+
   static void write( void );
   static void write( std::string file_name, std::string mode = "RECREATE" );
 
   static void clear( void );
+
+  /// True if a monitoring file is configured and it is time to rewrite it.
+  static bool monitorFileDue( void );
+
+  /// Set a value for the monitoring file. The type is either "gauge" or "counter".
+  static void setMonitorValue( const std::string& name, double value, const std::string& type = "gauge" );
+
+  /// Rewrite the monitoring file (if configured), regardless of the interval.
+  static void writeMonitorFile( void );
+
+  /// Direct the fills of the calling thread to the shard with the given index. Threads filling
+  /// concurrently must use different indices. A thread that never calls this function gets a
+  /// shard of its own with its first fill.
+  static void useShard( unsigned int index );
     
 private:
 
+  struct HistogramBinning
+  {
+    HistogramBinning( int n = 200, double min = -10., double max = 10. ) : nBins( n ), xMin( min ), xMax( max ) {}
+
+    int nBins;
+    double xMin;
+    double xMax;
+  };
+
+  /// Bin contents (including under- and overflow), running moments of the entries within
+  /// the histogram range and, if requested, the raw values. The binning is resolved at the
+  /// first entry, hence histograms can be registered before the collector is configured.
+  struct HistogramData
+  {
+    HistogramData( void ) : entries( 0 ), sumX( 0. ), sumX2( 0. ) {}
+
+    void add( const HistogramData& other );
+
+    HistogramBinning binning;
+    std::vector< double > contents;
+    unsigned long entries;
+    double sumX;
+    double sumX2;
+    std::vector< float > rawData;
+  };
+
+  struct GraphSampling
+  {
+    enum Policy { EveryNth, Reservoir, LTTB };
+
+    std::string pattern;
+    Policy policy;
+    unsigned int n;
+  };
+
+  /// Graph points and the state of the sampling. The sampling policy is resolved at the first
+  /// entry (0 = keep all points). For reservoir sampling, the sequence numbers of the kept points
+  /// are stored to restore their original order.
+  struct GraphData
+  {
+    GraphData( void ) : resolved( false ), sampling( 0 ), seen( 0 ) {}
+
+    /// True if the number of points is bounded by the sampling, such that the graph is never spilled.
+    inline bool bounded( void ) const { return sampling && sampling->policy != GraphSampling::EveryNth; }
+
+    std::vector< float > xData;
+    std::vector< float > yData;
+
+    bool resolved;
+    const GraphSampling* sampling;
+    unsigned long seen;
+    std::vector< unsigned long > sequence;
+  };
+
+  /// Column buffers of a multi-column ntuple.
+  struct ColumnNtupleData
+  {
+    std::vector< std::vector< float > > columns;
+  };
+
+  /// Position and number of values of a block of data in a spill file.
+  struct SpillChunk
+  {
+    long offset;
+    unsigned int size;
+  };
+
+  typedef std::vector< SpillChunk > SpillChunkCollection;
+
+  /// The data filled by a single thread. Histograms and graphs are indexed by their handles, the
+  /// handle maps cache the global registry such that only unknown names require locking.
+  /// Spilled graph chunks store the x-values followed by the y-values, spilled chunks of
+  /// multi-column ntuples store the columns one after the other (the size is the number of rows).
+  struct Shard
+  {
+    Shard( void ) : bufferedPoints( 0 ), spillFile( 0 ) {}
+    ~Shard( void ) { if ( spillFile ) fclose( spillFile ); }
+
+    std::map< std::string, int > histoHandles;
+    std::map< std::string, int > graphHandles;
+
+    std::vector< HistogramData > histoData;
+    std::vector< GraphData > graphData;
+    std::map< std::string, std::vector< float > > ntupleData;
+    std::vector< ColumnNtupleData > columnNtupleData;
+
+    unsigned long bufferedPoints;
+    FILE* spillFile;
+    std::map< int, SpillChunkCollection > graphChunks;
+    std::map< std::string, SpillChunkCollection > ntupleChunks;
+    std::map< int, SpillChunkCollection > columnNtupleChunks;
+  };
+
   void config( const edm::ParameterSet & config );
 
+  /// Handles from the global registry. The caller has to hold the lock.
+  int histogramHandle( const std::string& histo_name );
+  int graphHandle( const std::string& graph_name );
+
+  Shard& localShard( void );
+  void selectShard( unsigned int index );
+
+  /// All shards in the order in which they are merged. The caller has to hold the lock.
+  std::vector< const Shard* > mergeOrder( void ) const;
+
+  /// Move the buffered graph and ntuple data of the shard to its spill file.
+  void spill( Shard& shard );
+  FILE* openSpillFile( void ) const;
+  SpillChunk writeToSpillFile( FILE* file, const std::vector< float >& data ) const;
+  void readFromSpillFile( FILE* file, long offset, unsigned int size, std::vector< float >& data ) const;
+
+  /// Number of spilled and buffered graph points in the shard.
+  unsigned int graphSize( const Shard& shard, int graph_handle ) const;
+  /// Append the spilled and buffered points of the shard to the graph.
+  void appendGraphData( const Shard& shard, int graph_handle, GraphData& graph ) const;
+
+  /// Sampling policy for a graph, 0 if all points are kept.
+  const GraphSampling* sampling( const std::string& graph_name ) const;
+  /// Add a point according to the sampling policy. Returns true if the number of stored points grew.
+  bool addGraphPoint( int graph_handle, GraphData& graph, float x_data, float y_data ) const;
+
   void fillTH1F( std::string histo_name, float data );
   void fillTH1F( std::string histo_name, int histo_number, float data );
+  void fillTH1F( int histo_handle, float data );
   
   void fillTGraph( std::string graph_name, float x_data, float y_data );
   void fillTGraph( std::string graph_name, int graph_number, float x_data, float y_data );
+  void fillTGraph( int graph_handle, float x_data, float y_data );
 
   void fillTNtuple( std::string ntuple_name, float data );
+  /// The size of the row is checked against the number of columns unless it is negative.
+  void fillTNtuple( int ntuple_handle, const float* row, int row_size = -1 );
+
+  /// Write a multi-column ntuple as TTree, merged over all shards. The caller has to hold the lock.
+  void writeColumnNtuple( const std::string& ntuple_name, int ntuple_handle, const std::vector< const Shard* >& shards ) const;
   
   void writeToTFile( void );
   void writeToTFile( std::string file_name, std::string mode = "RECREATE" );
@@ -53,15 +252,38 @@ private:
   void clearData( void );
 
   std::string toString( int );
+
+  const HistogramBinning& binning( const std::string& histo_name ) const;
   
   static KalmanAlignmentDataCollector* theDataCollector;
+  static unsigned int theInstrumentation;
+  static thread_local Shard* theLocalShard;
 
   edm::ParameterSet theConfiguration;
   
-  std::map< std::string, std::vector< float > > theHistoData;
-  std::map< std::string, std::vector< float > > theXGraphData;
-  std::map< std::string, std::vector< float > > theYGraphData;
-  std::map< std::string, std::vector< float > > theNtupleData;
+  HistogramBinning theDefaultBinning;
+  std::vector< std::pair< std::string, HistogramBinning > > theBinningOverrides;
+  bool theRawHistoDataFlag;
+
+  unsigned long theSpillBufferSize;
+  std::string theSpillDirectory;
+
+  std::map< std::string, int > theHistoHandles;
+  std::vector< std::string > theHistoNames;
+  std::map< std::string, int > theGraphHandles;
+  std::vector< std::string > theGraphNames;
+  std::map< std::string, int > theColumnNtupleHandles;
+  std::vector< std::vector< std::string > > theColumnNtupleColumns;
+
+  std::vector< GraphSampling > theGraphSamplings;
+
+  std::vector< Shard* > theShards;
+  std::map< unsigned int, Shard* > theSelectedShards;
+
+  std::string theMonitorFileName;
+  double theMonitorInterval;
+  std::chrono::steady_clock::time_point theLastMonitorWrite;
+  std::map< std::string, std::pair< std::string, double > > theMonitorValues;
 };
 
 
@@ -13,6 +13,10 @@
 #include "TTree.h"
 #include "TFile.h"
 
+#include <iosfwd>
+
+class KalmanAlignmentCheckpoint;
+
 
 class KalmanAlignmentMetricsCalculator
 {
@@ -51,6 +55,10 @@ public:
   void writeDistances( std::string filename );
   void readDistances( std::string filename );
 
+  /// Write/read the stored distances to/from a checkpoint (see KalmanAlignmentCheckpoint).
+  void writeState( std::ostream& out, const KalmanAlignmentCheckpoint& checkpoint ) const;
+  void readState( std::istream& in, const KalmanAlignmentCheckpoint& checkpoint );
+
 private:
 
   void clearDistances( FullDistancesList& dist );
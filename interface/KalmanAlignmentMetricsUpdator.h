@@ -3,7 +3,10 @@
 
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 
+#include <iosfwd>
+
 class Alignable;
+class KalmanAlignmentCheckpoint;
 
 
 class KalmanAlignmentMetricsUpdator
@@ -22,6 +25,16 @@ public:
   //virtual const std::map< Alignable*, short int > additionalAlignablesWithDistances( const std::vector< Alignable* > & alignables ) = 0;
 
   virtual const std::vector< Alignable* > alignables( void ) const = 0;
+
+  /// Number of stored distances, i.e. the size of the metrics (for monitoring).
+  virtual unsigned int nDistances( void ) const { return 0; }
+
+  /// Alignables with a stored distance to the given alignable.
+  virtual const std::vector< Alignable* > relatedAlignables( Alignable* alignable ) const { return std::vector< Alignable* >(); }
+
+  /// Write/read the metrics to/from a checkpoint (see KalmanAlignmentCheckpoint).
+  virtual void writeState( std::ostream& out, const KalmanAlignmentCheckpoint& checkpoint ) const {}
+  virtual void readState( std::istream& in, const KalmanAlignmentCheckpoint& checkpoint ) {}
 };
 
 
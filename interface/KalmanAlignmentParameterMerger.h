@@ -0,0 +1,59 @@
+#ifndef Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentParameterMerger_h
+#define Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentParameterMerger_h
+
+#include "DataFormats/CLHEP/interface/AlgebraicObjects.h"
+
+/// Running sums for merging the alignment parameters of a single alignable from several jobs
+/// (see KalmanAlignmentAlgorithm::mergeResults). The parameters are weighted with their inverse
+/// covariance. If any of the inputs lacks an invertible covariance (or the weighted merge is
+/// switched off), equal weights are used and the merged covariance is the covariance of the mean,
+/// i.e. the sum of the input covariances divided by N^2.
+/// All jobs start from the same prior (start values and covariance), which is therefore contained
+/// N times in the summed information of N inputs. If the prior is given, it is removed N-1 times.
+/// The weighted merge with prior removal gives the same result, no matter if all inputs are merged
+/// at once or in groups whose results are merged again. Without prior removal, the merged
+/// covariance is too small and the parameters are biased towards the start values.
+
+
+class KalmanAlignmentParameterMerger
+{
+
+public:
+
+  KalmanAlignmentParameterMerger( void ) : theNumberOfInputs( 0 ), theWeightedFlag( true ), thePriorRemovedFlag( false ) {}
+
+  ~KalmanAlignmentParameterMerger( void ) {}
+
+  /// Add the parameters and covariance of one input.
+  void add( const AlgebraicVector& parameters, const AlgebraicSymMatrix& covariance, bool weightedMerge );
+
+  /// Compute the merged parameters and covariance. The prior (start values and covariance of the
+  /// inputs) is optional, it is only removed from a weighted merge of several inputs if its
+  /// covariance is invertible and the merged covariance stays positive on the diagonal.
+  void result( AlgebraicVector& parameters,
+	       AlgebraicSymMatrix& covariance,
+	       const AlgebraicVector* priorParameters = 0,
+	       const AlgebraicSymMatrix* priorCovariance = 0 );
+
+  inline int numberOfInputs( void ) const { return theNumberOfInputs; }
+
+  /// False if equal weights were used.
+  inline bool weighted( void ) const { return theWeightedFlag; }
+
+  /// True if the prior has been removed by the last call to result.
+  inline bool priorRemoved( void ) const { return thePriorRemovedFlag; }
+
+private:
+
+  AlgebraicVector theSum;
+  AlgebraicSymMatrix theCovarianceSum;
+  AlgebraicVector theWeightedSum;
+  AlgebraicSymMatrix theInformation;
+
+  int theNumberOfInputs;
+  bool theWeightedFlag;
+  bool thePriorRemovedFlag;
+};
+
+
+#endif
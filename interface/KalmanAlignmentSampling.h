@@ -0,0 +1,25 @@
+#ifndef Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentSampling_h
+#define Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentSampling_h
+
+#include <vector>
+
+/// Sampling algorithms for the graphs of the KalmanAlignmentDataCollector.
+
+class KalmanAlignmentSampling
+{
+
+public:
+
+  /// Random index within [0,iPoint] for the point iPoint of a graph in reservoir sampling. The
+  /// point replaces the sample with this index if the index is smaller than the size of the
+  /// reservoir. The number is a hash of the graph handle and the point number (splitmix64),
+  /// such that the sampling is reproducible.
+  static unsigned long long reservoirIndex( int graph_handle, unsigned long iPoint );
+
+  /// Reduce the points to n points with the largest-triangle-three-buckets algorithm. The first
+  /// and the last point are always kept. Nothing is done if there are at most n points or n < 3.
+  static void reduceLTTB( std::vector< float >& xData, std::vector< float >& yData, unsigned int n );
+
+};
+
+#endif
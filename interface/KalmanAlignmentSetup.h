@@ -8,6 +8,7 @@
 #include "Alignment/ReferenceTrajectories/interface/TrajectoryFactoryBase.h"
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentUpdator.h"
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentMetricsUpdator.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentChi2Probability.h"
 
 #include <vector>
 #include <string>
@@ -34,9 +35,12 @@ public:
 			const std::vector< SubDetId >& externalIds,
 			const unsigned int minExternalHits,
 			const SortingDirection externalSortingDir,
+			const std::string& externalFitterId,
 			TrajectoryFactoryBase* trajectoryFactory,
 			KalmanAlignmentUpdator* alignmentUpdator,
-			KalmanAlignmentMetricsUpdator* metricsUpdator );
+			KalmanAlignmentMetricsUpdator* metricsUpdator,
+			const double minChi2Prob = 0.,
+			const double maxChi2Prob = 1. );
 
   KalmanAlignmentSetup( const KalmanAlignmentSetup& setup );
 
@@ -59,6 +63,13 @@ public:
   inline const SortingDirection sortingDirection( void ) const { return theSortingDir; }
   inline const SortingDirection externalSortingDirection( void ) const { return theExternalSortingDir; }
 
+  /// Identifies the configuration of the external fitter. Setups with the same identifier use
+  /// equivalent external fitters, hence the external fits can be shared between them.
+  inline const std::string& externalFitterId( void ) const { return theExternalFitterId; }
+
+  /// Window on the chi2-probability of the refitted tracklets.
+  inline const KalmanAlignmentChi2Probability& trackChi2Probability( void ) const { return theTrackChi2Probability; }
+
   bool useForTracking( const ConstRecHitPointer& recHit ) const;
   bool useForExternalTracking( const ConstRecHitPointer& recHit ) const;
 
@@ -81,11 +92,14 @@ private:
   std::vector< SubDetId > theExternalTrackingSubDetIds;
   unsigned int theMinExternalHits;
   SortingDirection theExternalSortingDir;
+  std::string theExternalFitterId;
 
   TrajectoryFactoryBase* theTrajectoryFactory;
   KalmanAlignmentUpdator* theAlignmentUpdator;
   KalmanAlignmentMetricsUpdator* theMetricsUpdator;
 
+  KalmanAlignmentChi2Probability theTrackChi2Probability;
+
 };
 
 #endif
@@ -0,0 +1,63 @@
+#ifndef Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentTimer_h
+#define Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentTimer_h
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentDataCollector.h"
+
+#include <chrono>
+#include <string>
+
+/// Timing of the major stages of the KalmanAlignmentAlgorithm. A KalmanAlignmentTimer::Scope
+/// measures the (steady clock) time from its construction until stop() is called or it goes out
+/// of scope. The times are accumulated per thread without locking, in logarithmic bins with four
+/// bins per factor 2, from which the quantiles are estimated. The accumulators of finished threads
+/// are merged into a global one. Timing is only done if the instrumentation category 'Timing'
+/// of the KalmanAlignmentDataCollector is enabled.
+
+class KalmanAlignmentTimer
+{
+
+public:
+
+  enum Stage { Refit, ReferenceTrajectories, MetricsUpdate, AdditionalAlignables, SelectParameters,
+	       GainComputation, StoreUpdate, UserVariablesUpdate, NumberOfStages };
+
+  class Scope
+  {
+
+  public:
+
+    explicit Scope( Stage stage ) :
+      theStage( stage ),
+      theRunningFlag( KalmanAlignmentDataCollector::instrumented( KalmanAlignmentDataCollector::Timing ) )
+    { if ( theRunningFlag ) theStart = std::chrono::steady_clock::now(); }
+
+    ~Scope( void ) { stop(); }
+
+    inline void stop( void )
+    {
+      if ( !theRunningFlag ) return;
+      KalmanAlignmentTimer::add( theStage, std::chrono::steady_clock::now() - theStart );
+      theRunningFlag = false;
+    }
+
+  private:
+
+    Stage theStage;
+    bool theRunningFlag;
+    std::chrono::steady_clock::time_point theStart;
+
+  };
+
+  /// Add a measurement to the accumulator of the calling thread.
+  static void add( Stage stage, std::chrono::steady_clock::duration duration );
+
+  static const char* stageName( Stage stage );
+
+  /// Write the breakdown per stage (calls, total, mean, 50/90/99% quantiles) to the given text file
+  /// (if not empty) and to the ntuple 'Timing' of the KalmanAlignmentDataCollector. Must not be
+  /// called while other threads are timing.
+  static void write( const std::string& fileName );
+
+};
+
+#endif
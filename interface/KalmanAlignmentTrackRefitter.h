@@ -4,15 +4,24 @@
 #include "RecoTracker/TrackProducer/interface/TrackProducerBase.h"
 #include "RecoTracker/TrackProducer/interface/TrackProducerAlgorithm.h"
 
+#include "Alignment/CommonAlignment/interface/Alignable.h"
 #include "Alignment/CommonAlignment/interface/AlignableNavigator.h"
 
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentTracklet.h"
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentSetup.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentWorkerPool.h"
 
 #include "TrackingTools/TransientTrack/interface/TransientTrack.h"
 
+#include "DataFormats/GeometryVector/interface/GlobalPoint.h"
+
 #include "TrackingTools/TransientTrackingRecHit/interface/TransientTrackingRecHitBuilder.h"
 
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+
 class TrajectoryFitter;
 
 namespace reco { class BeamSpot; }
@@ -26,6 +35,20 @@ namespace reco { class BeamSpot; }
 /// the configuration file.
 /// NOTE: The trajectory measurements of the tracklets are always ordered along
 /// the direction of the momentum!
+/// The tracks of an event can be refitted on several threads (parameter
+/// 'NumberOfThreads'). The threads are started once and reused for all events.
+/// Each thread uses its own copies of the alignment setups and its own
+/// TrackProducerAlgorithm, hence its own fitters and propagators. The hit
+/// builder (with its CPEs) and the magnetic field are shared and not thread-safe,
+/// hence the calls that use them are serialized (parameter
+/// 'SerializeSharedServices', only to be switched off if these services are known
+/// to be thread-safe). As the hit building, the propagation and the fit all use the
+/// magnetic field, they run under the same lock and the serialized refit does not
+/// scale with the number of threads. With 'ValidateThreadedRefit', every event is refitted
+/// sequentially as well and compared to the result of the threads. The resulting
+/// tracklets are always returned in the same order as for the sequential refit.
+/// Hits on dets that are not known to the alignable navigator are dropped. The
+/// corresponding DetIds are collected once at construction.
 
 
 class KalmanAlignmentTrackRefitter : public TrackProducerBase<reco::Track>
@@ -46,12 +69,15 @@ public:
   typedef AlignmentAlgorithmBase::ConstTrajTrackPair ConstTrajTrackPair;
   typedef AlignmentAlgorithmBase::ConstTrajTrackPairCollection ConstTrajTrackPairCollection;
 
-  /// Constructor.
-  KalmanAlignmentTrackRefitter( const edm::ParameterSet& config, AlignableNavigator* navigator );
+  /// Constructor. The alignables are the same as those used to construct the navigator.
+  KalmanAlignmentTrackRefitter( const edm::ParameterSet& config,
+				AlignableNavigator* navigator,
+				const std::vector< Alignable* >& alignables );
 
   /// Destructor.
   ~KalmanAlignmentTrackRefitter( void );
 
+  /// Must not be called concurrently.
   TrackletCollection refitTracks( const edm::EventSetup& eventSetup,
 				  const AlignmentSetupCollection& algoSetups,
 				  const ConstTrajTrackPairCollection& tracks,
@@ -60,9 +86,123 @@ public:
   /// Dummy implementation, due to inheritance from TrackProducerBase.
   virtual void produce( edm::Event&, const edm::EventSetup& ) {}
 
+  /// Number of threads used for refitting the tracks.
+  inline unsigned int numberOfThreads( void ) const { return theNumberOfThreads; }
+
+  /// Number of calls to refitTracks.
+  inline unsigned int numberOfRefitCalls( void ) const { return theNumberOfRefitCalls; }
+
+  /// Number of valid hits that were dropped because their det is not known to the navigator.
+  inline unsigned long numberOfDroppedHits( void ) const { return theNumberOfDroppedHits; }
+
+  /// True if hits with the given global positions of the first and the last hit have to be
+  /// reversed to follow the sorting direction.
+  static bool reverseHitOrder( const GlobalPoint& firstPosition,
+			       const GlobalPoint& lastPosition,
+			       const SortingDirection& sortingDir );
+
+  /// Number of events for which the threaded refit was compared to the sequential one, and
+  /// number of events for which they did not agree (see 'ValidateThreadedRefit').
+  inline unsigned int numberOfValidatedEvents( void ) const { return theNumberOfValidatedEvents; }
+  inline unsigned int numberOfMismatches( void ) const { return theNumberOfMismatches; }
+
+  /// Lock for the calls that use the hit builder or the magnetic field. Not locked at all if the
+  /// shared services are not serialized. Code that uses these services while the tracks are
+  /// refitted (e.g. the trajectory factories) must take the same lock.
+  std::unique_lock< std::mutex > lockSharedServices( void ) const;
+
 private:
 
-  TrajTrackPairCollection refitSingleTracklet( const TrackingGeometry* geometry,
+  /// Handles of the debug histograms (see KalmanAlignmentDataCollector) for one identifier.
+  struct DebugHistograms
+  {
+    int ipPt;
+    int fsPt;
+    int cumChi2;
+    int nHits;
+    int pt;
+    int eta;
+    int phi;
+    int normChi2;
+    int dz;
+    int dxyBS;
+    int dxy;
+  };
+
+  typedef std::map< std::string, DebugHistograms > DebugHistogramMap;
+
+  /// Register the debug histograms for the given identifier, if not done yet. Must not be
+  /// called while the tracks are refitted on several threads.
+  void registerDebugHistograms( const std::string& identifier );
+
+  /// Histogram handles for an identifier that has already been registered.
+  inline const DebugHistograms& debugHistograms( const std::string& identifier ) const
+    { return theDebugHistograms.find( identifier )->second; }
+
+  /// External fit of a track. It is shared between all alignment setups that refit the same
+  /// external hits with an equivalent external fitter and the same sorting direction.
+  struct ExternalTracklet
+  {
+    std::vector< unsigned int > detIds;
+    std::string fitterId;
+    SortingDirection sortingDir;
+    KalmanAlignmentTracklet::TrajTrackPair trajTrackPair;
+    reco::TransientTrack transientTrack;
+  };
+
+  typedef std::vector< ExternalTracklet > ExternalTrackletCache;
+
+  typedef TrackProducerAlgorithm< reco::Track > RefitterAlgorithm;
+
+  /// Return the external fit for the given hits and setup, refit only if not yet in the cache.
+  /// Returns 0 if the external fit failed.
+  const ExternalTracklet* externalTracklet( ExternalTrackletCache& cache,
+					    const KalmanAlignmentSetup* algoSetup,
+					    const KalmanAlignmentSetup* fitterSetup,
+					    RefitterAlgorithm& refitterAlgo,
+					    const TrackingGeometry* geometry,
+					    const MagneticField* magneticField,
+					    const TransientTrackingRecHitBuilder* recHitBuilder,
+					    const reco::TransientTrack& fullTrack,
+					    RecHitContainer& recHits,
+					    const reco::BeamSpot* beamSpot );
+
+  void clearExternalTracklets( ExternalTrackletCache& cache ) const;
+
+  /// Refit a single track for all alignment setups. The fitters and propagators are taken
+  /// from fitterSetups, which are either the algoSetups themselves or thread-private copies.
+  void refitTrack( const ConstTrajTrackPair& track,
+		   const AlignmentSetupCollection& algoSetups,
+		   const AlignmentSetupCollection& fitterSetups,
+		   RefitterAlgorithm& refitterAlgo,
+		   const TrackingGeometry* geometry,
+		   const MagneticField* magneticField,
+		   const TransientTrackingRecHitBuilder* recHitBuilder,
+		   const Propagator* predictionPropagator,
+		   const reco::BeamSpot* beamSpot,
+		   TrackletCollection& result );
+
+  /// Collect the DetIds of all AlignableDets and AlignableDetUnits, as done by the navigator.
+  void collectDetIds( const Alignable* alignable );
+
+  /// True if the det is known to the navigator.
+  inline bool isKnownDetId( const DetId& detId ) const
+    { return std::binary_search( theKnownDetIds.begin(), theKnownDetIds.end(), detId.rawId() ); }
+
+  /// Make sure that there are private copies of the alignment setups for each additional thread.
+  void prepareWorkerSetups( const AlignmentSetupCollection& algoSetups, unsigned int nWorkers );
+
+  void clearWorkerSetups( void );
+
+  /// The TrackProducerAlgorithm of a worker, the first worker uses theRefitterAlgo.
+  inline RefitterAlgorithm& refitterAlgorithm( unsigned int iWorker )
+    { return ( iWorker == 0 ) ? theRefitterAlgo : *theWorkerAlgos[iWorker-1]; }
+
+  /// True if both collections hold the same tracklets (same setups, hits and fit results).
+  bool equivalentTracklets( const TrackletCollection& tracklets1, const TrackletCollection& tracklets2 ) const;
+
+  TrajTrackPairCollection refitSingleTracklet( RefitterAlgorithm& refitterAlgo,
+					       const TrackingGeometry* geometry,
 					       const MagneticField* magneticField,
 					       const TrajectoryFitter* fitter,
 					       const Propagator* propagator,
@@ -75,23 +215,46 @@ private:
 					       bool reuseMomentumEstimate,
 					       const std::string identifier = std::string("RefitSingle_") );
 
+  /// Reverse the order of the hits if needed for the given sorting direction. The decision is
+  /// based on the global positions of the first and the last hit.
   void sortRecHits( RecHitContainer& hits,
-		    const TransientTrackingRecHitBuilder* builder,
+		    const TrackingGeometry* geometry,
 		    const SortingDirection& sortingDir ) const;
 
 
-  bool rejectTrack( const reco::Track* track ) const;
+  /// Reject tracks whose chi2-probability is outside the window configured for the setup.
+  bool rejectTrack( const reco::Track* track, const KalmanAlignmentSetup* setup ) const;
 
 
-  void debugTrackData( const std::string identifier,
+  void debugTrackData( const DebugHistograms& histograms,
 		       const Trajectory* traj,
 		       const reco::Track* track,
 		       const reco::BeamSpot* bs );
 
-  TrackProducerAlgorithm<reco::Track> theRefitterAlgo;
+  RefitterAlgorithm theRefitterAlgo;
   //TrackProducerAlgorithm theRefitterAlgo;
   AlignableNavigator* theNavigator;
   bool theDebugFlag;
+
+  DebugHistogramMap theDebugHistograms;
+
+  std::vector< unsigned int > theKnownDetIds;
+  std::atomic< unsigned long > theNumberOfDroppedHits;
+
+  unsigned int theNumberOfThreads;
+  std::vector< AlignmentSetupCollection > theWorkerSetups;
+  std::vector< RefitterAlgorithm* > theWorkerAlgos;
+
+  bool theSerializeFlag;
+  mutable std::mutex theSharedServicesMutex;
+
+  KalmanAlignmentWorkerPool* theWorkerPool;
+
+  bool theValidationFlag;
+  unsigned int theNumberOfValidatedEvents;
+  unsigned int theNumberOfMismatches;
+
+  unsigned int theNumberOfRefitCalls;
 };
 
 
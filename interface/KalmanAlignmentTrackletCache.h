@@ -0,0 +1,78 @@
+#ifndef Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentTrackletCache_h
+#define Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentTrackletCache_h
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentTracklet.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentSetup.h"
+
+#include "DataFormats/BeamSpot/interface/BeamSpot.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+class MagneticField;
+class TrackingGeometry;
+
+/// On-disk cache of the refitted tracklets, written event by event by one job and read back by a
+/// later job (e.g. the next iteration of KAPS), which can then skip reading the tracks and refitting
+/// them. Per tracklet, the cache holds the id of the alignment setup, the hits (DetId, local
+/// position and error), the updated trajectory states (local parameters and errors), the refitted
+/// track and the external prediction. The geometry of the reading job is used to place the states
+/// and hits, such that the reference trajectories are linearised around the current geometry.
+/// NOTE: Only valid hits on dets are cached. The hits keep their local positions and errors, as
+/// with the hit builder 'WithoutRefit'.
+
+class KalmanAlignmentTrackletCache
+{
+
+public:
+
+  typedef KalmanAlignmentTracklet::TrackletPtr TrackletPtr;
+  typedef std::vector< TrackletPtr > TrackletCollection;
+  typedef std::vector< KalmanAlignmentSetup* > AlignmentSetupCollection;
+
+  /// Open the file for reading or writing. Throws if the file cannot be opened or, for reading,
+  /// is not a tracklet cache.
+  KalmanAlignmentTrackletCache( const std::string& fileName, bool readMode );
+
+  ~KalmanAlignmentTrackletCache( void );
+
+  /// Append the tracklets of an event.
+  void write( const TrackletCollection& tracklets, const reco::BeamSpot& beamSpot );
+
+  /// Read the tracklets of the next event. The tracklets are assigned to the alignment setups with
+  /// the same id. Returns false after the last event.
+  bool read( const AlignmentSetupCollection& setups,
+	     const TrackingGeometry* geometry,
+	     const MagneticField* magneticField,
+	     TrackletCollection& tracklets,
+	     reco::BeamSpot& beamSpot );
+
+  inline bool readMode( void ) const { return theReadMode; }
+
+  inline unsigned long numberOfEvents( void ) const { return theNumberOfEvents; }
+  inline unsigned long numberOfTracklets( void ) const { return theNumberOfTracklets; }
+
+private:
+
+  /// The surface of a trajectory state is identified by the DetId of a hit of the trajectory on the
+  /// same surface. Returns 0 if there is no such hit.
+  static unsigned int surfaceId( const TrajectoryStateOnSurface& state, const Trajectory* trajectory );
+
+  /// True if the tracklet can be cached (at least two hits, external prediction on a known surface).
+  static bool cacheable( const KalmanAlignmentTracklet* tracklet );
+
+  void write( const TrajectoryStateOnSurface& state, unsigned int surfaceId );
+  TrajectoryStateOnSurface readState( const TrackingGeometry* geometry, const MagneticField* magneticField );
+
+  std::fstream theStream;
+  std::vector< char > theBuffer;
+  std::string theFileName;
+  bool theReadMode;
+
+  unsigned long theNumberOfEvents;
+  unsigned long theNumberOfTracklets;
+};
+
+
+#endif
@@ -8,6 +8,9 @@
 
 #include "DataFormats/BeamSpot/interface/BeamSpot.h"
 
+#include <iosfwd>
+#include <mutex>
+
 /// Abstract base class for updators for the KalmanAlignmentAlgorithm.
 
 class MagneticField;
@@ -19,7 +22,11 @@ public:
 
   typedef ReferenceTrajectoryBase::ReferenceTrajectoryPtr ReferenceTrajectoryPtr;
 
-  KalmanAlignmentUpdator( const edm::ParameterSet & config ) {}
+  KalmanAlignmentUpdator( const edm::ParameterSet & config ) :
+    theNumberOfProcessedTrajectories( 0 ),
+    theNumberOfRejectedUpdates( 0 ),
+    theNumberOfSkippedTrajectories( 0 )
+  {}
   virtual ~KalmanAlignmentUpdator( void ) {}
 
   /// Process some kind of reference trajectory, for instance a single- or two-particle-trajectory,
@@ -32,6 +39,19 @@ public:
 
   virtual KalmanAlignmentUpdator* clone( void ) const = 0;
 
+  /// Number of valid trajectories handed to process (for monitoring).
+  inline unsigned long numberOfProcessedTrajectories( void ) const { return theNumberOfProcessedTrajectories; }
+
+  /// Number of updates that were computed but rejected, e.g. due to non-invertible matrices (for monitoring).
+  inline unsigned long numberOfRejectedUpdates( void ) const { return theNumberOfRejectedUpdates; }
+
+  /// Number of trajectories skipped because all their alignables have converged (for monitoring).
+  inline unsigned long numberOfSkippedTrajectories( void ) const { return theNumberOfSkippedTrajectories; }
+
+  /// Write/read the counters of the updator to/from a checkpoint (see KalmanAlignmentCheckpoint).
+  virtual void writeState( std::ostream& out ) const;
+  virtual void readState( std::istream& in );
+
 protected:
 
   /// Update the AlignmentUserVariables, given that the Alignables hold KalmanAlignmentUserVariables.
@@ -45,6 +65,18 @@ protected:
 
   unsigned int nDifferentAlignables( const std::vector<Alignable*>& ali ) const;
 
+  /// True if all Alignables hold KalmanAlignmentUserVariables that flag them as converged.
+  bool allConverged( const std::vector< Alignable* >& alignables ) const;
+
+  /// Guards the AlignmentParameterStore (parameters and correlations), which is shared by the updators
+  /// of alignment setups that are processed concurrently. Everything else an updator touches belongs
+  /// to alignables of its own setup.
+  static std::mutex& storeMutex( void );
+
+  unsigned long theNumberOfProcessedTrajectories;
+  unsigned long theNumberOfRejectedUpdates;
+  unsigned long theNumberOfSkippedTrajectories;
+
 };
 
 
@@ -7,12 +7,26 @@
 #include "Alignment/CommonAlignment/interface/AlignableObjectId.h"
 #include "Alignment/TrackerAlignment/interface/TrackerAlignableId.h"
 
+#include <atomic>
+#include <iosfwd>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 /// User variables used by the KalmanAlignmentAlgorithm. The evolution of the estimated alignment
 /// parameters is stored in graphs using the DataCollector.
+/// The counters and flags of all alignables are kept in a dense array, the user variables only
+/// hold an index into it. Hence, cloning them (on every update of the alignment parameters) is
+/// cheap and all clones share the same bookkeeping.
+/// An alignable is considered converged if the sum of the variances of its selected parameters
+/// was reduced by less than a given fraction during the last window of updates.
+/// During the run, only compact snapshots of the parameters and their errors are recorded into a
+/// pre-allocated buffer per alignable.
+/// The snapshots are converted to the global frame and passed to the DataCollector when the
+/// buffer is full or when the update is enforced (at the end of the job).
 
 class TrackerTopology;
+class KalmanAlignmentCheckpoint;
 
 class KalmanAlignmentUserVariables : public AlignmentUserVariables
 {
@@ -25,61 +39,147 @@ public:
                                 const TrackerTopology* tTopo,
 				int frequency = 100 );
 
-  KalmanAlignmentUserVariables( void ) :
-    theParentAlignable( 0 ),
-    theNumberOfHits( 0 ),
-    theNumberOfUpdates( 0 ),
-    theUpdateFrequency( 0 ),
-    theFirstUpdate( false ),
-    theAlignmentFlag( false )
-  {}
+  KalmanAlignmentUserVariables( void ) : theIndex( -1 ) {}
 
   virtual ~KalmanAlignmentUserVariables( void ) {}
 
   virtual KalmanAlignmentUserVariables* clone( void ) const { return new KalmanAlignmentUserVariables( *this ); }
 
+  /// Set the number of snapshots buffered per alignable (0 = pass them on immediately).
+  static void setSnapshotBufferSize( unsigned int size ) { theSnapshotBufferSize = size; }
+
+  /// Set the number of updates per convergence window (0 = no convergence tracking) and the
+  /// relative reduction of the variances below which an alignable is considered converged.
+  static void setConvergenceCriterion( unsigned int window, double threshold )
+    { theConvergenceWindow = window; theConvergenceThreshold = threshold; }
+
   /// Return the number of hits.
-  inline int numberOfHits( void ) const { return theNumberOfHits; }
+  inline int numberOfHits( void ) const { return ( theIndex < 0 ) ? 0 : theBookkeeping[theIndex].numberOfHits; }
   /// Call this function in case the associated Alignable was hit by a particle.
-  inline void hit( void ) { ++theNumberOfHits; }
+  inline void hit( void ) { if ( theIndex >= 0 ) ++theBookkeeping[theIndex].numberOfHits; }
 
   /// Return the number of updates.
-  inline int numberOfUpdates( void ) const { return theNumberOfUpdates; }
+  inline int numberOfUpdates( void ) const { return ( theIndex < 0 ) ? 0 : theBookkeeping[theIndex].numberOfUpdates; }
   /// Call this function in case the associated Alignable was updated by the alignment algorithm.
-  void update( bool enforceUpdate = false );
+  inline void update( bool enforceUpdate = false ) { if ( theIndex >= 0 ) update( theIndex, enforceUpdate ); }
   /// Update user variables with given alignment parameters.
   void update( const AlignmentParameters* param );
   /// Histogram current estimate of the alignment parameters wrt. the true values.
   void histogramParameters( std::string histoNamePrefix );
 
-  inline const std::string identifier( void ) const { return theIdentifier; }
+  inline const std::string identifier( void ) const
+    { return ( theIndex < 0 ) ? std::string( "NoAlignable" ) : theEvolution[theIndex].identifier; }
+
+  inline void setAlignmentFlag( bool flag ) { if ( theIndex >= 0 ) theBookkeeping[theIndex].alignmentFlag = flag; }
+  inline bool isAligned( void ) const { return ( theIndex >= 0 ) && theBookkeeping[theIndex].alignmentFlag; }
 
-  inline void setAlignmentFlag( bool flag ) { theAlignmentFlag = flag; }
-  inline bool isAligned( void ) const { return theAlignmentFlag; }
+  /// True if the estimate of the alignable has converged (see above).
+  inline bool isConverged( void ) const { return ( theIndex >= 0 ) && theBookkeeping[theIndex].converged; }
 
   void fixAlignable( void );
   void unfixAlignable( void );
 
+  /// Index of the bookkeeping of an alignable (-1 if it holds no KalmanAlignmentUserVariables).
+  static int index( const Alignable* alignable );
+
+  /// Start a new epoch for marking alignables (see below).
+  static unsigned long newEpoch( void ) { return ++theEpoch; }
+
+  /// Mark the alignable with the given index. Returns false if it was already marked in this epoch.
+  static inline bool mark( int index, unsigned long epoch )
+  {
+    if ( theBookkeeping[index].epoch == epoch ) return false;
+    theBookkeeping[index].epoch = epoch;
+    return true;
+  }
+
+  /// Same as isConverged, for the alignable with the given index.
+  static inline bool converged( int index ) { return theBookkeeping[index].converged; }
+
+  /// Same as the non-static update, for the alignable with the given index.
+  static void update( int index, bool enforceUpdate = false );
+
+  /// Write/read the counters and flags of all alignables to/from a checkpoint (see
+  /// KalmanAlignmentCheckpoint). Buffered snapshots are not part of the checkpoint.
+  static void writeState( std::ostream& out, const KalmanAlignmentCheckpoint& checkpoint );
+  static void readState( std::istream& in, const KalmanAlignmentCheckpoint& checkpoint );
+
 protected:
 
-  const AlgebraicVector extractTrueParameters( void ) const;
+  static const int theNumberOfParameters = 6;
+
+  /// Estimated parameters (local frame) and their errors after a given number of updates.
+  struct EvolutionSnapshot
+  {
+    int step;
+    bool first;
+    float parameters[theNumberOfParameters];
+    float sigmas[theNumberOfParameters];
+  };
+
+  typedef std::vector< EvolutionSnapshot > EvolutionBuffer;
+
+  /// Counters and flags of an alignable, accessed on every update.
+  struct Bookkeeping
+  {
+    Bookkeeping( void ) :
+      numberOfHits( 0 ), numberOfUpdates( 0 ), firstUpdate( true ), alignmentFlag( false ), epoch( 0 ),
+      windowStart( 0 ), windowVariance( 0. ), converged( false ) {}
+
+    int numberOfHits;
+    int numberOfUpdates;
+    bool firstUpdate;
+    bool alignmentFlag;
+    unsigned long epoch;
+
+    /// Update count and sum of the variances at the start of the current convergence window.
+    int windowStart;
+    float windowVariance;
+    bool converged;
+  };
+
+  /// Names, graph handles and buffered snapshots of an alignable, accessed when the evolution
+  /// of its parameters is recorded.
+  struct Evolution
+  {
+    Alignable* parent;
+    int updateFrequency;
+
+    std::string identifier;
+    std::string typeAndLayer;
+
+    /// Handles of the graphs for the evolution of the parameters (see KalmanAlignmentDataCollector).
+    int deltaGraphs[theNumberOfParameters];
+    int sigmaGraphs[theNumberOfParameters];
+
+    EvolutionBuffer snapshots;
+  };
+
+  static void checkConvergence( int index );
+
+  static void recordSnapshot( int index );
+  static void flushSnapshots( int index );
+
+  static const AlgebraicVector extractTrueParameters( const Alignable* alignable );
 
-  const std::string selectedParameter( const int& selected ) const;
-  float selectedScaling( const int& selected ) const;
+  static const std::string selectedParameter( const int& selected );
+  static float selectedScaling( const int& selected );
 
-  const std::string toString( const int& i ) const;
+  static const std::string toString( const int& i );
 
-  Alignable* theParentAlignable;
+  /// Index into the bookkeeping of the associated alignable, which is shared by all clones.
+  int theIndex;
 
-  int theNumberOfHits;
-  int theNumberOfUpdates;
-  int theUpdateFrequency;
+  /// The bookkeeping of all alignables, indexed by the order of construction.
+  static std::vector< Bookkeeping > theBookkeeping;
+  static std::vector< Evolution > theEvolution;
+  static std::unordered_map< const Alignable*, int > theIndexMap;
+  static std::atomic< unsigned long > theEpoch;
 
-  bool theFirstUpdate;
-  bool theAlignmentFlag;
+  static unsigned int theSnapshotBufferSize;
 
-  std::string theIdentifier;
-  std::string theTypeAndLayer;
+  static unsigned int theConvergenceWindow;
+  static double theConvergenceThreshold;
 
   static const TrackerAlignableId* theAlignableId;
   static const AlignableObjectId* theObjectId;
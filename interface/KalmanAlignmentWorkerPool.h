@@ -0,0 +1,61 @@
+#ifndef Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentWorkerPool_h
+#define Alignment_KalmanAlignmentAlgorithm_KalmanAlignmentWorkerPool_h
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// A fixed number of worker threads that are started once and reused for all jobs. A job is run
+/// on all workers at once, with the index of the worker as argument. Worker i fills the shard
+/// firstShard+i of the KalmanAlignmentDataCollector. The threads are started with the first job
+/// and stopped by the destructor. start() and wait() must be called from the same thread.
+
+class KalmanAlignmentWorkerPool
+{
+
+public:
+
+  typedef std::function< void( unsigned int ) > Job;
+
+  KalmanAlignmentWorkerPool( unsigned int nWorkers, unsigned int firstShard );
+
+  /// Waits for the running job and stops the workers.
+  ~KalmanAlignmentWorkerPool( void );
+
+  /// Start the job on all workers and return immediately. A previous job must have been waited for.
+  void start( const Job& job );
+
+  /// Wait until all workers are done with the job. Rethrows the first exception thrown by a worker.
+  void wait( void );
+
+  /// Run the job on all workers and wait until they are done.
+  inline void run( const Job& job ) { start( job ); wait(); }
+
+  inline unsigned int numberOfWorkers( void ) const { return theNumberOfWorkers; }
+
+private:
+
+  KalmanAlignmentWorkerPool( const KalmanAlignmentWorkerPool& ) = delete;
+  KalmanAlignmentWorkerPool& operator=( const KalmanAlignmentWorkerPool& ) = delete;
+
+  void runWorker( unsigned int iWorker );
+
+  unsigned int theNumberOfWorkers;
+  unsigned int theFirstShard;
+
+  std::vector< std::thread > theWorkers;
+  std::mutex theWorkMutex;
+  std::condition_variable theWorkCondition;
+  std::condition_variable theDoneCondition;
+  Job theJob;
+  unsigned long theJobNumber;
+  unsigned int theNumberOfRunningJobs;
+  bool theRunningFlag;
+  bool theStopFlag;
+  std::vector< std::exception_ptr > theJobExceptions;
+};
+
+#endif
@@ -5,6 +5,7 @@
 // includes for alignment
 #include "Alignment/CommonAlignment/interface/AlignableNavigator.h"
 #include "Alignment/CommonAlignment/interface/Utilities.h"
+#include "Alignment/CommonAlignmentAlgorithm/interface/AlignmentCorrelationsStore.h"
 #include "Alignment/CommonAlignmentAlgorithm/interface/AlignmentIORoot.h"
 #include "Alignment/CommonAlignmentAlgorithm/interface/AlignmentParameterSelector.h"
 
@@ -16,6 +17,9 @@
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentUserVariables.h"
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentDataCollector.h"
 #include "Alignment/KalmanAlignmentAlgorithm/interface/CurrentAlignmentKFUpdator.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentCheckpoint.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentTimer.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentWorkerPool.h"
 
 #include "Alignment/ReferenceTrajectories/interface/TrajectoryFactoryPlugin.h"
 
@@ -32,20 +36,50 @@
 
 #include "MagneticField/Records/interface/IdealMagneticFieldRecord.h" 
 
+#include "Geometry/Records/interface/TrackerDigiGeometryRecord.h"
+#include "Geometry/TrackerGeometryBuilder/interface/TrackerGeometry.h"
+
 #include "DataFormats/TrackingRecHit/interface/AlignmentPositionError.h"
 #include "DataFormats/BeamSpot/interface/BeamSpot.h"
+#include "DataFormats/DetId/interface/DetId.h"
 
 // miscellaneous includes
 #include "FWCore/Utilities/interface/Exception.h"
 #include "CLHEP/Random/RandGauss.h"
+#include "CLHEP/Random/Random.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <mutex>
+#include <thread>
 
 using namespace std;
 
 
 KalmanAlignmentAlgorithm::KalmanAlignmentAlgorithm( const edm::ParameterSet& config ) :
   AlignmentAlgorithmBase( config ),
-  theConfiguration( config )
+  theConfiguration( config ),
+  theNumberOfProcessedEvents( 0 ),
+  theCheckpointEvents( 0 ),
+  theCheckpointMinutes( 0. ),
+  theNumberOfEventsToSkip( 0 ),
+  theTrackletCacheFile( 0 ),
+  theAbortFlag( false ),
+  theMaxCachedTracklets( 0 ),
+  theNumberOfCachedTracklets( 0 ),
+  theTrackletCacheFull( false ),
+  theNumberOfPasses( 1 ),
+  theCovarianceRescaling( 1. ),
+  theConcurrentSetupsFlag( false ),
+  theSetupGroupWorkers( 0 ),
+  thePipelineDepth( 0 ),
+  theExactPipelineFlag( false ),
+  theNumberOfRepeatedRefits( 0 ),
+  thePipelineWorker( 0 )
 {}
 
 
@@ -70,12 +104,84 @@ void KalmanAlignmentAlgorithm::initialize( const edm::EventSetup& setup,
     theNavigator = new AlignableNavigator( tracker->components() );
     theSelector = new AlignmentParameterSelector( tracker );
 
-    theRefitter = new KalmanAlignmentTrackRefitter( theConfiguration.getParameter< edm::ParameterSet >( "TrackRefitter" ), theNavigator );
+    theRefitter = new KalmanAlignmentTrackRefitter( theConfiguration.getParameter< edm::ParameterSet >( "TrackRefitter" ),
+						   theNavigator, tracker->components() );
+
+    theConcurrentSetupsFlag = theConfiguration.getUntrackedParameter< bool >( "ConcurrentSetups", false );
+    thePipelineDepth = theConfiguration.getUntrackedParameter< unsigned int >( "PipelineDepth", 0 );
+    theExactPipelineFlag = theConfiguration.getUntrackedParameter< bool >( "ExactPipeline", false );
+
+    if ( theExactPipelineFlag && thePipelineDepth != 1 )
+      throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentAlgorithm::initialize] "
+					  << "ExactPipeline requires PipelineDepth = 1.";
+
+    // The pipelined refit fills the debug data of the shard after those of the refit threads.
+    if ( thePipelineDepth > 0 ) thePipelineWorker = new KalmanAlignmentWorkerPool( 1, theRefitter->numberOfThreads() );
 
     initializeAlignmentParameters( setup );
     initializeAlignmentSetups( setup );
 
+    // The start parameters and covariances, to be removed from the merged results of several jobs
+    // (see Merger.PriorFileName).
+    string startParametersFile = theConfiguration.getUntrackedParameter< string >( "StartParametersFile", "" );
+    if ( !startParametersFile.empty() )
+    {
+      vector< Alignable* > allAlignables;
+      vector< Alignable* > alignablesToWrite;
+      getComponents( theTracker, allAlignables );
+
+      for ( vector< Alignable* >::iterator it = allAlignables.begin(); it != allAlignables.end(); ++it )
+	if ( (*it)->alignmentParameters() &&
+	     dynamic_cast< KalmanAlignmentUserVariables* >( (*it)->alignmentParameters()->userVariables() ) )
+	  alignablesToWrite.push_back( *it );
+
+      cout << "[KalmanAlignmentAlgorithm::initialize] Write start parameters of "
+	   << alignablesToWrite.size() << " alignables to " << startParametersFile << endl;
+
+      AlignmentIORoot alignmentIO;
+      int ierr = 0;
+      alignmentIO.writeAlignmentParameters( alignablesToWrite, startParametersFile.c_str(), 1, false, ierr );
+      if ( ierr == -1 ) alignmentIO.writeAlignmentParameters( alignablesToWrite, startParametersFile.c_str(), -1, false, ierr );
+    }
+
     KalmanAlignmentDataCollector::configure( theConfiguration.getParameter< edm::ParameterSet >( "DataCollector" ) );
+    theRecHitsHistogram = KalmanAlignmentDataCollector::registerHistogram( "Trajectory_RecHits" );
+
+    theStartTime = std::chrono::steady_clock::now();
+
+    theCheckpointFile = theConfiguration.getUntrackedParameter< string >( "CheckpointFile", "" );
+    theCheckpointEvents = theConfiguration.getUntrackedParameter< unsigned int >( "CheckpointEvents", 0 );
+    theCheckpointMinutes = theConfiguration.getUntrackedParameter< double >( "CheckpointMinutes", 0. );
+    theLastCheckpoint = std::chrono::steady_clock::now();
+
+    theMaxCachedTracklets = theConfiguration.getUntrackedParameter< unsigned int >( "MaxCachedTracklets", 0 );
+    theNumberOfPasses = theConfiguration.getUntrackedParameter< unsigned int >( "NumberOfPasses", 1 );
+    theCovarianceRescaling = theConfiguration.getUntrackedParameter< double >( "CovarianceRescaling", 1. );
+
+    if ( theNumberOfPasses > 1 && theMaxCachedTracklets == 0 )
+      throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentAlgorithm::initialize] "
+					  << "NumberOfPasses > 1 requires the tracklet cache (MaxCachedTracklets > 0).";
+
+    if ( theCovarianceRescaling <= 0. )
+      throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentAlgorithm::initialize] "
+					  << "CovarianceRescaling must be positive.";
+
+    const bool resume = theConfiguration.getUntrackedParameter< bool >( "ResumeFromCheckpoint", false );
+
+    string trackletCacheFile = theConfiguration.getUntrackedParameter< string >( "TrackletCacheFile", "" );
+    if ( !trackletCacheFile.empty() )
+    {
+      const bool readMode = theConfiguration.getUntrackedParameter< bool >( "ReadTrackletCache", false );
+
+      // A resumed job would only write the events after the checkpoint.
+      if ( !readMode && resume && !theCheckpointFile.empty() )
+	throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentAlgorithm::initialize] "
+					    << "The tracklet cache cannot be written by a job that resumes from a checkpoint.";
+
+      theTrackletCacheFile = new KalmanAlignmentTrackletCache( trackletCacheFile, readMode );
+    }
+
+    if ( !theCheckpointFile.empty() && resume ) readCheckpoint();
   }
 }
 
@@ -89,12 +195,43 @@ void KalmanAlignmentAlgorithm::terminate( const edm::EventSetup& setup )
 
   cout << "[KalmanAlignmentAlgorithm::terminate] start ..." << endl;
 
+  // After an exception in run, the current state is written as it is.
+  if ( theAbortFlag )
+  {
+    cout << "[KalmanAlignmentAlgorithm::terminate] Job aborted, no further passes" << endl;
+  }
+  else
+  {
+    // Updates of the events that are still in the pipeline.
+    processPendingEvents( setup );
+
+    if ( theTrackletCacheFile && theTrackletCacheFile->readMode() ) processTrackletCacheFile( setup );
+
+    // Further passes over the cached tracklets, starting from the covariances of the previous pass
+    // scaled by CovarianceRescaling.
+    for ( unsigned int iPass = 1; iPass < theNumberOfPasses && !theTrackletCache.empty(); ++iPass )
+    {
+      cout << "[KalmanAlignmentAlgorithm::terminate] Pass " << iPass + 1 << " of " << theNumberOfPasses
+	   << " over " << theNumberOfCachedTracklets << " cached tracklet(s)" << endl;
+      rescaleCovariances( theCovarianceRescaling );
+      processCachedTracklets( setup );
+    }
+  }
+
+  // Final state of the monitoring file (before the updators are deleted).
+  updateMonitor();
+  KalmanAlignmentDataCollector::writeMonitorFile();
+
   set< Alignable* > allAlignables;
   vector< Alignable* > alignablesToWrite;
 
   AlignmentSetupCollection::const_iterator itSetup;
   for ( itSetup = theAlignmentSetups.begin(); itSetup != theAlignmentSetups.end(); ++itSetup )
   {
+    cout << "[KalmanAlignmentAlgorithm::terminate] The updator for setup \'" << (*itSetup)->id()
+	 << "\' processed " << (*itSetup)->alignmentUpdator()->numberOfProcessedTrajectories() << " trajectories, skipped "
+	 << (*itSetup)->alignmentUpdator()->numberOfSkippedTrajectories() << " (converged alignables only)" << endl;
+
     delete (*itSetup)->alignmentUpdator();
 
     const vector< Alignable* >& alignablesFromMetrics  = (*itSetup)->metricsUpdator()->alignables();
@@ -135,11 +272,36 @@ void KalmanAlignmentAlgorithm::terminate( const edm::EventSetup& setup )
     if ( ierr == -1 ) alignmentIO.writeAlignmentParameters( alignablesToWrite, output.c_str(), -1, false, ierr );
   }
 
+  string timingLogFile = theConfiguration.getUntrackedParameter< string >( "TimingLogFile", "" );
+  KalmanAlignmentTimer::write( timingLogFile );
+
   KalmanAlignmentDataCollector::write();
 
-  string timingLogFile = theConfiguration.getUntrackedParameter< string >( "TimingLogFile", "timing.log" );
-  cout << "The usage of TimingReport from Utilities/Timing! Timing not written to log file" << endl;
-  
+  cout << "[KalmanAlignmentAlgorithm::terminate] Refitted tracks of " << theRefitter->numberOfRefitCalls()
+       << " events using " << theRefitter->numberOfThreads() << " thread(s)" << endl;
+  if ( theExactPipelineFlag )
+    cout << "[KalmanAlignmentAlgorithm::terminate] Repeated the pipelined refit of " << theNumberOfRepeatedRefits
+	 << " events to include the updates of the previous event" << endl;
+  cout << "[KalmanAlignmentAlgorithm::terminate] Dropped " << theRefitter->numberOfDroppedHits()
+       << " hit(s) on dets without alignable" << endl;
+  if ( theRefitter->numberOfValidatedEvents() > 0 )
+    cout << "[KalmanAlignmentAlgorithm::terminate] Threaded refit compared to the sequential refit for "
+	 << theRefitter->numberOfValidatedEvents() << " events, mismatches: " << theRefitter->numberOfMismatches() << endl;
+  if ( theMaxCachedTracklets > 0 )
+    cout << "[KalmanAlignmentAlgorithm::terminate] Cached " << theNumberOfCachedTracklets << " tracklet(s) of "
+	 << theTrackletCache.size() << " events" << endl;
+  theTrackletCache.clear();
+
+  // Closes the on-disk tracklet cache.
+  delete theTrackletCacheFile;
+  theTrackletCacheFile = 0;
+
+  // Stops the refit and update threads.
+  delete thePipelineWorker;
+  thePipelineWorker = 0;
+  delete theSetupGroupWorkers;
+  theSetupGroupWorkers = 0;
+  delete theRefitter;
   delete theNavigator;
 
   cout << "[KalmanAlignmentAlgorithm::terminate] ... done." << endl;
@@ -150,62 +312,317 @@ void KalmanAlignmentAlgorithm::run( const edm::EventSetup & setup, const EventIn
 {
   if ( theMergerFlag ) return; // only merging mode. nothing to do here.
 
+  // The tracklets are read from the on-disk cache at the end of the job.
+  if ( theTrackletCacheFile && theTrackletCacheFile->readMode() ) return;
+
+  if ( theNumberOfEventsToSkip > 0 )
+  {
+    // Resumed from a checkpoint: skip the events that have already been processed.
+    --theNumberOfEventsToSkip;
+    return;
+  }
+
   static int iEvent = 1;
   if ( iEvent % 100 == 0 ) cout << "[KalmanAlignmentAlgorithm::run] Event Nr. " << iEvent << endl;
   iEvent++;
 
-  edm::ESHandle< MagneticField > aMagneticField;
-  setup.get< IdealMagneticFieldRecord >().get( aMagneticField );  
+  ++theNumberOfProcessedEvents;
+  if ( KalmanAlignmentDataCollector::monitorFileDue() )
+  {
+    updateMonitor();
+    KalmanAlignmentDataCollector::writeMonitorFile();
+  }
 
   try
   {
-    // Run the refitter algorithm
     const ConstTrajTrackPairCollection &tracks = eventInfo.trajTrackPairs_;
     const reco::BeamSpot &beamSpot = eventInfo.beamSpot_;
-    TrackletCollection refittedTracklets = theRefitter->refitTracks( setup, theAlignmentSetups, tracks, &beamSpot );
 
-    // Associate tracklets to alignment setups
-    map< AlignmentSetup*, TrackletCollection > setupToTrackletMap;
-    TrackletCollection::iterator itTracklet;
-    for ( itTracklet = refittedTracklets.begin(); itTracklet != refittedTracklets.end(); ++itTracklet )
-      setupToTrackletMap[(*itTracklet)->alignmentSetup()].push_back( *itTracklet );
+    if ( thePipelineDepth > 0 )
+    {
+      runPipelined( setup, tracks, beamSpot );
+    }
+    else
+    {
+      // Run the refitter algorithm
+      KalmanAlignmentTimer::Scope refitTimer( KalmanAlignmentTimer::Refit );
+      TrackletCollection refittedTracklets = theRefitter->refitTracks( setup, theAlignmentSetups, tracks, &beamSpot );
+      refitTimer.stop();
+
+      cacheTracklets( refittedTracklets, beamSpot );
+
+      processTracklets( setup, refittedTracklets, beamSpot );
+    }
+
+    // The checkpoint must not miss the updates of the pending events.
+    if ( checkpointDue() )
+    {
+      processPendingEvents( setup );
+      writeCheckpoint();
+    }
+  }
+  catch( cms::Exception& exception )
+  {
+    cout << exception.what() << endl;
+    thePendingEvents.clear();
+    theAbortFlag = true;
+    terminate(setup);
+    throw exception;
+  }
+}
+
+
+void KalmanAlignmentAlgorithm::runPipelined( const edm::EventSetup& setup,
+					     const ConstTrajTrackPairCollection& tracks,
+					     const reco::BeamSpot& beamSpot )
+{
+  // The refit reads the alignment parameters of the hit dets from a snapshot, taken before the
+  // updates of the oldest pending event start.
+  CurrentAlignmentKFUpdator::Snapshot snapshot;
+  ConstTrajTrackPairCollection::const_iterator itTrack;
+  for ( itTrack = tracks.begin(); itTrack != tracks.end(); ++itTrack )
+  {
+    Trajectory::ConstRecHitContainer hits = itTrack->first->recHits();
+    Trajectory::ConstRecHitContainer::const_iterator itHit;
+    for ( itHit = hits.begin(); itHit != hits.end(); ++itHit )
+      if ( (*itHit)->isValid() && (*itHit)->det() ) snapshot.add( theNavigator, (*itHit)->det() );
+  }
+
+  // Refit the tracks of this event on the pipeline thread ...
+  TrackletCollection refittedTracklets;
+  thePipelineWorker->start( [&]( unsigned int )
+  {
+    CurrentAlignmentKFUpdator::useSnapshot( &snapshot );
+    KalmanAlignmentTimer::Scope refitTimer( KalmanAlignmentTimer::Refit );
+    refittedTracklets = theRefitter->refitTracks( setup, theAlignmentSetups, tracks, &beamSpot );
+  } );
+
+  // ... while the updates of the oldest pending event run.
+  std::exception_ptr updateException;
+  try
+  {
+    if ( thePendingEvents.size() >= thePipelineDepth )
+    {
+      processTracklets( setup, thePendingEvents.front().tracklets, thePendingEvents.front().beamSpot );
+      thePendingEvents.pop_front();
+    }
+  }
+  catch(...) { updateException = std::current_exception(); }
+
+  // Rethrows the exception of the refit first.
+  thePipelineWorker->wait();
+  if ( updateException ) std::rethrow_exception( updateException );
+
+  // In the exact mode, the refit is repeated with the current alignment parameters if the updates
+  // of the previous event changed any of the parameters it has read from the snapshot.
+  if ( theExactPipelineFlag && !snapshot.upToDate() )
+  {
+    ++theNumberOfRepeatedRefits;
+    KalmanAlignmentTimer::Scope refitTimer( KalmanAlignmentTimer::Refit );
+    refittedTracklets = theRefitter->refitTracks( setup, theAlignmentSetups, tracks, &beamSpot );
+  }
+
+  cacheTracklets( refittedTracklets, beamSpot );
+
+  thePendingEvents.push_back( CachedEvent( refittedTracklets, beamSpot ) );
+}
+
+
+void KalmanAlignmentAlgorithm::processPendingEvents( const edm::EventSetup& setup )
+{
+  while ( !thePendingEvents.empty() )
+  {
+    processTracklets( setup, thePendingEvents.front().tracklets, thePendingEvents.front().beamSpot );
+    thePendingEvents.pop_front();
+  }
+}
+
+
+void KalmanAlignmentAlgorithm::processTracklets( const edm::EventSetup& setup,
+						 const TrackletCollection& tracklets,
+						 const reco::BeamSpot& beamSpot )
+{
+  edm::ESHandle< MagneticField > aMagneticField;
+  setup.get< IdealMagneticFieldRecord >().get( aMagneticField );  
+
+  // Associate tracklets to alignment setups
+  map< AlignmentSetup*, TrackletCollection > setupToTrackletMap;
+  TrackletCollection::const_iterator itTracklet;
+  for ( itTracklet = tracklets.begin(); itTracklet != tracklets.end(); ++itTracklet )
+    setupToTrackletMap[(*itTracklet)->alignmentSetup()].push_back( *itTracklet );
 
+  map< AlignmentSetup*, TrackletCollection >::iterator itMap;
+
+  if ( !theConcurrentSetupsFlag || theSetupGroups.size() < 2 || setupToTrackletMap.size() < 2 )
+  {
     // Iterate on alignment setups
-    map< AlignmentSetup*, TrackletCollection >::iterator itMap;
     for ( itMap = setupToTrackletMap.begin(); itMap != setupToTrackletMap.end(); ++itMap )
+      processSetupTracklets( setup, itMap->first, itMap->second, beamSpot, aMagneticField.product() );
+    return;
+  }
+
+  // The groups of setups update disjoint sets of alignables and are processed concurrently, each
+  // on its own worker. Within a group, the setups are processed in the same order as above, hence
+  // the results do not differ.
+  vector< bool > activeGroups( theSetupGroups.size(), false );
+  for ( itMap = setupToTrackletMap.begin(); itMap != setupToTrackletMap.end(); ++itMap )
+    activeGroups[theSetupGroupIndex.find( itMap->first )->second] = true;
+
+  theSetupGroupWorkers->run( [&]( unsigned int iGroup )
+  {
+    if ( !activeGroups[iGroup] ) return;
+
+    map< AlignmentSetup*, TrackletCollection >::iterator itGroup;
+    for ( itGroup = setupToTrackletMap.begin(); itGroup != setupToTrackletMap.end(); ++itGroup )
+      if ( theSetupGroupIndex.find( itGroup->first )->second == iGroup )
+	processSetupTracklets( setup, itGroup->first, itGroup->second, beamSpot, aMagneticField.product() );
+  } );
+}
+
+
+void KalmanAlignmentAlgorithm::processSetupTracklets( const edm::EventSetup& setup,
+						      AlignmentSetup* alignmentSetup,
+						      const TrackletCollection& tracklets,
+						      const reco::BeamSpot& beamSpot,
+						      const MagneticField* magneticField )
+{
+  ConstTrajTrackPairCollection trajTrackPairs;
+  ExternalPredictionCollection external;
+
+  TrackletCollection::const_iterator itTracklet;
+  for ( itTracklet = tracklets.begin(); itTracklet != tracklets.end(); ++itTracklet )
+  {
+    trajTrackPairs.push_back( (*itTracklet)->trajTrackPair() );
+    external.push_back( (*itTracklet)->externalPrediction() );
+  }
+
+  // Construct reference trajectories. The factories use the hit builder and the magnetic field,
+  // which are shared with the pipelined refit and the other groups of setups.
+  KalmanAlignmentTimer::Scope trajectoryTimer( KalmanAlignmentTimer::ReferenceTrajectories );
+  std::unique_lock< std::mutex > sharedServicesLock = theRefitter->lockSharedServices();
+  ReferenceTrajectoryCollection trajectories =
+    alignmentSetup->trajectoryFactory()->trajectories( setup, trajTrackPairs, external, beamSpot );
+  sharedServicesLock.unlock();
+  trajectoryTimer.stop();
+
+  ReferenceTrajectoryCollection::iterator itTrajectories;
+
+  // Run the alignment algorithm.
+  for ( itTrajectories = trajectories.begin(); itTrajectories != trajectories.end(); ++itTrajectories )
+  {
+    alignmentSetup->alignmentUpdator()->process( *itTrajectories, theParameterStore, theNavigator,
+						 alignmentSetup->metricsUpdator(), magneticField );
+
+    if ( KalmanAlignmentDataCollector::instrumented( KalmanAlignmentDataCollector::TrackQA ) )
+      KalmanAlignmentDataCollector::fillHistogram( theRecHitsHistogram, (*itTrajectories)->recHits().size() );
+  }
+}
+
+
+void KalmanAlignmentAlgorithm::cacheTracklets( const TrackletCollection& tracklets, const reco::BeamSpot& beamSpot )
+{
+  if ( theTrackletCacheFile && !theTrackletCacheFile->readMode() ) theTrackletCacheFile->write( tracklets, beamSpot );
+
+  if ( theMaxCachedTracklets == 0 || tracklets.empty() || theTrackletCacheFull ) return;
+
+  if ( theNumberOfCachedTracklets + tracklets.size() > theMaxCachedTracklets )
+  {
+    cout << "[KalmanAlignmentAlgorithm::cacheTracklets] Tracklet cache is full after " << theTrackletCache.size()
+	 << " events (" << theNumberOfCachedTracklets << " tracklets), caching stopped" << endl;
+    theTrackletCacheFull = true;
+    return;
+  }
+
+  // The tracklets own deep copies of the refitted trajectories and tracks, hence sharing the pointers
+  // keeps them alive beyond the current event.
+  theTrackletCache.push_back( CachedEvent( tracklets, beamSpot ) );
+  theNumberOfCachedTracklets += tracklets.size();
+}
+
+
+void KalmanAlignmentAlgorithm::processTrackletCacheFile( const edm::EventSetup& setup )
+{
+  edm::ESHandle< TrackerGeometry > aGeometry;
+  edm::ESHandle< MagneticField > aMagneticField;
+  setup.get< TrackerDigiGeometryRecord >().get( aGeometry );
+  setup.get< IdealMagneticFieldRecord >().get( aMagneticField );
+
+  TrackletCollection tracklets;
+  reco::BeamSpot beamSpot;
+  while ( theTrackletCacheFile->read( theAlignmentSetups, aGeometry.product(), aMagneticField.product(), tracklets, beamSpot ) )
+  {
+    ++theNumberOfProcessedEvents;
+    cacheTracklets( tracklets, beamSpot );
+    processTracklets( setup, tracklets, beamSpot );
+  }
+
+  cout << "[KalmanAlignmentAlgorithm::processTrackletCacheFile] Processed " << theTrackletCacheFile->numberOfTracklets()
+       << " tracklet(s) of " << theTrackletCacheFile->numberOfEvents() << " events from the tracklet cache" << endl;
+}
+
+
+void KalmanAlignmentAlgorithm::processCachedTracklets( const edm::EventSetup& setup )
+{
+  vector< CachedEvent >::const_iterator itEvent;
+  for ( itEvent = theTrackletCache.begin(); itEvent != theTrackletCache.end(); ++itEvent )
+    processTracklets( setup, itEvent->tracklets, itEvent->beamSpot );
+}
+
+
+void KalmanAlignmentAlgorithm::rescaleCovariances( double factor )
+{
+  if ( factor == 1. ) return;
+
+  const vector< Alignable* >& alignables = theParameterStore->alignables();
+  vector< Alignable* >::const_iterator itAlignable;
+  for ( itAlignable = alignables.begin(); itAlignable != alignables.end(); ++itAlignable )
+  {
+    AlignmentParameters* oldParameters = (*itAlignable)->alignmentParameters();
+    if ( !oldParameters ) continue;
+
+    AlgebraicSymMatrix covariance = factor*oldParameters->covariance();
+    (*itAlignable)->setAlignmentParameters( oldParameters->clone( oldParameters->parameters(), covariance ) );
+  }
+
+  // Scale the correlations accordingly. Only alignables related via the metrics can have been
+  // correlated by the updators.
+  AlignmentCorrelationsStore* correlationsStore = theParameterStore->correlationsStore();
+  set< pair< Alignable*, Alignable* > > scaled;
+
+  AlignmentSetupCollection::const_iterator itSetup;
+  for ( itSetup = theAlignmentSetups.begin(); itSetup != theAlignmentSetups.end(); ++itSetup )
+  {
+    const KalmanAlignmentMetricsUpdator* metricsUpdator = (*itSetup)->metricsUpdator();
+    const vector< Alignable* > metricsAlignables = metricsUpdator->alignables();
+
+    for ( itAlignable = metricsAlignables.begin(); itAlignable != metricsAlignables.end(); ++itAlignable )
     {
-      ConstTrajTrackPairCollection tracklets;
-      ExternalPredictionCollection external;
+      Alignable* first = *itAlignable;
+      if ( !first->alignmentParameters() ) continue;
 
-      TrackletCollection::iterator itTracklet;
-      for ( itTracklet = itMap->second.begin(); itTracklet != itMap->second.end(); ++itTracklet )
+      const vector< Alignable* > related = metricsUpdator->relatedAlignables( first );
+      vector< Alignable* >::const_iterator itOther;
+      for ( itOther = related.begin(); itOther != related.end(); ++itOther )
       {
-	tracklets.push_back( (*itTracklet)->trajTrackPair() );
-	external.push_back( (*itTracklet)->externalPrediction() );
-      }
+	Alignable* second = *itOther;
+	if ( second == first || !second->alignmentParameters() ) continue;
+	if ( !scaled.insert( make_pair( min( first, second ), max( first, second ) ) ).second ) continue;
+	if ( !correlationsStore->correlationsAvailable( first, second ) ) continue;
 
-      // Construct reference trajectories
-      ReferenceTrajectoryCollection trajectories =
-	itMap->first->trajectoryFactory()->trajectories( setup, tracklets, external, eventInfo.beamSpot_ );
+	const int nFirst = first->alignmentParameters()->numSelected();
+	const int nSecond = second->alignmentParameters()->numSelected();
 
-      ReferenceTrajectoryCollection::iterator itTrajectories;
+	AlgebraicSymMatrix covariance( nFirst + nSecond, 0 );
+	correlationsStore->correlations( first, second, covariance, 0, nFirst );
 
-      // Run the alignment algorithm.
-      for ( itTrajectories = trajectories.begin(); itTrajectories != trajectories.end(); ++itTrajectories )
-      {
-	itMap->first->alignmentUpdator()->process( *itTrajectories, theParameterStore, theNavigator,
-						   itMap->first->metricsUpdator(), aMagneticField.product() );
+	AlgebraicMatrix correlations( nFirst, nSecond );
+	for ( int i = 0; i < nFirst; ++i )
+	  for ( int j = 0; j < nSecond; ++j ) correlations[i][j] = factor*covariance[i][nFirst+j];
 
-	KalmanAlignmentDataCollector::fillHistogram( "Trajectory_RecHits", (*itTrajectories)->recHits().size() );
+	correlationsStore->setCorrelations( first, second, correlations );
       }
     }
   }
-  catch( cms::Exception& exception )
-  {
-    cout << exception.what() << endl;
-    terminate(setup);
-    throw exception;
-  }
 }
 
 
@@ -222,6 +639,9 @@ void KalmanAlignmentAlgorithm::initializeAlignmentParameters( const edm::EventSe
   const edm::ParameterSet initConfig = theConfiguration.getParameter< edm::ParameterSet >( "ParameterConfig" );
 
   int updateGraph = initConfig.getUntrackedParameter< int >( "UpdateGraphs", 100 );
+  KalmanAlignmentUserVariables::setSnapshotBufferSize( initConfig.getUntrackedParameter< unsigned int >( "SnapshotBufferSize", 64 ) );
+  KalmanAlignmentUserVariables::setConvergenceCriterion( initConfig.getUntrackedParameter< unsigned int >( "ConvergenceWindow", 0 ),
+							 initConfig.getUntrackedParameter< double >( "ConvergenceThreshold", 0.01 ) );
 
   bool addPositionError = false;// = initConfig.getUntrackedParameter< bool >( "AddPositionError", true );
 
@@ -503,6 +923,7 @@ void KalmanAlignmentAlgorithm::initializeAlignmentSetups( const edm::EventSetup&
 
   const edm::ParameterSet initConfig = theConfiguration.getParameter< edm::ParameterSet >( "AlgorithmConfig" );
   const vector<string> selSetup = initConfig.getParameter< vector<string> >( "Setups" );
+  vector< vector<int> > scopes;
 
   for ( vector<string>::const_iterator itSel = selSetup.begin(); itSel != selSetup.end(); ++itSel )
   {
@@ -520,6 +941,14 @@ void KalmanAlignmentAlgorithm::initializeAlignmentSetups( const edm::EventSetup&
     vector<int> externalIDs = confSetup.getParameter< vector<int> >( "External" );
     unsigned int minExternalHits = confSetup.getUntrackedParameter< unsigned int >( "MinExternalHits", 0 );
 
+    // The subdetectors whose alignables can be updated by this setup (see initializeSetupGroups).
+    vector<int> defaultScope( trackingIDs );
+    defaultScope.insert( defaultScope.end(), externalIDs.begin(), externalIDs.end() );
+    vector<int> scope = confSetup.getUntrackedParameter< vector<int> >( "Scope", defaultScope );
+
+    double minChi2Prob = confSetup.getUntrackedParameter< double >( "MinChi2Probability", 0. );
+    double maxChi2Prob = confSetup.getUntrackedParameter< double >( "MaxChi2Probability", 1. );
+
     edm::ESHandle< TrajectoryFitter > aTrajectoryFitter;
     string fitterName = confSetup.getUntrackedParameter< string >( "Fitter", "KFFittingSmoother" );
     setup.get<TrajectoryFitter::Record>().get( fitterName, aTrajectoryFitter );
@@ -594,14 +1023,16 @@ void KalmanAlignmentAlgorithm::initializeAlignmentSetups( const edm::EventSetup&
 
 	KalmanAlignmentSetup::SortingDirection sortingDir = getSortingDirection( strSortingDir );
 	KalmanAlignmentSetup::SortingDirection externalSortingDir = getSortingDirection( strExternalSortingDir );
+	string externalFitterId = fitterName + string( "_" ) + strExternalPropDir;
 
 	AlignmentSetup* anAlignmentSetup
 	  = new AlignmentSetup( *itSel,
 				fittingSmoother, fitter->propagator(), trackingIDs, minTrackingHits, sortingDir,
-				externalFittingSmoother, externalFitter->propagator(), externalIDs, minExternalHits, externalSortingDir,
-				trajectoryFactory, alignmentUpdator, metricsUpdator );
+				externalFittingSmoother, externalFitter->propagator(), externalIDs, minExternalHits, externalSortingDir, externalFitterId,
+				trajectoryFactory, alignmentUpdator, metricsUpdator, minChi2Prob, maxChi2Prob );
 
 	theAlignmentSetups.push_back( anAlignmentSetup );
+	scopes.push_back( scope );
 
 	delete fittingSmoother;
 	delete fitter;
@@ -628,6 +1059,97 @@ void KalmanAlignmentAlgorithm::initializeAlignmentSetups( const edm::EventSetup&
 
   cout << "[KalmanAlignmentAlgorithm::initializeAlignmentSetups] I'm using " << theAlignmentSetups.size() << " AlignmentSetup(s)." << endl;
 
+  initializeSetupGroups( scopes );
+}
+
+
+void KalmanAlignmentAlgorithm::initializeSetupGroups( const vector< vector<int> >& scopes )
+{
+  // Determine the alignables within the scope of each setup, i.e. those with at least one
+  // component in one of the subdetectors of the scope.
+  const vector< Alignable* >& alignables = theParameterStore->alignables();
+  vector< set< Alignable* > > setupAlignables( theAlignmentSetups.size() );
+
+  vector< Alignable* >::const_iterator itAlignable;
+  for ( itAlignable = alignables.begin(); itAlignable != alignables.end(); ++itAlignable )
+  {
+    vector< Alignable* > components;
+    getComponents( *itAlignable, components );
+
+    set< int > subdetIds;
+    vector< Alignable* >::const_iterator itComponent;
+    for ( itComponent = components.begin(); itComponent != components.end(); ++itComponent )
+      subdetIds.insert( DetId( (*itComponent)->id() ).subdetId() );
+
+    for ( unsigned int iSetup = 0; iSetup < theAlignmentSetups.size(); ++iSetup )
+    {
+      vector<int>::const_iterator itId;
+      for ( itId = scopes[iSetup].begin(); itId != scopes[iSetup].end(); ++itId )
+      {
+	if ( subdetIds.count( *itId ) )
+	{
+	  setupAlignables[iSetup].insert( *itAlignable );
+	  break;
+	}
+      }
+    }
+  }
+
+  // Setups with overlapping scopes (directly or via other setups) end up in the same group.
+  vector< unsigned int > group( theAlignmentSetups.size() );
+  for ( unsigned int iSetup = 0; iSetup < group.size(); ++iSetup ) group[iSetup] = iSetup;
+
+  for ( unsigned int iSetup = 0; iSetup < group.size(); ++iSetup )
+  {
+    for ( unsigned int jSetup = iSetup + 1; jSetup < group.size(); ++jSetup )
+    {
+      bool overlap = false;
+      set< Alignable* >::const_iterator itAli;
+      for ( itAli = setupAlignables[jSetup].begin(); itAli != setupAlignables[jSetup].end() && !overlap; ++itAli )
+	overlap = setupAlignables[iSetup].count( *itAli );
+      if ( !overlap ) continue;
+
+      unsigned int oldGroup = max( group[iSetup], group[jSetup] );
+      unsigned int newGroup = min( group[iSetup], group[jSetup] );
+      for ( unsigned int kSetup = 0; kSetup < group.size(); ++kSetup )
+	if ( group[kSetup] == oldGroup ) group[kSetup] = newGroup;
+    }
+  }
+
+  theSetupGroups.clear();
+  theSetupGroupIndex.clear();
+
+  map< unsigned int, unsigned int > groupIndex;
+  for ( unsigned int iSetup = 0; iSetup < theAlignmentSetups.size(); ++iSetup )
+  {
+    if ( !groupIndex.count( group[iSetup] ) )
+    {
+      groupIndex[group[iSetup]] = theSetupGroups.size();
+      theSetupGroups.push_back( AlignmentSetupCollection() );
+    }
+
+    theSetupGroups[groupIndex[group[iSetup]]].push_back( theAlignmentSetups[iSetup] );
+    theSetupGroupIndex[theAlignmentSetups[iSetup]] = groupIndex[group[iSetup]];
+  }
+
+  for ( unsigned int iGroup = 0; iGroup < theSetupGroups.size(); ++iGroup )
+  {
+    cout << "[KalmanAlignmentAlgorithm::initializeSetupGroups] Group " << iGroup << ":";
+    AlignmentSetupCollection::const_iterator itSetup;
+    for ( itSetup = theSetupGroups[iGroup].begin(); itSetup != theSetupGroups[iGroup].end(); ++itSetup )
+      cout << " " << (*itSetup)->id();
+    cout << endl;
+  }
+
+  if ( theConcurrentSetupsFlag && theSetupGroups.size() > 1 )
+  {
+    cout << "[KalmanAlignmentAlgorithm::initializeSetupGroups] Process " << theSetupGroups.size()
+	 << " groups of setups concurrently." << endl;
+
+    // The shards of the refitter threads and the pipelined refit come first.
+    delete theSetupGroupWorkers;
+    theSetupGroupWorkers = new KalmanAlignmentWorkerPool( theSetupGroups.size(), theRefitter->numberOfThreads() + 1 );
+  }
 }
 
 
@@ -697,58 +1219,192 @@ void KalmanAlignmentAlgorithm::mergeResults( void ) const
   bool applyPar = mergeConf.getParameter<bool>( "ApplyParameters" );
   bool applyCov = mergeConf.getParameter<bool>( "ApplyErrors" );
 
-  map< Alignable*, vector< AlignmentParameters* > > alignmentParametersMap;
+  bool weightedMerge = mergeConf.getUntrackedParameter<bool>( "WeightedMerge", true );
+  unsigned int readAhead = mergeConf.getUntrackedParameter<unsigned int>( "ReadAhead", 2 );
 
   vector< Alignable* > allAlignables;
   getComponents( theTracker, allAlignables );
 
   cout << "allAlignables.size() = " << allAlignables.size() << endl;
 
-  AlignmentIORoot alignmentIO;
+  // The start parameters and covariances of the jobs (the last iteration of the file, if any).
+  map< Alignable*, AlignmentParameters* > priorParametersMap;
+
+  // Deletes the start parameters when leaving, also if reading or merging throws.
+  struct PriorParametersGuard
+  {
+    ~PriorParametersGuard( void )
+    {
+      map< Alignable*, AlignmentParameters* >::iterator itPrior;
+      for ( itPrior = priors.begin(); itPrior != priors.end(); ++itPrior ) delete itPrior->second;
+    }
+    map< Alignable*, AlignmentParameters* >& priors;
+  } priorParametersGuard = { priorParametersMap };
 
-  for ( vector<string>::iterator itFile = inFileNames.begin(); itFile != inFileNames.end(); ++itFile )
+  string priorFileName = mergeConf.getUntrackedParameter<string>( "PriorFileName", "" );
+  if ( !priorFileName.empty() )
   {
+    AlignmentIORoot alignmentIO;
     int iter = 1;
     int ierr = 0;
 
     while ( !ierr )
     {
-      cout << "Read alignment parameters. file / iteration = " << *itFile << " / " << iter << endl;
-
       vector< AlignmentParameters* > alignmentParameters =
-	alignmentIO.readAlignmentParameters( allAlignables, (*itFile).c_str(), iter, ierr );
+	alignmentIO.readAlignmentParameters( allAlignables, priorFileName.c_str(), iter, ierr );
 
-      cout << "#param / ierr = " << alignmentParameters.size() << " / " << ierr << endl;
-      
       vector< AlignmentParameters* >::iterator itParam;
       for ( itParam = alignmentParameters.begin(); itParam != alignmentParameters.end(); ++itParam )
-	  alignmentParametersMap[(*itParam)->alignable()].push_back( *itParam );
+      {
+	AlignmentParameters*& prior = priorParametersMap[(*itParam)->alignable()];
+	delete prior;
+	prior = *itParam;
+      }
 
       ++iter;
     }
-  }
 
-  vector< Alignable* > alignablesToWrite;
-  alignablesToWrite.reserve( alignmentParametersMap.size() );
+    if ( priorParametersMap.empty() )
+      throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentAlgorithm::mergeResults] "
+					  << "No start parameters read from " << priorFileName;
 
-  map< Alignable*, vector< AlignmentParameters* > >::iterator itMap;
-  for ( itMap = alignmentParametersMap.begin(); itMap != alignmentParametersMap.end(); ++itMap )
+    cout << "Read the start parameters of " << priorParametersMap.size() << " alignables from " << priorFileName << endl;
+  }
+  else
   {
-    //cout << "merge param for alignable" << itMap->first << endl;
+    cout << "No start parameters given (PriorFileName), the weighted merge counts them once per input file" << endl;
+  }
 
-    AlgebraicVector mergedParam( 6, 0 );
-    AlgebraicSymMatrix mergedCov( 6, 0 );
-    int nMerge = 0;
+  // The parameters are merged on the fly, such that only running sums are kept per alignable.
+  // The map owns the first parameters read per alignable until the result is taken.
+  map< Alignable*, MergedParameters > mergedParametersMap;
 
-    vector< AlignmentParameters* >& vecParam = itMap->second;
+  auto merge = [&]( vector< AlignmentParameters* >& alignmentParameters )
+  {
     vector< AlignmentParameters* >::iterator itParam;
-    for ( itParam = vecParam.begin(); itParam != vecParam.end(); ++itParam, ++nMerge )
-      mergedParam += (*itParam)->parameters();
+    for ( itParam = alignmentParameters.begin(); itParam != alignmentParameters.end(); ++itParam )
+      mergedParametersMap[(*itParam)->alignable()].add( *itParam, weightedMerge );
+  };
+
+  // Read all iterations of all input files and pass them to 'consume'.
+  auto readInputFiles = [&]( const std::function< void ( vector< AlignmentParameters* >& ) >& consume )
+  {
+    AlignmentIORoot alignmentIO;
+
+    for ( vector<string>::iterator itFile = inFileNames.begin(); itFile != inFileNames.end(); ++itFile )
+    {
+      int iter = 1;
+      int ierr = 0;
+
+      while ( !ierr )
+      {
+	cout << "Read alignment parameters. file / iteration = " << *itFile << " / " << iter << endl;
+
+	vector< AlignmentParameters* > alignmentParameters =
+	  alignmentIO.readAlignmentParameters( allAlignables, (*itFile).c_str(), iter, ierr );
+
+	cout << "#param / ierr = " << alignmentParameters.size() << " / " << ierr << endl;
+
+	consume( alignmentParameters );
+
+	++iter;
+      }
+    }
+  };
+
+  if ( readAhead == 0 )
+  {
+    readInputFiles( merge );
+  }
+  else
+  {
+    // The input files are read on a separate thread (the only one using ROOT), while the parameters
+    // read so far are merged. At most 'ReadAhead' iterations are buffered.
+    deque< vector< AlignmentParameters* > > buffer;
+    std::mutex bufferMutex;
+    std::condition_variable bufferCondition;
+    bool readingDone = false;
+    bool stopReading = false;
+    std::exception_ptr readException;
+
+    std::thread reader( [&]()
+    {
+      try
+      {
+	readInputFiles( [&]( vector< AlignmentParameters* >& alignmentParameters )
+	{
+	  std::unique_lock< std::mutex > lock( bufferMutex );
+	  bufferCondition.wait( lock, [&]() { return buffer.size() < readAhead || stopReading; } );
+	  buffer.push_back( vector< AlignmentParameters* >() );
+	  buffer.back().swap( alignmentParameters );
+	  if ( stopReading ) throw cms::Exception( "LogicError" ) << "[KalmanAlignmentAlgorithm::mergeResults] merge aborted";
+	  bufferCondition.notify_all();
+	} );
+      }
+      catch(...) { readException = std::current_exception(); }
 
-    mergedParam /= nMerge;
+      std::lock_guard< std::mutex > lock( bufferMutex );
+      readingDone = true;
+      bufferCondition.notify_all();
+    } );
+
+    std::exception_ptr mergeException;
+
+    try
+    {
+      while ( true )
+      {
+	vector< AlignmentParameters* > alignmentParameters;
+	{
+	  std::unique_lock< std::mutex > lock( bufferMutex );
+	  bufferCondition.wait( lock, [&]() { return !buffer.empty() || readingDone; } );
+	  if ( buffer.empty() ) break;
+	  alignmentParameters.swap( buffer.front() );
+	  buffer.pop_front();
+	  bufferCondition.notify_all();
+	}
+	merge( alignmentParameters );
+      }
+    }
+    catch(...)
+    {
+      // Stop the reader before leaving, the thread must not be destroyed while joinable.
+      mergeException = std::current_exception();
+      std::lock_guard< std::mutex > lock( bufferMutex );
+      stopReading = true;
+      bufferCondition.notify_all();
+    }
+
+    reader.join();
+
+    if ( mergeException )
+    {
+      deque< vector< AlignmentParameters* > >::iterator itBuffer;
+      for ( itBuffer = buffer.begin(); itBuffer != buffer.end(); ++itBuffer )
+	for ( vector< AlignmentParameters* >::iterator itParam = itBuffer->begin(); itParam != itBuffer->end(); ++itParam )
+	  delete *itParam;
+      std::rethrow_exception( mergeException );
+    }
+
+    if ( readException ) std::rethrow_exception( readException );
+  }
+
+  vector< Alignable* > alignablesToWrite;
+  alignablesToWrite.reserve( mergedParametersMap.size() );
+
+  unsigned int nWeighted = 0;
+  unsigned int nPriorRemoved = 0;
+
+  map< Alignable*, MergedParameters >::iterator itMap;
+  for ( itMap = mergedParametersMap.begin(); itMap != mergedParametersMap.end(); ++itMap )
+  {
+    map< Alignable*, AlignmentParameters* >::const_iterator itPrior = priorParametersMap.find( itMap->first );
+    const AlignmentParameters* prior = ( itPrior != priorParametersMap.end() ) ? itPrior->second : 0;
+
+    AlignmentParameters* mergedAliParam = itMap->second.result( prior );
+    if ( itMap->second.merger.weighted() ) ++nWeighted;
+    if ( itMap->second.merger.priorRemoved() ) ++nPriorRemoved;
 
-    // no merging of errors up to now
-    AlignmentParameters* mergedAliParam = vecParam.front()->clone( mergedParam, mergedCov );
     itMap->first->setAlignmentParameters( mergedAliParam );
 
     alignablesToWrite.push_back( itMap->first );
@@ -756,8 +1412,11 @@ void KalmanAlignmentAlgorithm::mergeResults( void ) const
     if ( applyPar || applyCov ) applyAlignmentParameters( itMap->first, mergedAliParam, applyPar, applyCov );
   }
 
-  cout << "alignablesToWrite.size() = " << alignablesToWrite.size() << endl;
+  cout << "alignablesToWrite.size() = " << alignablesToWrite.size() << " (" << nWeighted
+       << " weighted with the inverse covariance, " << nPriorRemoved << " of them with the start parameters removed, "
+       << alignablesToWrite.size() - nWeighted << " with equal weights)" << endl;
 
+  AlignmentIORoot alignmentIO;
   int ierr = 0;
   // Write output to "iteration 1", ...
   alignmentIO.writeAlignmentParameters( alignablesToWrite, outFileName.c_str(), 1, false, ierr );
@@ -768,6 +1427,293 @@ void KalmanAlignmentAlgorithm::mergeResults( void ) const
 }
 
 
+KalmanAlignmentAlgorithm::MergedParameters::~MergedParameters( void )
+{
+  delete prototype;
+}
+
+
+void KalmanAlignmentAlgorithm::MergedParameters::add( AlignmentParameters* parameters, bool weightedMerge )
+{
+  // Parameters without invertible covariance make the alignable fall back to equal weights.
+  merger.add( parameters->parameters(), parameters->covariance(), weightedMerge );
+
+  if ( !prototype ) prototype = parameters;
+  else delete parameters;
+}
+
+
+AlignmentParameters* KalmanAlignmentAlgorithm::MergedParameters::result( const AlignmentParameters* prior )
+{
+  AlgebraicVector mergedParam;
+  AlgebraicSymMatrix mergedCov;
+
+  if ( prior ) merger.result( mergedParam, mergedCov, &prior->parameters(), &prior->covariance() );
+  else merger.result( mergedParam, mergedCov );
+
+  AlignmentParameters* mergedAliParam = prototype->clone( mergedParam, mergedCov );
+  delete prototype;
+  prototype = 0;
+
+  return mergedAliParam;
+}
+
+
+void KalmanAlignmentAlgorithm::updateMonitor( void )
+{
+  double elapsed = std::chrono::duration< double >( std::chrono::steady_clock::now() - theStartTime ).count();
+
+  unsigned long nTrajectories = 0;
+  unsigned long nRejected = 0;
+  unsigned long nSkipped = 0;
+  unsigned long nDistances = 0;
+
+  AlignmentSetupCollection::const_iterator itSetup;
+  for ( itSetup = theAlignmentSetups.begin(); itSetup != theAlignmentSetups.end(); ++itSetup )
+  {
+    nTrajectories += (*itSetup)->alignmentUpdator()->numberOfProcessedTrajectories();
+    nRejected += (*itSetup)->alignmentUpdator()->numberOfRejectedUpdates();
+    nSkipped += (*itSetup)->alignmentUpdator()->numberOfSkippedTrajectories();
+    nDistances += (*itSetup)->metricsUpdator()->nDistances();
+  }
+
+  KalmanAlignmentDataCollector::setMonitorValue( "kaa_events_total", theNumberOfProcessedEvents, "counter" );
+  KalmanAlignmentDataCollector::setMonitorValue( "kaa_events_per_second", ( elapsed > 0. ) ? theNumberOfProcessedEvents/elapsed : 0. );
+  KalmanAlignmentDataCollector::setMonitorValue( "kaa_trajectories_total", nTrajectories, "counter" );
+  KalmanAlignmentDataCollector::setMonitorValue( "kaa_rejected_updates_total", nRejected, "counter" );
+  KalmanAlignmentDataCollector::setMonitorValue( "kaa_skipped_trajectories_total", nSkipped, "counter" );
+  KalmanAlignmentDataCollector::setMonitorValue( "kaa_dropped_hits_total", theRefitter->numberOfDroppedHits(), "counter" );
+  KalmanAlignmentDataCollector::setMonitorValue( "kaa_store_correlations", theParameterStore->numCorrelations() );
+  KalmanAlignmentDataCollector::setMonitorValue( "kaa_metrics_distances", nDistances );
+}
+
+
+bool KalmanAlignmentAlgorithm::checkpointDue( void ) const
+{
+  if ( theCheckpointFile.empty() ) return false;
+
+  if ( theCheckpointEvents > 0 && theNumberOfProcessedEvents % theCheckpointEvents == 0 ) return true;
+
+  if ( theCheckpointMinutes > 0. )
+  {
+    double elapsed = std::chrono::duration< double >( std::chrono::steady_clock::now() - theLastCheckpoint ).count();
+    return ( elapsed >= 60.*theCheckpointMinutes );
+  }
+
+  return false;
+}
+
+
+void KalmanAlignmentAlgorithm::writeCheckpoint( void )
+{
+  const vector< Alignable* >& alignables = theParameterStore->alignables();
+  KalmanAlignmentCheckpoint checkpoint( alignables );
+
+  // Write to a temporary file first and rename it, such that a crash never leaves a partial checkpoint.
+  string tmpFileName = theCheckpointFile + string( ".tmp" );
+  ofstream out( tmpFileName.c_str(), ios::out | ios::binary | ios::trunc );
+  if ( !out )
+  {
+    cout << "[KalmanAlignmentAlgorithm::writeCheckpoint] Could not open " << tmpFileName << endl;
+    return;
+  }
+
+  KalmanAlignmentCheckpoint::writeHeader( out );
+  KalmanAlignmentCheckpoint::write( out, theNumberOfProcessedEvents );
+  KalmanAlignmentCheckpoint::write( out, CLHEP::HepRandom::getTheEngine()->put() );
+
+  // Alignment parameters and covariances.
+  KalmanAlignmentCheckpoint::write( out, static_cast< unsigned int >( alignables.size() ) );
+
+  vector< Alignable* >::const_iterator itAlignable;
+  for ( itAlignable = alignables.begin(); itAlignable != alignables.end(); ++itAlignable )
+  {
+    const AlignmentParameters* parameters = (*itAlignable)->alignmentParameters();
+
+    KalmanAlignmentCheckpoint::write( out, static_cast< unsigned int >( (*itAlignable)->id() ) );
+    KalmanAlignmentCheckpoint::write( out, ( parameters != 0 ) );
+
+    if ( parameters )
+    {
+      KalmanAlignmentCheckpoint::write( out, parameters->parameters() );
+      KalmanAlignmentCheckpoint::write( out, parameters->covariance() );
+    }
+  }
+
+  // Correlations. Only alignables related via the metrics can have been correlated by the updators
+  // (see rescaleCovariances), hence the candidates are the pairs related by the metrics of any setup.
+  AlignmentCorrelationsStore* correlationsStore = theParameterStore->correlationsStore();
+
+  vector< pair< int, int > > candidates;
+
+  AlignmentSetupCollection::const_iterator itSetup;
+  for ( itSetup = theAlignmentSetups.begin(); itSetup != theAlignmentSetups.end(); ++itSetup )
+  {
+    const vector< Alignable* > metricsAlignables = (*itSetup)->metricsUpdator()->alignables();
+    for ( itAlignable = metricsAlignables.begin(); itAlignable != metricsAlignables.end(); ++itAlignable )
+    {
+      int index = checkpoint.index( *itAlignable );
+      const vector< Alignable* > others = (*itSetup)->metricsUpdator()->relatedAlignables( *itAlignable );
+
+      vector< Alignable* >::const_iterator itOther;
+      for ( itOther = others.begin(); itOther != others.end(); ++itOther )
+      {
+	int otherIndex = checkpoint.index( *itOther );
+	if ( index >= 0 && otherIndex >= 0 && index != otherIndex )
+	  candidates.push_back( make_pair( min( index, otherIndex ), max( index, otherIndex ) ) );
+      }
+    }
+  }
+
+  sort( candidates.begin(), candidates.end() );
+  candidates.erase( unique( candidates.begin(), candidates.end() ), candidates.end() );
+
+  vector< pair< int, int > > correlated;
+  vector< pair< int, int > >::const_iterator itPair;
+  for ( itPair = candidates.begin(); itPair != candidates.end(); ++itPair )
+  {
+    Alignable* first = alignables[itPair->first];
+    Alignable* second = alignables[itPair->second];
+    if ( first->alignmentParameters() && second->alignmentParameters() &&
+	 correlationsStore->correlationsAvailable( first, second ) ) correlated.push_back( *itPair );
+  }
+
+  KalmanAlignmentCheckpoint::write( out, static_cast< unsigned int >( correlated.size() ) );
+  for ( itPair = correlated.begin(); itPair != correlated.end(); ++itPair )
+  {
+    Alignable* first = alignables[itPair->first];
+    Alignable* second = alignables[itPair->second];
+
+    const int nFirst = first->alignmentParameters()->numSelected();
+    const int nSecond = second->alignmentParameters()->numSelected();
+
+    AlgebraicSymMatrix covariance( nFirst + nSecond, 0 );
+    correlationsStore->correlations( first, second, covariance, 0, nFirst );
+
+    AlgebraicMatrix correlations( nFirst, nSecond );
+    for ( int i = 0; i < nFirst; ++i )
+      for ( int j = 0; j < nSecond; ++j ) correlations[i][j] = covariance[i][nFirst+j];
+
+    KalmanAlignmentCheckpoint::write( out, itPair->first );
+    KalmanAlignmentCheckpoint::write( out, itPair->second );
+    KalmanAlignmentCheckpoint::write( out, correlations );
+  }
+
+  KalmanAlignmentUserVariables::writeState( out, checkpoint );
+
+  for ( itSetup = theAlignmentSetups.begin(); itSetup != theAlignmentSetups.end(); ++itSetup )
+  {
+    (*itSetup)->alignmentUpdator()->writeState( out );
+    (*itSetup)->metricsUpdator()->writeState( out, checkpoint );
+  }
+
+  out.close();
+
+  if ( !out || rename( tmpFileName.c_str(), theCheckpointFile.c_str() ) != 0 )
+  {
+    cout << "[KalmanAlignmentAlgorithm::writeCheckpoint] Could not write " << theCheckpointFile << endl;
+    return;
+  }
+
+  cout << "[KalmanAlignmentAlgorithm::writeCheckpoint] Wrote checkpoint after " << theNumberOfProcessedEvents
+       << " events (" << correlated.size() << " correlations)" << endl;
+
+  theLastCheckpoint = std::chrono::steady_clock::now();
+}
+
+
+bool KalmanAlignmentAlgorithm::readCheckpoint( void )
+{
+  ifstream in( theCheckpointFile.c_str(), ios::in | ios::binary );
+  if ( !in )
+  {
+    cout << "[KalmanAlignmentAlgorithm::readCheckpoint] No checkpoint found at " << theCheckpointFile
+	 << ", starting from scratch" << endl;
+    return false;
+  }
+
+  if ( !KalmanAlignmentCheckpoint::readHeader( in ) )
+    throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentAlgorithm::readCheckpoint] "
+					<< theCheckpointFile << " is not a valid checkpoint file.";
+
+  const vector< Alignable* >& alignables = theParameterStore->alignables();
+  KalmanAlignmentCheckpoint checkpoint( alignables );
+
+  KalmanAlignmentCheckpoint::read( in, theNumberOfProcessedEvents );
+
+  vector< unsigned long > engineState;
+  KalmanAlignmentCheckpoint::read( in, engineState );
+  CLHEP::HepRandom::getTheEngine()->get( engineState );
+
+  unsigned int nAlignables = 0;
+  KalmanAlignmentCheckpoint::read( in, nAlignables );
+  if ( nAlignables != alignables.size() )
+    throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentAlgorithm::readCheckpoint] "
+					<< "Checkpoint holds " << nAlignables << " alignables, but " << alignables.size()
+					<< " are selected.";
+
+  for ( unsigned int index = 0; index < nAlignables; ++index )
+  {
+    unsigned int id = 0;
+    bool hasParameters = false;
+    KalmanAlignmentCheckpoint::read( in, id );
+    KalmanAlignmentCheckpoint::read( in, hasParameters );
+
+    if ( id != alignables[index]->id() )
+      throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentAlgorithm::readCheckpoint] "
+					  << "Alignable " << index << " has Id " << alignables[index]->id()
+					  << ", but " << id << " in the checkpoint.";
+
+    if ( !hasParameters ) continue;
+
+    AlgebraicVector parameters;
+    AlgebraicSymMatrix covariance;
+    KalmanAlignmentCheckpoint::read( in, parameters );
+    KalmanAlignmentCheckpoint::read( in, covariance );
+
+    AlignmentParameters* oldParameters = alignables[index]->alignmentParameters();
+    if ( oldParameters ) alignables[index]->setAlignmentParameters( oldParameters->clone( parameters, covariance ) );
+  }
+
+  AlignmentCorrelationsStore* correlationsStore = theParameterStore->correlationsStore();
+  correlationsStore->resetCorrelations();
+
+  unsigned int nCorrelations = 0;
+  KalmanAlignmentCheckpoint::read( in, nCorrelations );
+  for ( unsigned int iCorrelation = 0; iCorrelation < nCorrelations && in.good(); ++iCorrelation )
+  {
+    int first = -1;
+    int second = -1;
+    AlgebraicMatrix correlations;
+    KalmanAlignmentCheckpoint::read( in, first );
+    KalmanAlignmentCheckpoint::read( in, second );
+    KalmanAlignmentCheckpoint::read( in, correlations );
+
+    correlationsStore->setCorrelations( checkpoint.alignable( first ), checkpoint.alignable( second ), correlations );
+  }
+
+  KalmanAlignmentUserVariables::readState( in, checkpoint );
+
+  AlignmentSetupCollection::const_iterator itSetup;
+  for ( itSetup = theAlignmentSetups.begin(); itSetup != theAlignmentSetups.end(); ++itSetup )
+  {
+    (*itSetup)->alignmentUpdator()->readState( in );
+    (*itSetup)->metricsUpdator()->readState( in, checkpoint );
+  }
+
+  if ( !in )
+    throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentAlgorithm::readCheckpoint] "
+					<< theCheckpointFile << " is truncated.";
+
+  theNumberOfEventsToSkip = theNumberOfProcessedEvents;
+
+  cout << "[KalmanAlignmentAlgorithm::readCheckpoint] Resumed from checkpoint after " << theNumberOfProcessedEvents
+       << " events (" << nCorrelations << " correlations)" << endl;
+
+  return true;
+}
+
+
 void KalmanAlignmentAlgorithm::setAPEToZero( void )
 {
   AlignmentPositionError zeroAPE( 0., 0., 0. );
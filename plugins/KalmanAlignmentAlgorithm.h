@@ -5,9 +5,17 @@
 #include "Alignment/CommonAlignmentAlgorithm/interface/AlignmentAlgorithmBase.h"
 #include "Alignment/ReferenceTrajectories/interface/TrajectoryFactoryBase.h"
 
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentParameterMerger.h"
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentSetup.h"
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentTrackRefitter.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentTrackletCache.h"
 
+#include "DataFormats/BeamSpot/interface/BeamSpot.h"
+#include "DataFormats/CLHEP/interface/AlgebraicObjects.h"
+
+#include <chrono>
+#include <deque>
+#include <map>
 #include <set>
 
 /// The main class for the Kalman alignment algorithm. It is the stage on which all the protagonists
@@ -17,10 +25,11 @@
 
 class AlignableNavigator;
 class AlignmentParameterSelector;
+class AlignmentParameters;
+class KalmanAlignmentWorkerPool;
+class MagneticField;
 class TrajectoryFitter;
 
-namespace reco { class BeamSpot; }
-
 class KalmanAlignmentAlgorithm : public AlignmentAlgorithmBase
 {
 
@@ -60,16 +69,75 @@ private:
 
   void initializeAlignmentParameters( const edm::EventSetup& setup );
 
+  /// Build the reference trajectories for the refitted tracklets and pass them to the updators.
+  void processTracklets( const edm::EventSetup& setup, const TrackletCollection& tracklets, const reco::BeamSpot& beamSpot );
+
+  /// Build the reference trajectories for the tracklets of a single alignment setup and pass them to its updator.
+  void processSetupTracklets( const edm::EventSetup& setup,
+			      AlignmentSetup* alignmentSetup,
+			      const TrackletCollection& tracklets,
+			      const reco::BeamSpot& beamSpot,
+			      const MagneticField* magneticField );
+
+  /// Refit the tracks of the current event on a separate thread, reading the alignment parameters
+  /// from a snapshot, while the updates of the oldest pending event are computed. The refitted
+  /// tracklets are appended to the pending events. At most PipelineDepth events are pending, hence
+  /// the refit may miss the updates of up to PipelineDepth preceding events. In the exact mode
+  /// (PipelineDepth = 1), the refit is repeated if the updates changed any of the parameters read
+  /// from the snapshot, which gives the same results as the sequential processing.
+  void runPipelined( const edm::EventSetup& setup, const ConstTrajTrackPairCollection& tracks, const reco::BeamSpot& beamSpot );
+
+  /// Process all pending events of the pipeline.
+  void processPendingEvents( const edm::EventSetup& setup );
+
+  /// Keep the refitted tracklets of the current event in the tracklet cache (up to MaxCachedTracklets)
+  /// and append them to the on-disk tracklet cache (if written by this job).
+  void cacheTracklets( const TrackletCollection& tracklets, const reco::BeamSpot& beamSpot );
+
+  /// Process all events of the on-disk tracklet cache (if read by this job), instead of the events
+  /// given to run.
+  void processTrackletCacheFile( const edm::EventSetup& setup );
+
+  /// Rebuild the reference trajectories of all cached tracklets, i.e. re-linearise them around the
+  /// current alignment parameters, and pass them to the updators.
+  void processCachedTracklets( const edm::EventSetup& setup );
+
+  /// Scale the covariances of all alignment parameters and their correlations by a common factor.
+  void rescaleCovariances( double factor );
+
   void initializeAlignmentSetups( const edm::EventSetup& setup );
 
+  /// Group the alignment setups such that setups of different groups update disjoint sets of
+  /// alignables. The scope of a setup is given by a list of subdetector ids (parameter 'Scope',
+  /// default are the tracking and external subdetectors of the setup).
+  void initializeSetupGroups( const std::vector< std::vector<int> >& scopes );
+
   void applyAlignmentParameters( Alignable* ali, AlignmentParameters* par, bool applyPar, bool applyCov ) const;
 
   void getComponents( Alignable* ali, std::vector<Alignable*>& comps ) const;
 
+  /// Merge the alignment parameters of several jobs (see PSet 'Merger'). The parameters of each
+  /// alignable are weighted with their inverse covariance, or with equal weights if any of them
+  /// lacks an invertible covariance (see KalmanAlignmentParameterMerger). The start parameters
+  /// common to all jobs are removed if they are given by 'PriorFileName'. The input files are read
+  /// while merging and only running sums are kept per alignable.
   void mergeResults( void ) const;
 
   void setAPEToZero( void );
 
+  /// Pass the current progress counters to the monitoring file of the DataCollector.
+  void updateMonitor( void );
+
+  /// True if a checkpoint should be written after the current event.
+  bool checkpointDue( void ) const;
+
+  /// Write the state of the algorithm (alignment parameters, correlations, metrics, counters of the
+  /// user variables and updators, state of the random number engine) to the checkpoint file.
+  void writeCheckpoint( void );
+
+  /// Restore the state of the algorithm from the checkpoint file. Returns false if there is none.
+  bool readCheckpoint( void );
+
   inline const PropagationDirection getDirection( const std::string& dir ) const
     { return ( dir == "alongMomentum" ) ? alongMomentum : oppositeToMomentum; }
 
@@ -91,6 +159,71 @@ private:
   AlignableTracker* theTracker;
 
   bool theMergerFlag;
+
+  int theRecHitsHistogram;
+
+  unsigned long theNumberOfProcessedEvents;
+  std::chrono::steady_clock::time_point theStartTime;
+
+  std::string theCheckpointFile;
+  unsigned int theCheckpointEvents;
+  double theCheckpointMinutes;
+  std::chrono::steady_clock::time_point theLastCheckpoint;
+  unsigned long theNumberOfEventsToSkip;
+
+  /// Running sums of the merge of the alignment parameters of a single alignable.
+  struct MergedParameters
+  {
+    MergedParameters( void ) : prototype( 0 ) {}
+    MergedParameters( const MergedParameters& ) = delete;
+    MergedParameters& operator=( const MergedParameters& ) = delete;
+
+    /// Deletes the parameters if the result has not been taken, e.g. after an exception.
+    ~MergedParameters( void );
+
+    /// Add the parameters (the ownership is taken).
+    void add( AlignmentParameters* parameters, bool weightedMerge );
+
+    /// The merged parameters (owned by the caller). The start parameters and covariance common to
+    /// all inputs (optional) are removed from the weighted merge. Must be called only once.
+    AlignmentParameters* result( const AlignmentParameters* prior );
+
+    AlignmentParameters* prototype;
+    KalmanAlignmentParameterMerger merger;
+  };
+
+  /// The refitted tracklets of one event, kept for later processing.
+  struct CachedEvent
+  {
+    CachedEvent( const TrackletCollection& t, const reco::BeamSpot& b ) : tracklets( t ), beamSpot( b ) {}
+    TrackletCollection tracklets;
+    reco::BeamSpot beamSpot;
+  };
+
+  std::vector< CachedEvent > theTrackletCache;
+  KalmanAlignmentTrackletCache* theTrackletCacheFile;
+
+  /// Set if run failed, terminate then skips the further passes.
+  bool theAbortFlag;
+  unsigned int theMaxCachedTracklets;
+  unsigned int theNumberOfCachedTracklets;
+  bool theTrackletCacheFull;
+
+  unsigned int theNumberOfPasses;
+  double theCovarianceRescaling;
+
+  bool theConcurrentSetupsFlag;
+  std::vector< AlignmentSetupCollection > theSetupGroups;
+  std::map< AlignmentSetup*, unsigned int > theSetupGroupIndex;
+  /// One thread per group of setups, started once and reused for all events.
+  KalmanAlignmentWorkerPool* theSetupGroupWorkers;
+
+  unsigned int thePipelineDepth;
+  bool theExactPipelineFlag;
+  unsigned int theNumberOfRepeatedRefits;
+  std::deque< CachedEvent > thePendingEvents;
+  /// The thread for the pipelined refit, started once and reused for all events.
+  KalmanAlignmentWorkerPool* thePipelineWorker;
 };
 
 #endif
@@ -43,6 +43,17 @@ void MultiMetricsUpdator::update( const std::vector< Alignable* > & alignables )
 }
 
 
+unsigned int MultiMetricsUpdator::nDistances( void ) const
+{
+  unsigned int result = 0;
+
+  std::vector< SimpleMetricsUpdator* >::const_iterator it;
+  for ( it = theMetricsUpdators.begin(); it != theMetricsUpdators.end(); ++it ) result += (*it)->nDistances();
+
+  return result;
+}
+
+
 const std::vector< Alignable* >
 MultiMetricsUpdator::additionalAlignables( const std::vector< Alignable* > & alignables )
 {
@@ -79,4 +90,36 @@ MultiMetricsUpdator::alignables( void ) const
 }
 
 
+const std::vector< Alignable* >
+MultiMetricsUpdator::relatedAlignables( Alignable* alignable ) const
+{
+  std::set< Alignable* > alignableSet;
+
+  std::vector< SimpleMetricsUpdator* >::const_iterator it;
+  for ( it = theMetricsUpdators.begin(); it != theMetricsUpdators.end(); ++it )
+  {
+    const std::vector< Alignable* > related = (*it)->relatedAlignables( alignable );
+    alignableSet.insert( related.begin(), related.end() );
+  }
+
+  std::vector< Alignable* > result;
+  result.insert( result.end(), alignableSet.begin(), alignableSet.end() );
+  return result;
+}
+
+
+void MultiMetricsUpdator::writeState( std::ostream& out, const KalmanAlignmentCheckpoint& checkpoint ) const
+{
+  std::vector< SimpleMetricsUpdator* >::const_iterator it;
+  for ( it = theMetricsUpdators.begin(); it != theMetricsUpdators.end(); ++it ) (*it)->writeState( out, checkpoint );
+}
+
+
+void MultiMetricsUpdator::readState( std::istream& in, const KalmanAlignmentCheckpoint& checkpoint )
+{
+  std::vector< SimpleMetricsUpdator* >::const_iterator it;
+  for ( it = theMetricsUpdators.begin(); it != theMetricsUpdators.end(); ++it ) (*it)->readState( in, checkpoint );
+}
+
+
 DEFINE_EDM_PLUGIN( KalmanAlignmentMetricsUpdatorPlugin, MultiMetricsUpdator, "MultiMetricsUpdator" );
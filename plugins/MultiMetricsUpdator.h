@@ -23,6 +23,13 @@ public:
 
   virtual const std::vector< Alignable* > alignables( void ) const;
 
+  virtual unsigned int nDistances( void ) const;
+
+  virtual const std::vector< Alignable* > relatedAlignables( Alignable* alignable ) const;
+
+  virtual void writeState( std::ostream& out, const KalmanAlignmentCheckpoint& checkpoint ) const;
+  virtual void readState( std::istream& in, const KalmanAlignmentCheckpoint& checkpoint );
+
 private:
 
   std::vector<SimpleMetricsUpdator*> theMetricsUpdators;
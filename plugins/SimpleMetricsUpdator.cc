@@ -54,6 +54,21 @@ void SimpleMetricsUpdator::update( const std::vector< Alignable* > & alignables
 }
 
 
+const std::vector< Alignable* >
+SimpleMetricsUpdator::relatedAlignables( Alignable* alignable ) const
+{
+  const KalmanAlignmentMetricsCalculator::SingleDistancesList& distances = theMetricsCalculator.getDistances( alignable );
+
+  std::vector< Alignable* > result;
+  result.reserve( distances.size() );
+
+  KalmanAlignmentMetricsCalculator::SingleDistancesList::const_iterator itD;
+  for ( itD = distances.begin(); itD != distances.end(); ++itD ) result.push_back( itD->first );
+
+  return result;
+}
+
+
 const std::vector< Alignable* >
 SimpleMetricsUpdator::additionalAlignables( const std::vector< Alignable* > & alignables )
 {
@@ -24,6 +24,16 @@ public:
 
   virtual const std::vector< Alignable* > alignables( void ) const { return theMetricsCalculator.alignables(); }
 
+  virtual unsigned int nDistances( void ) const { return theMetricsCalculator.nDistances(); }
+
+  virtual const std::vector< Alignable* > relatedAlignables( Alignable* alignable ) const;
+
+  virtual void writeState( std::ostream& out, const KalmanAlignmentCheckpoint& checkpoint ) const
+    { theMetricsCalculator.writeState( out, checkpoint ); }
+
+  virtual void readState( std::istream& in, const KalmanAlignmentCheckpoint& checkpoint )
+    { theMetricsCalculator.readState( in, checkpoint ); }
+
 private:
 
   bool additionalSelectionCriterion( Alignable* const& referenceAli,
@@ -9,8 +9,11 @@
 #include "FWCore/Utilities/interface/Exception.h"
 
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentDataCollector.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentCheckpoint.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentTimer.h"
 
 #include <algorithm>
+#include <atomic>
 
 
 using namespace std;
@@ -27,6 +30,13 @@ SingleTrajectoryUpdator::SingleTrajectoryUpdator( const edm::ParameterSet & conf
   theNumberOfPreAlignmentEvts = config.getParameter< unsigned int >( "NumberOfPreAlignmentEvts" );
   theNumberOfProcessedEvts = 0;
 
+  // Trajectories that only hit converged alignables are skipped, except for every N-th (0 = skip all).
+  theSkipConvergedFlag = config.getUntrackedParameter< bool >( "SkipConvergedTrajectories", false );
+  theConvergedPrescale = config.getUntrackedParameter< unsigned int >( "ConvergedTrajectoryPrescale", 0 );
+  theNumberOfConvergedTrajectories = 0;
+
+  theCorrelationGraph = KalmanAlignmentDataCollector::registerGraph( "correlation_entries" );
+
   std::cout << "[SingleTrajectoryUpdator] Use " << theNumberOfPreAlignmentEvts << "events for pre-alignment" << std::endl;
 }
 
@@ -42,6 +52,8 @@ void SingleTrajectoryUpdator::process( const ReferenceTrajectoryPtr & trajectory
 {
   if ( !( *trajectory ).isValid() ) return;
 
+  ++theNumberOfProcessedTrajectories;
+
 //   std::cout << "[SingleTrajectoryUpdator::process] START" << std::endl;
 
   vector< AlignableDetOrUnitPtr > currentAlignableDets = navigator->alignablesFromHits( ( *trajectory ).recHits() );
@@ -50,20 +62,40 @@ void SingleTrajectoryUpdator::process( const ReferenceTrajectoryPtr & trajectory
   if ( nDifferentAlignables( currentAlignables ) < 2 ) return;
   if ( currentAlignables.size() < theMinNumberOfHits ) return;
 
+  if ( theSkipConvergedFlag && allConverged( currentAlignables ) )
+  {
+    ++theNumberOfConvergedTrajectories;
+    if ( theConvergedPrescale == 0 || theNumberOfConvergedTrajectories % theConvergedPrescale != 0 )
+    {
+      ++theNumberOfSkippedTrajectories;
+      return;
+    }
+  }
+
   ++theNumberOfProcessedEvts;
   bool includeCorrelations = ( theNumberOfPreAlignmentEvts < theNumberOfProcessedEvts );
   
+  KalmanAlignmentTimer::Scope metricsTimer( KalmanAlignmentTimer::MetricsUpdate );
   metrics->update( currentAlignables );
+  metricsTimer.stop();
 
+  KalmanAlignmentTimer::Scope additionalTimer( KalmanAlignmentTimer::AdditionalAlignables );
   vector< Alignable* > additionalAlignables;
   if ( includeCorrelations ) additionalAlignables = metrics->additionalAlignables( currentAlignables );
+  additionalTimer.stop();
 
   vector< Alignable* > allAlignables;
   allAlignables.reserve( currentAlignables.size() + additionalAlignables.size() );
   allAlignables.insert( allAlignables.end(), currentAlignables.begin(), currentAlignables.end() );
   allAlignables.insert( allAlignables.end(), additionalAlignables.begin(), additionalAlignables.end() );
 
+  std::unique_lock< std::mutex > storeLock( storeMutex() );
+  KalmanAlignmentTimer::Scope selectTimer( KalmanAlignmentTimer::SelectParameters );
   CompositeAlignmentParameters alignmentParameters = store->selectParameters( allAlignables );
+  selectTimer.stop();
+  storeLock.unlock();
+
+  KalmanAlignmentTimer::Scope gainTimer( KalmanAlignmentTimer::GainComputation );
 
   const AlgebraicVector& allAlignmentParameters = alignmentParameters.parameters();
   AlgebraicSymMatrix currentAlignmentCov = alignmentParameters.covarianceSubset( currentAlignables );
@@ -101,6 +133,7 @@ void SingleTrajectoryUpdator::process( const ReferenceTrajectoryPtr & trajectory
     if ( checkInversion != 0 )
     {
       cout << "[KalmanAlignment] WARNING: 'AlgebraicSymMatrix fullCov' not invertible." << endl;
+      ++theNumberOfRejectedUpdates;
       return;
     }
 
@@ -115,12 +148,14 @@ void SingleTrajectoryUpdator::process( const ReferenceTrajectoryPtr & trajectory
     if ( checkInversion != 0 )
     {
       cout << "[KalmanAlignment] WARNING: 'AlgebraicSymMatrix misalignedCov' not invertible." << endl;
+      ++theNumberOfRejectedUpdates;
       return;
     }
     AlgebraicSymMatrix weightMatrix1 = ( invMisalignedCov.similarityT( derivatives ) ).inverse( checkInversion );
     if ( checkInversion != 0 )
     {
       cout << "[KalmanAlignment] WARNING: 'AlgebraicSymMatrix weightMatrix1' not computed." << endl;
+      ++theNumberOfRejectedUpdates;
       return;
     }
     AlgebraicSymMatrix weightMatrix2 = weightMatrix1.similarity( invMisalignedCov*derivatives );
@@ -175,6 +210,8 @@ void SingleTrajectoryUpdator::process( const ReferenceTrajectoryPtr & trajectory
   }
 
 
+  gainTimer.stop();
+
   // update in alignment-interface
   CompositeAlignmentParameters* updatedParameters;
   updatedParameters = alignmentParameters.clone( updatedAlignmentParameters, updatedAlignmentCov );
@@ -184,10 +221,16 @@ void SingleTrajectoryUpdator::process( const ReferenceTrajectoryPtr & trajectory
     if ( includeCorrelations ) throw cms::Exception( "BadCovariance" );
 
     delete updatedParameters;
+    ++theNumberOfRejectedUpdates;
     return;
   }
 
+  storeLock.lock();
+  KalmanAlignmentTimer::Scope storeTimer( KalmanAlignmentTimer::StoreUpdate );
   store->updateParameters( *updatedParameters, includeCorrelations );
+  storeTimer.stop();
+  const int numCorrelations = store->numCorrelations();
+  storeLock.unlock();
   delete updatedParameters;
 
 
@@ -195,12 +238,15 @@ void SingleTrajectoryUpdator::process( const ReferenceTrajectoryPtr & trajectory
   //updateUserVariables( alignmentParameters.components() );
 
   //std::cout << "update user variables now" << std::endl;
+  KalmanAlignmentTimer::Scope userVariablesTimer( KalmanAlignmentTimer::UserVariablesUpdate );
   updateUserVariables( currentAlignables );
+  userVariablesTimer.stop();
   //std::cout << "done." << std::endl;
 
-  static int i = 0;
-  if ( i%100 == 0 ) KalmanAlignmentDataCollector::fillGraph( "correlation_entries", i, store->numCorrelations() );
-  ++i;
+  static std::atomic< int > nUpdates( 0 );
+  const int i = nUpdates++;
+  if ( i%100 == 0 && KalmanAlignmentDataCollector::instrumented( KalmanAlignmentDataCollector::AlignableEvolution ) )
+    KalmanAlignmentDataCollector::fillGraph( theCorrelationGraph, i, numCorrelations );
 
   //std::cout << "[SingleTrajectoryUpdator::process] DONE" << std::endl;
 
@@ -208,6 +254,22 @@ void SingleTrajectoryUpdator::process( const ReferenceTrajectoryPtr & trajectory
 }
 
 
+void SingleTrajectoryUpdator::writeState( std::ostream& out ) const
+{
+  KalmanAlignmentUpdator::writeState( out );
+  KalmanAlignmentCheckpoint::write( out, theNumberOfProcessedEvts );
+  KalmanAlignmentCheckpoint::write( out, theNumberOfConvergedTrajectories );
+}
+
+
+void SingleTrajectoryUpdator::readState( std::istream& in )
+{
+  KalmanAlignmentUpdator::readState( in );
+  KalmanAlignmentCheckpoint::read( in, theNumberOfProcessedEvts );
+  KalmanAlignmentCheckpoint::read( in, theNumberOfConvergedTrajectories );
+}
+
+
 bool SingleTrajectoryUpdator::checkCovariance( const AlgebraicSymMatrix& cov ) const
 {
   for ( int i = 0; i < cov.num_row(); ++i )
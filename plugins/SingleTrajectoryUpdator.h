@@ -29,6 +29,9 @@ public:
 
   virtual SingleTrajectoryUpdator* clone( void ) const { return new SingleTrajectoryUpdator( *this ); }
 
+  virtual void writeState( std::ostream& out ) const;
+  virtual void readState( std::istream& in );
+
 private:
 
   bool checkCovariance( const AlgebraicSymMatrix& cov ) const;
@@ -40,6 +43,12 @@ private:
 
   unsigned int theNumberOfPreAlignmentEvts;
   unsigned int theNumberOfProcessedEvts;
+
+  bool theSkipConvergedFlag;
+  unsigned int theConvergedPrescale;
+  unsigned long theNumberOfConvergedTrajectories;
+
+  int theCorrelationGraph;
 };
 
 
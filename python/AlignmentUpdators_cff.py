@@ -7,7 +7,11 @@ SingleTrajectoryUpdatorForPixels = cms.PSet(
     ExtraWeight = cms.double(1e-06),
     ExternalPredictionWeight = cms.double(10.0),
     CheckCovariance = cms.bool( False ),
-    NumberOfPreAlignmentEvts = cms.uint32(0)
+    NumberOfPreAlignmentEvts = cms.uint32(0),
+    # Skip trajectories that only hit converged alignables (see ConvergenceWindow in ParameterConfig),
+    # but process every N-th of them (0 = skip all).
+    SkipConvergedTrajectories = cms.untracked.bool( False ),
+    ConvergedTrajectoryPrescale = cms.untracked.uint32(0)
 )
 
 SingleTrajectoryUpdatorForStrips = cms.PSet(
@@ -17,7 +21,9 @@ SingleTrajectoryUpdatorForStrips = cms.PSet(
     ExtraWeight = cms.double(0.0001),
     ExternalPredictionWeight = cms.double(10.0),
     CheckCovariance = cms.bool( False ),
-    NumberOfPreAlignmentEvts = cms.uint32(0)
+    NumberOfPreAlignmentEvts = cms.uint32(0),
+    SkipConvergedTrajectories = cms.untracked.bool( False ),
+    ConvergedTrajectoryPrescale = cms.untracked.uint32(0)
 )
 
 DummyUpdator = cms.PSet(
@@ -10,8 +10,53 @@ KalmanAlignmentAlgorithm = cms.PSet(
 
     WriteAlignmentParameters = cms.untracked.bool( True ),
     OutputFile = cms.string( "output.root" ),
+    # File to which the start parameters and covariances are written after the initialization (empty =
+    # off), for the removal of the common start values from the merged results (Merger.PriorFileName).
+    StartParametersFile = cms.untracked.string( "" ),
 
-    TimingLogFile = cms.untracked.string( "timing.log" ),
+    # Text file with the timing of the stages of the algorithm (calls, mean and quantiles, empty = no
+    # file), written if the DataCollector instrumentation category 'Timing' is enabled. The timing is
+    # also stored in the ntuple 'Timing' of the DataCollector.
+    TimingLogFile = cms.untracked.string( "" ),
+
+    # Periodic checkpoints of the algorithm state (empty file name = off), written every
+    # CheckpointEvents events and/or CheckpointMinutes minutes (0 = never). With ResumeFromCheckpoint,
+    # the state is restored from the file (if it exists) and the events it covers are skipped.
+    CheckpointFile = cms.untracked.string( "" ),
+    CheckpointEvents = cms.untracked.uint32( 0 ),
+    CheckpointMinutes = cms.untracked.double( 0.0 ),
+    ResumeFromCheckpoint = cms.untracked.bool( False ),
+
+    # Keep the refitted tracklets of the processed events in memory (up to MaxCachedTracklets
+    # tracklets, 0 = off), such that their reference trajectories can be rebuilt later in the job.
+    MaxCachedTracklets = cms.untracked.uint32( 0 ),
+    # Number of passes over the data within the job. All passes after the first run over the cached
+    # tracklets, starting with the covariances of the previous pass scaled by CovarianceRescaling.
+    NumberOfPasses = cms.untracked.uint32( 1 ),
+    CovarianceRescaling = cms.untracked.double( 1.0 ),
+    # On-disk cache of the refitted tracklets (empty file name = off). A job writes the tracklets of
+    # all its events to the file. With ReadTrackletCache, a later job (e.g. the next KAPS iteration,
+    # with the new geometry) processes the tracklets of the file at the end of the job instead of the
+    # events given to it, hence it can run on an EmptySource without the track refit. Only valid hits
+    # on dets are cached, the trajectory factories must not use hits without det.
+    TrackletCacheFile = cms.untracked.string( "" ),
+    ReadTrackletCache = cms.untracked.bool( False ),
+
+    # Process alignment setups that update disjoint sets of alignables concurrently. The alignables
+    # of a setup are those within the subdetectors given by its (optional) parameter 'Scope', which
+    # defaults to the subdetectors of 'Tracking' and 'External'. The trajectory factories use the
+    # hit builder and the magnetic field, hence they are serialized as long as the TrackRefitter
+    # serializes the shared services; only the updates of the groups run concurrently.
+    ConcurrentSetups = cms.untracked.bool( False ),
+
+    # Refit the tracks of an event on a separate thread while the updates of a previous event are
+    # computed. The refit may then miss the updates of up to PipelineDepth preceding events
+    # (0 = no pipeline). With ExactPipeline (requires PipelineDepth = 1), the refit is repeated if
+    # the updates changed any of the alignment parameters it used, such that the results are the
+    # same as without pipeline. The trajectory factories of the updates and the refit share the
+    # lock of the TrackRefitter for the hit builder and the magnetic field (SerializeSharedServices).
+    PipelineDepth = cms.untracked.uint32( 0 ),
+    ExactPipeline = cms.untracked.bool( False ),
 
     TrackRefitter = cms.PSet(
         src = cms.string( "" ),
@@ -20,6 +65,18 @@ KalmanAlignmentAlgorithm = cms.PSet(
         TTRHBuilder = cms.string( "WithoutRefit" ),
         AlgorithmName = cms.string( "undefAlgorithm" ),
         debug = cms.untracked.bool( True ),
+        # Number of threads for the track refit. NOTE: With SerializeSharedServices, the hit building,
+        # propagation and fit of a tracklet run under one lock, since all of them use the magnetic
+        # field (the pixel CPE as well). Only the hit selection and sorting and the bookkeeping run
+        # concurrently, hence more than one thread currently gives no significant speedup. The refit
+        # only scales with thread-safe services and SerializeSharedServices = False, check the
+        # scaling and the equivalence with test/refit-scaling.sh before using it.
+        NumberOfThreads = cms.untracked.uint32( 1 ),
+        # Serialize the calls of the threads that use the hit builder and the magnetic field. Only
+        # switch off if these services are known to be thread-safe.
+        SerializeSharedServices = cms.untracked.bool( True ),
+        # Refit every event sequentially as well and compare it to the threaded refit (slow).
+        ValidateThreadedRefit = cms.untracked.bool( False ),
         Propagator = cms.string( "AnalyticalPropagator" )
     ),
 
@@ -27,6 +84,19 @@ KalmanAlignmentAlgorithm = cms.PSet(
         XMin = cms.untracked.double(-20.0),
         NBins = cms.untracked.int32(400),
         XMax = cms.untracked.double(20.0),
+        # Binning for histograms whose names start with 'Name' (NBins, XMin, XMax).
+        HistogramBinning = cms.untracked.VPSet(),
+        StoreRawHistogramData = cms.untracked.bool( False ),
+        # Spill graphs and ntuples to a temporary file every N points per thread (0 = never).
+        SpillBufferSize = cms.untracked.uint32( 0 ),
+        SpillDirectory = cms.untracked.string( "" ),
+        # Sampling of graphs, selected by shell pattern (Pattern, Policy = EveryNth/Reservoir/LTTB, N).
+        GraphSampling = cms.untracked.VPSet(),
+        # Enabled instrumentation categories (TrackQA, AlignableEvolution, Timing).
+        Instrumentation = cms.untracked.vstring( "TrackQA", "AlignableEvolution", "Timing" ),
+        # Monitoring file in the Prometheus text format (empty = off), rewritten every MonitorInterval seconds.
+        MonitorFileName = cms.untracked.string( "" ),
+        MonitorInterval = cms.untracked.double( 30.0 ),
         FileName = cms.untracked.string( "debug.root" )
     ),
 
@@ -36,7 +106,18 @@ KalmanAlignmentAlgorithm = cms.PSet(
 	OutputMergeFileName = cms.string( "kaaMerged.root" ),
 
 	ApplyParameters = cms.bool( False ),
-	ApplyErrors = cms.bool( False )
+	ApplyErrors = cms.bool( False ),
+
+	# Weight the parameters with their inverse covariance (equal weights for alignables
+	# without invertible covariance, with the covariance of the mean). The input is read
+	# ReadAhead iterations ahead by one prefetch thread (0 = no separate thread).
+	WeightedMerge = cms.untracked.bool( True ),
+	ReadAhead = cms.untracked.uint32( 2 ),
+	# Start parameters common to all input jobs (written with StartParametersFile). They are
+	# removed N-1 times from the weighted merge of N inputs. Empty = no removal, then the
+	# start values are counted N times, i.e. the merged covariance is too small and the
+	# parameters are biased towards the start values.
+	PriorFileName = cms.untracked.string( "" )
     )
 )
 
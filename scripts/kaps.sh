@@ -57,6 +57,17 @@ function alignment_run
     #clean_up
 }
 
+function tree_merge
+{
+    echo "[tree_merge] using the following parameters"
+    echo "  template config = " $1
+    echo "  merge directory = " $2
+    echo "  number of jobs = " $3
+    echo "  storage directory = " $4
+    echo "  files per merge = " $5
+    kaps_treemerge.pl -l -k $5 $1 $2 $3 $4
+}
+
 function fetch_output
 {
     rm $1/kaaOutput*.root
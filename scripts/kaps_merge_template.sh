@@ -29,6 +29,15 @@ echo Running directory changed to $(pwd).
 # Execute. The cfg file name will be overwritten by MPS
 time cmsRun merge_cfg.py
 
+# Merge the DataCollector output of all jobs. hadd reads the files object by object,
+# so the memory does not grow with the number of jobs.
+DEBUGFILES=()
+DEBUGFILES=($DEBUGFILES $RUNDIR/../jobISN/kaaDebugISN.root)
+DEBUGFILES=(${^DEBUGFILES}(N))
+if [ ${#DEBUGFILES} -gt 0 ]; then
+  time hadd -f kaaDebugMerged.root $DEBUGFILES
+fi
+
 echo "\nDirectory content after running cmsRun"
 ls -lh
 # Copy everything you need to MPS directory of your job,
@@ -36,3 +45,6 @@ ls -lh
 
 cp -p alignment.log $RUNDIR
 cp -p kaaMerged.root $MSSDIR
+if [ -f kaaDebugMerged.root ]; then
+  cp -p kaaDebugMerged.root $RUNDIR
+fi
@@ -9,7 +9,9 @@
 #
 #  Usage:
 #
-#  kaps_retry.pl [job sequence numbers | jobstates]
+#  kaps_retry.pl [-c] [job sequence numbers | jobstates]
+#
+#  -c: resume the jobs from their last checkpoint (see CheckpointFile)
 #
 
 BEGIN {
@@ -23,6 +25,7 @@ use Kapslib;
 $refresh = "no";
 $retryMerge = 0;
 $force = 0;
+$resume = 0;
 
 # parse the arguments
 while (@ARGV) {
@@ -48,6 +51,10 @@ while (@ARGV) {
     elsif ($arg =~ "f") {
       $force = 1;
     }
+    elsif ($arg =~ "c") {
+      $resume = 1;
+      print "option sets resume to $resume\n";
+    }
     $optionstring = "$optionstring$arg";
   }
   else {                # parameters not related to options
@@ -128,6 +135,14 @@ sub reSchedule() {
     print "kaps_script.pl $batchScript  jobData/$theJobDir/theScript.sh $theJobData/$theJobDir the_cfg.py jobData/$theJobDir/theSplit $theIsn\n";
     system "kaps_script.pl $batchScript  jobData/$theJobDir/theScript.sh $theJobData/$theJobDir the_cfg.py jobData/$theJobDir/theSplit $theIsn";
   }
+  if ($resume == 1) {
+    # let the job continue from its last checkpoint instead of reprocessing its whole input
+    $theCfg = "jobData/@JOBDIR[$_[0]]/the_cfg.py";
+    open CFGFILE,">>$theCfg";
+    print CFGFILE "\nprocess.AlignmentProducer.algoConfig.ResumeFromCheckpoint = cms.untracked.bool( True )\n";
+    close CFGFILE;
+    print "Resume @JOBDIR[$_[0]] from its last checkpoint\n";
+  }
   print "ReSchedule @JOBDIR[$_[0]]\n";
 }
 
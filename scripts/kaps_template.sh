@@ -10,6 +10,10 @@
 RUNDIR=rundir
 MSSDIR=mssdir
 
+# The job directory survives the job: the cfg may use it for checkpoints, e.g.
+# CheckpointFile = cms.untracked.string( os.environ["RUNDIR"] + "/kaaCheckpoint.bin" )
+export RUNDIR
+
 MSSDIRPOOL=cmscaf
 export STAGE_SVCCLASS=$MSSDIRPOOL
 
@@ -0,0 +1,214 @@
+#!/usr/bin/env perl
+#
+#  This script is part of the Kalman Alignment Production System (KAPS).
+#
+#  Merge the output of many jobs in a tree reduction instead of a single
+#  merge job: in each stage, groups of (at most) groupSize files are merged
+#  by independent cmsRun processes, until a single file is left. Each merge
+#  is done in its own directory below mergeDir. The last stage writes
+#  mergeDir/kaaMerged.root and applies the parameters/errors as requested
+#  by the cfg, the intermediate stages write partial results only.
+#
+#  The partial results are ordinary merge outputs holding the combined
+#  covariance. The tree merge requires the (default) weighted merge, since
+#  the number of files behind a partial result is not stored. The weighted
+#  merge of the alignables with invertible covariances equals merging all
+#  files at once. If the start parameters of the jobs are given
+#  (Merger.PriorFileName, written by the jobs with StartParametersFile),
+#  each merge removes the common prior, such that it enters the final
+#  result once. Without them, the prior is counted once per file, as in a
+#  single merge. Alignables that fall back to equal weights (input without
+#  invertible covariance) are averaged per group, the group means are then
+#  weighted with the covariance of the mean, not by their number of files.
+#
+#  The stages are written to the driver script mergeDir/treemerge.sh, which
+#  runs the merges of a stage with up to nProc local processes. It can be
+#  run on any multi-core machine or within a batch job. With -l, it is run
+#  right away.
+#
+#  Usage:
+#
+#  kaps_treemerge.pl [-c] [-l] [-k groupSize] [-j nProc] inCfg mergeDir njobs mssDir
+#
+
+BEGIN {
+use File::Basename;
+unshift(@INC, dirname($0)."/kapslib");
+}
+use Kapslib;
+use POSIX;
+use Cwd 'abs_path';
+
+$inCfg = "undefined";
+$mergeDir = "undefined";
+$nJobs = "undefined";
+$mssDir = "undefined";
+$groupSize = 10;
+$nProc = `nproc 2>/dev/null`;
+chomp($nProc);
+if ($nProc < 1) { $nProc = 1; }
+
+# parse the arguments
+while (@ARGV) {
+  $arg = shift(@ARGV);
+  if ($arg =~ /\A-/) {  # check for option
+    if ($arg eq "-k") {
+      $groupSize = shift(@ARGV);
+    }
+    elsif ($arg eq "-j") {
+      $nProc = shift(@ARGV);
+    }
+    elsif ($arg =~ "h") {
+      $helpwanted = 1;
+    }
+    elsif ($arg =~ "c") {
+# Check which jobs are "OK" and merge just them
+      $checkok = 1;
+    }
+    elsif ($arg =~ "l") {
+# Run the merge on the local machine right away
+      $runLocal = 1;
+    }
+  }
+  else {                # parameters not related to options
+    $i = $i + 1;
+    if ($i eq 1) {
+      $inCfg = $arg;
+    }
+    elsif ($i eq 2) {
+      $mergeDir = $arg;
+    }
+    elsif ($i eq 3) {
+      $nJobs = $arg;
+    }
+    elsif ($i eq 4) {
+      $mssDir = $arg;
+    }
+  }
+}
+
+if ($helpwanted == 1 || $mssDir eq "undefined") {
+  print "Usage:\n  kaps_treemerge.pl [-c] [-l] [-k groupSize] [-j nProc] inCfg mergeDir njobs mssDir\n";
+  exit 1;
+}
+
+if ($groupSize < 2) {
+  print "kaps_treemerge.pl: the group size must be at least 2\n";
+  exit 1;
+}
+
+if ($checkok == 1) {
+  read_db();
+}
+
+unless (-d $mergeDir) {
+  system "mkdir -p $mergeDir";
+}
+
+# the merges run in their own directories, hence all paths must be absolute
+$mergeDir = abs_path($mergeDir);
+if (-d $mssDir) { $mssDir = abs_path($mssDir); }
+
+# create the cfg of a single merge job, the stages only override its input and output
+$baseCfg = "$mergeDir/treemerge_base_cfg.py";
+system "kaps_merge.pl $inCfg $baseCfg $mergeDir $nJobs $mssDir";
+unless (-r $baseCfg) {
+  print "kaps_treemerge.pl: kaps_merge.pl did not create $baseCfg\n";
+  exit 1;
+}
+
+open INFILE,"$baseCfg";
+undef $/;  # undefining the INPUT-RECORD_SEPARATOR means slurp whole file
+$body = <INFILE>;  # read whole file
+close INFILE;
+$/ = "\n"; # back to normal
+
+# the partial results do not hold the number of merged files, equal weights would be wrong
+if ($body =~ /WeightedMerge\s*=\s*cms\.untracked\.bool\(\s*False\s*\)/) {
+  print "kaps_treemerge.pl: the tree merge requires Merger.WeightedMerge = True, use kaps_merge.pl instead\n";
+  exit 1;
+}
+unless ($body =~ /PriorFileName\s*=\s*cms\.untracked\.string\(\s*"[^"]+"\s*\)/) {
+  print "kaps_treemerge.pl: warning, no Merger.PriorFileName given, the prior is counted once per file\n";
+}
+
+# list of input files
+@inputs = ();
+for ($i=1; $i<=$nJobs; ++$i) {
+  if ($checkok==1 && @JOBSTATUS[$i-1] ne "OK") {next;}
+  push @inputs, sprintf "$mssDir/kaaOutput%03d.root",$i;
+}
+
+if (@inputs == 0) {
+  print "kaps_treemerge.pl: no input files\n";
+  exit 1;
+}
+
+$driver = "#!/bin/zsh\n#\n# Tree merge of " . scalar(@inputs) . " files, generated by kaps_treemerge.pl.\n#\n";
+$driver = $driver . "NPROC=\${NPROC:-$nProc}\nset -e\n";
+
+$stage = 0;
+do {
+  $stage = $stage + 1;
+  $nGroups = ceil(@inputs/$groupSize);
+  $lastStage = ($nGroups == 1);
+
+  @outputs = ();
+  @groupDirs = ();
+
+  for ($group=1; $group<=$nGroups; ++$group) {
+    $groupDir = sprintf "$mergeDir/stage%d/group%03d",$stage,$group;
+    system "mkdir -p $groupDir";
+
+    @groupInputs = splice(@inputs, 0, $groupSize);
+    $output = $lastStage ? "$mergeDir/kaaMerged.root" : "$groupDir/kaaPartial.root";
+
+    $mergerFiles = join(",\n        ", map { "\"$_\"" } @groupInputs);
+
+    $cfg = $body;
+    $cfg = $cfg . "\n# tree merge, stage $stage, group $group\n";
+    $cfg = $cfg . "process.AlignmentProducer.algoConfig.Merger.InputMergeFileNames = cms.vstring(\n        $mergerFiles )\n";
+    $cfg = $cfg . "process.AlignmentProducer.algoConfig.Merger.OutputMergeFileName = cms.string( \"$output\" )\n";
+    $cfg = $cfg . "process.AlignmentProducer.algoConfig.Merger.WeightedMerge = cms.untracked.bool( True )\n";
+    unless ($lastStage) {
+      # partial results are neither applied nor stored in the database
+      $cfg = $cfg . "process.AlignmentProducer.algoConfig.Merger.ApplyParameters = cms.bool( False )\n";
+      $cfg = $cfg . "process.AlignmentProducer.algoConfig.Merger.ApplyErrors = cms.bool( False )\n";
+      $cfg = $cfg . "process.AlignmentProducer.saveToDB = cms.bool( False )\n";
+    }
+
+    open OUTFILE,">$groupDir/merge_cfg.py";
+    print OUTFILE $cfg;
+    close OUTFILE;
+
+    push @outputs, $output;
+    push @groupDirs, $groupDir;
+  }
+
+  print "Stage $stage: $nGroups merge job(s)\n";
+
+  # run the merges of the stage in parallel, the next stage starts when all are done
+  $driver = $driver . "\necho \"Stage $stage: $nGroups merge job(s) at \$(date)\"\n";
+  $driver = $driver . "rm -f " . join(" ", @outputs) . "\n";
+  $driver = $driver . "printf '%s\\n' \\\n  " . join(" \\\n  ", @groupDirs) . " | \\\n";
+  $driver = $driver . "  xargs -P \$NPROC -I{} zsh -c 'cd {} && cmsRun merge_cfg.py > merge.log 2>&1 || { echo \"Merge failed in {}\"; exit 1; }'\n";
+
+  @inputs = @outputs;
+} while (@inputs > 1);
+
+$driver = $driver . "\necho \"Tree merge done at \$(date)\"\n";
+
+open OUTFILE,">$mergeDir/treemerge.sh";
+print OUTFILE $driver;
+close OUTFILE;
+system "chmod a+x $mergeDir/treemerge.sh";
+
+print "Wrote $mergeDir/treemerge.sh ($stage stage(s), group size $groupSize)\n";
+
+if ($runLocal == 1) {
+  $status = system "NPROC=$nProc $mergeDir/treemerge.sh";
+  if ($status != 0) {
+    print "kaps_treemerge.pl: tree merge failed\n";
+    exit 1;
+  }
+}
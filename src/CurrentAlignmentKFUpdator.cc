@@ -8,6 +8,9 @@
 #include "TrackingTools/TransientTrackingRecHit/interface/TransientTrackingRecHit.h"
 
 
+thread_local const CurrentAlignmentKFUpdator::Snapshot* CurrentAlignmentKFUpdator::theSnapshot = 0;
+
+
 TrajectoryStateOnSurface CurrentAlignmentKFUpdator::update( const TrajectoryStateOnSurface & tsos,
 							    const TransientTrackingRecHit & aRecHit ) const 
 {
@@ -119,7 +122,14 @@ void CurrentAlignmentKFUpdator::includeCurrentAlignmentEstimate( const Transient
 }
 
 
-AlignmentParameters* CurrentAlignmentKFUpdator::getAlignmentParameters( const AlignableDetOrUnitPtr alignableDet ) const
+AlignmentParameters* CurrentAlignmentKFUpdator::getAlignmentParameters( const AlignableDetOrUnitPtr alignableDet )
+{
+  if ( theSnapshot ) return theSnapshot->parameters( alignableDet );
+  return getCurrentParameters( alignableDet );
+}
+
+
+AlignmentParameters* CurrentAlignmentKFUpdator::getCurrentParameters( const Alignable* alignableDet )
 {
   // Get alignment parameters from AlignableDet ...
   AlignmentParameters* alignmentParameters = alignableDet->alignmentParameters();
@@ -129,7 +139,7 @@ AlignmentParameters* CurrentAlignmentKFUpdator::getAlignmentParameters( const Al
 }
 
 
-AlignmentParameters* CurrentAlignmentKFUpdator::getHigherLevelParameters( const Alignable* aAlignable ) const
+AlignmentParameters* CurrentAlignmentKFUpdator::getHigherLevelParameters( const Alignable* aAlignable )
 {
   Alignable* higherLevelAlignable = aAlignable->mother();
   // Alignable has no mother ... most probably the alignable is already the full tracker.
@@ -138,3 +148,70 @@ AlignmentParameters* CurrentAlignmentKFUpdator::getHigherLevelParameters( const
   // Found alignment parameters? If not, go one level higher in the hierarchy.
   return higherLevelParameters ? higherLevelParameters : getHigherLevelParameters( higherLevelAlignable );
 }
+
+
+void CurrentAlignmentKFUpdator::Snapshot::add( AlignableNavigator* navigator, const GeomDet* det )
+{
+  AlignableDetOrUnitPtr alignableDet = navigator->alignableFromGeomDet( det );
+  if ( alignableDet.isNull() || theParameters.count( alignableDet ) ) return;
+
+  AlignmentParameters* alignmentParameters = getCurrentParameters( alignableDet );
+  if ( alignmentParameters )
+  {
+    // AlignableDets with the same higher level alignable share the copy.
+    AlignmentParameters*& copy = theCopies[alignmentParameters];
+    if ( !copy ) copy = alignmentParameters->clone( alignmentParameters->parameters(), alignmentParameters->covariance() );
+    alignmentParameters = copy;
+  }
+
+  theParameters[alignableDet] = alignmentParameters;
+}
+
+
+AlignmentParameters* CurrentAlignmentKFUpdator::Snapshot::parameters( const Alignable* alignableDet ) const
+{
+  std::map< const Alignable*, AlignmentParameters* >::const_iterator itParameters = theParameters.find( alignableDet );
+  return ( itParameters != theParameters.end() ) ? itParameters->second : 0;
+}
+
+
+bool CurrentAlignmentKFUpdator::Snapshot::upToDate( void ) const
+{
+  std::map< const Alignable*, AlignmentParameters* >::const_iterator itParameters;
+  for ( itParameters = theParameters.begin(); itParameters != theParameters.end(); ++itParameters )
+  {
+    const AlignmentParameters* copy = itParameters->second;
+    const AlignmentParameters* current = getCurrentParameters( itParameters->first );
+
+    if ( !copy || !current )
+    {
+      if ( copy != current ) return false;
+      continue;
+    }
+
+    const AlgebraicVector& copyParameters = copy->parameters();
+    const AlgebraicVector& currentParameters = current->parameters();
+    if ( copyParameters.num_row() != currentParameters.num_row() ) return false;
+    for ( int i = 0; i < copyParameters.num_row(); ++i )
+      if ( copyParameters[i] != currentParameters[i] ) return false;
+
+    const AlgebraicSymMatrix& copyCovariance = copy->covariance();
+    const AlgebraicSymMatrix& currentCovariance = current->covariance();
+    if ( copyCovariance.num_row() != currentCovariance.num_row() ) return false;
+    for ( int i = 0; i < copyCovariance.num_row(); ++i )
+      for ( int j = 0; j <= i; ++j )
+	if ( copyCovariance[i][j] != currentCovariance[i][j] ) return false;
+  }
+
+  return true;
+}
+
+
+void CurrentAlignmentKFUpdator::Snapshot::clear( void )
+{
+  std::map< const AlignmentParameters*, AlignmentParameters* >::iterator itCopy;
+  for ( itCopy = theCopies.begin(); itCopy != theCopies.end(); ++itCopy ) delete itCopy->second;
+
+  theCopies.clear();
+  theParameters.clear();
+}
@@ -0,0 +1,102 @@
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentCheckpoint.h"
+
+#include <cstring>
+
+using namespace std;
+
+// Identifies checkpoint files. Increase the version if the layout of the file changes.
+static const char theMagicWord[8] = { 'K', 'A', 'A', 'C', 'K', 'P', 'T', '1' };
+
+
+KalmanAlignmentCheckpoint::KalmanAlignmentCheckpoint( const vector< Alignable* >& alignables ) :
+  theAlignables( alignables )
+{
+  for ( unsigned int i = 0; i < theAlignables.size(); ++i ) theIndices[theAlignables[i]] = i;
+}
+
+
+int KalmanAlignmentCheckpoint::index( Alignable* alignable ) const
+{
+  map< Alignable*, int >::const_iterator itIndex = theIndices.find( alignable );
+  return ( itIndex == theIndices.end() ) ? -1 : itIndex->second;
+}
+
+
+Alignable* KalmanAlignmentCheckpoint::alignable( int index ) const
+{
+  return ( index < 0 || index >= static_cast< int >( theAlignables.size() ) ) ? 0 : theAlignables[index];
+}
+
+
+void KalmanAlignmentCheckpoint::writeHeader( ostream& out )
+{
+  out.write( theMagicWord, sizeof( theMagicWord ) );
+}
+
+
+bool KalmanAlignmentCheckpoint::readHeader( istream& in )
+{
+  char magicWord[sizeof( theMagicWord )];
+  in.read( magicWord, sizeof( magicWord ) );
+  return ( in.good() && memcmp( magicWord, theMagicWord, sizeof( theMagicWord ) ) == 0 );
+}
+
+
+void KalmanAlignmentCheckpoint::write( ostream& out, const AlgebraicVector& vector )
+{
+  const int nRow = vector.num_row();
+  write( out, nRow );
+  for ( int i = 0; i < nRow; ++i ) write( out, vector[i] );
+}
+
+
+void KalmanAlignmentCheckpoint::write( ostream& out, const AlgebraicSymMatrix& matrix )
+{
+  const int nRow = matrix.num_row();
+  write( out, nRow );
+  for ( int i = 0; i < nRow; ++i )
+    for ( int j = 0; j <= i; ++j ) write( out, matrix[i][j] );
+}
+
+
+void KalmanAlignmentCheckpoint::write( ostream& out, const AlgebraicMatrix& matrix )
+{
+  const int nRow = matrix.num_row();
+  const int nCol = matrix.num_col();
+  write( out, nRow );
+  write( out, nCol );
+  for ( int i = 0; i < nRow; ++i )
+    for ( int j = 0; j < nCol; ++j ) write( out, matrix[i][j] );
+}
+
+
+void KalmanAlignmentCheckpoint::read( istream& in, AlgebraicVector& vector )
+{
+  int nRow = 0;
+  read( in, nRow );
+  vector = AlgebraicVector( nRow );
+  for ( int i = 0; i < nRow; ++i ) read( in, vector[i] );
+}
+
+
+void KalmanAlignmentCheckpoint::read( istream& in, AlgebraicSymMatrix& matrix )
+{
+  int nRow = 0;
+  read( in, nRow );
+  matrix = AlgebraicSymMatrix( nRow );
+  for ( int i = 0; i < nRow; ++i )
+    for ( int j = 0; j <= i; ++j ) read( in, matrix[i][j] );
+}
+
+
+void KalmanAlignmentCheckpoint::read( istream& in, AlgebraicMatrix& matrix )
+{
+  int nRow = 0;
+  int nCol = 0;
+  read( in, nRow );
+  read( in, nCol );
+  matrix = AlgebraicMatrix( nRow, nCol );
+  for ( int i = 0; i < nRow; ++i )
+    for ( int j = 0; j < nCol; ++j ) read( in, matrix[i][j] );
+}
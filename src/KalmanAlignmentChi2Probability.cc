@@ -0,0 +1,44 @@
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentChi2Probability.h"
+
+#include "TMath.h"
+
+#include <limits>
+
+
+KalmanAlignmentChi2Probability::KalmanAlignmentChi2Probability( double minProb, double maxProb, unsigned int maxCachedNdof ) :
+  theMinProb( minProb ),
+  theMaxProb( maxProb ),
+  theFullWindowFlag( ( minProb <= 0. ) && ( maxProb >= 1. ) )
+{
+  if ( theFullWindowFlag ) return;
+
+  theMinChi2.reserve( maxCachedNdof + 1 );
+  theMaxChi2.reserve( maxCachedNdof + 1 );
+
+  for ( unsigned int ndof = 0; ndof <= maxCachedNdof; ++ndof )
+  {
+    theMinChi2.push_back( minChi2( ndof ) );
+    theMaxChi2.push_back( maxChi2( ndof ) );
+  }
+}
+
+
+double KalmanAlignmentChi2Probability::minChi2( unsigned int ndof ) const
+{
+  if ( theMaxProb >= 1. || ndof == 0 ) return 0.;
+  if ( theMaxProb <= 0. ) return std::numeric_limits< double >::max();
+
+  // prob( chi2 ) > maxProb <==> cdf( chi2 ) < 1 - maxProb
+  return TMath::ChisquareQuantile( 1. - theMaxProb, ndof );
+}
+
+
+double KalmanAlignmentChi2Probability::maxChi2( unsigned int ndof ) const
+{
+  if ( theMinProb <= 0. || ndof == 0 ) return std::numeric_limits< double >::max();
+  if ( theMinProb >= 1. ) return 0.;
+
+  // prob( chi2 ) < minProb <==> cdf( chi2 ) > 1 - minProb
+  return TMath::ChisquareQuantile( 1. - theMinProb, ndof );
+}
@@ -1,24 +1,63 @@
 
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentDataCollector.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentSampling.h"
+
+#include "FWCore/Utilities/interface/Exception.h"
 
 #include "TGraph.h"
 #include "TNtuple.h"
 #include "TFile.h"
+#include "TH1D.h"
 #include "TH1F.h"
+#include "TTree.h"
+
+#include <mutex>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fnmatch.h>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
 
 using namespace std;
 
 
 KalmanAlignmentDataCollector* KalmanAlignmentDataCollector::theDataCollector = new KalmanAlignmentDataCollector();
 
+thread_local KalmanAlignmentDataCollector::Shard* KalmanAlignmentDataCollector::theLocalShard = 0;
+
+unsigned int KalmanAlignmentDataCollector::theInstrumentation = TrackQA | AlignableEvolution | Timing;
 
-KalmanAlignmentDataCollector::KalmanAlignmentDataCollector( void ) {}
+// Protects the registry of names and the list of shards. The shards themselves are filled
+// without locking.
+static std::mutex theDataCollectorMutex;
 
 
-KalmanAlignmentDataCollector::KalmanAlignmentDataCollector( const edm::ParameterSet & config ) : theConfiguration( config ) {}
+KalmanAlignmentDataCollector::KalmanAlignmentDataCollector( void ) :
+  theRawHistoDataFlag( false ),
+  theSpillBufferSize( 0 ),
+  theMonitorInterval( 30. )
+{}
 
 
-KalmanAlignmentDataCollector::~KalmanAlignmentDataCollector() {}
+KalmanAlignmentDataCollector::KalmanAlignmentDataCollector( const edm::ParameterSet & config ) :
+  theRawHistoDataFlag( false ),
+  theSpillBufferSize( 0 ),
+  theMonitorInterval( 30. )
+{
+  this->config( config );
+}
+
+
+KalmanAlignmentDataCollector::~KalmanAlignmentDataCollector()
+{
+  vector< Shard* >::iterator itShard;
+  for ( itShard = theShards.begin(); itShard != theShards.end(); ++itShard ) delete *itShard;
+
+  map< unsigned int, Shard* >::iterator itSelected;
+  for ( itSelected = theSelectedShards.begin(); itSelected != theSelectedShards.end(); ++itSelected ) delete itSelected->second;
+}
 
 
 KalmanAlignmentDataCollector* KalmanAlignmentDataCollector::get( void )
@@ -35,6 +74,20 @@ void KalmanAlignmentDataCollector::configure( const edm::ParameterSet & config )
 }
 
 
+int KalmanAlignmentDataCollector::registerHistogram( const string& histo_name )
+{
+  std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+  return theDataCollector->histogramHandle( histo_name );
+}
+
+
+int KalmanAlignmentDataCollector::registerGraph( const string& graph_name )
+{
+  std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+  return theDataCollector->graphHandle( graph_name );
+}
+
+
 void KalmanAlignmentDataCollector::fillHistogram( string histo_name, float data )
 {
   //if ( !theDataCollector ) theDataCollector = new KalmanAlignmentDataCollector();
@@ -49,6 +102,12 @@ void KalmanAlignmentDataCollector::fillHistogram( string histo_name, int histo_n
 }
 
 
+void KalmanAlignmentDataCollector::fillHistogram( int histo_handle, float data )
+{
+  theDataCollector->fillTH1F( histo_handle, data );
+}
+
+
 void KalmanAlignmentDataCollector::fillGraph( string graph_name, float x_data, float y_data )
 {
   //if ( !theDataCollector ) theDataCollector = new KalmanAlignmentDataCollector();
@@ -63,6 +122,12 @@ void KalmanAlignmentDataCollector::fillGraph( string graph_name, int graph_numbe
 }
 
 
+void KalmanAlignmentDataCollector::fillGraph( int graph_handle, float x_data, float y_data )
+{
+  theDataCollector->fillTGraph( graph_handle, x_data, y_data );
+}
+
+
 void KalmanAlignmentDataCollector::fillNtuple( std::string ntuple_name, float data )
 {
   //if ( !theDataCollector ) theDataCollector = new KalmanAlignmentDataCollector();
@@ -70,6 +135,46 @@ void KalmanAlignmentDataCollector::fillNtuple( std::string ntuple_name, float da
 }
 
 
+int KalmanAlignmentDataCollector::registerNtuple( const string& ntuple_name, const vector< string >& columns )
+{
+  std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+
+  map< string, int >& handles = theDataCollector->theColumnNtupleHandles;
+  vector< vector< string > >& registeredColumns = theDataCollector->theColumnNtupleColumns;
+
+  map< string, int >::iterator itHandle = handles.find( ntuple_name );
+  if ( itHandle != handles.end() )
+  {
+    if ( registeredColumns[itHandle->second] != columns )
+      throw cms::Exception( "LogicError" ) << "[KalmanAlignmentDataCollector::registerNtuple] "
+					   << "Ntuple " << ntuple_name << " has already been registered with other columns.";
+    return itHandle->second;
+  }
+
+  if ( columns.empty() )
+    throw cms::Exception( "LogicError" ) << "[KalmanAlignmentDataCollector::registerNtuple] "
+					 << "Ntuple " << ntuple_name << " has no columns.";
+
+  int handle = registeredColumns.size();
+  registeredColumns.push_back( columns );
+  handles[ntuple_name] = handle;
+
+  return handle;
+}
+
+
+void KalmanAlignmentDataCollector::fillNtuple( int ntuple_handle, const float* row )
+{
+  theDataCollector->fillTNtuple( ntuple_handle, row );
+}
+
+
+void KalmanAlignmentDataCollector::fillNtuple( int ntuple_handle, const vector< float >& row )
+{
+  theDataCollector->fillTNtuple( ntuple_handle, row.empty() ? 0 : &row[0], row.size() );
+}
+
+
 void KalmanAlignmentDataCollector::write( void )
 {
   //if ( !theDataCollector ) theDataCollector = new KalmanAlignmentDataCollector();
@@ -90,24 +195,231 @@ void KalmanAlignmentDataCollector::clear( void )
 }
 
 
+bool KalmanAlignmentDataCollector::monitorFileDue( void )
+{
+  if ( theDataCollector->theMonitorFileName.empty() ) return false;
+
+  double elapsed = std::chrono::duration< double >( std::chrono::steady_clock::now() - theDataCollector->theLastMonitorWrite ).count();
+  return ( elapsed >= theDataCollector->theMonitorInterval );
+}
+
+
+void KalmanAlignmentDataCollector::setMonitorValue( const string& name, double value, const string& type )
+{
+  std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+  theDataCollector->theMonitorValues[name] = make_pair( type, value );
+}
+
+
+void KalmanAlignmentDataCollector::writeMonitorFile( void )
+{
+  const string& fileName = theDataCollector->theMonitorFileName;
+  if ( fileName.empty() ) return;
+
+  // Resident set size from /proc (second field, in pages).
+  double residentMemory = 0.;
+  ifstream statm( "/proc/self/statm" );
+  unsigned long totalPages = 0;
+  unsigned long residentPages = 0;
+  if ( statm >> totalPages >> residentPages ) residentMemory = static_cast< double >( residentPages )*sysconf( _SC_PAGESIZE );
+
+  // Write to a temporary file first and rename it, such that readers never see a partial file.
+  string tmpFileName = fileName + string( ".tmp" );
+  ofstream file( tmpFileName.c_str() );
+  if ( !file )
+  {
+    cout << "[KalmanAlignmentDataCollector::writeMonitorFile] Could not open " << tmpFileName << endl;
+    return;
+  }
+
+  {
+    std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+
+    map< string, pair< string, double > >::const_iterator itValue;
+    for ( itValue = theDataCollector->theMonitorValues.begin(); itValue != theDataCollector->theMonitorValues.end(); ++itValue )
+    {
+      file << "# TYPE " << itValue->first << " " << itValue->second.first << "\n";
+      file << itValue->first << " " << itValue->second.second << "\n";
+    }
+  }
+
+  file << "# TYPE kaa_resident_memory_bytes gauge\n";
+  file << "kaa_resident_memory_bytes " << residentMemory << "\n";
+  file.close();
+
+  if ( rename( tmpFileName.c_str(), fileName.c_str() ) != 0 )
+    cout << "[KalmanAlignmentDataCollector::writeMonitorFile] Could not rename " << tmpFileName << endl;
+
+  theDataCollector->theLastMonitorWrite = std::chrono::steady_clock::now();
+}
+
+
+void KalmanAlignmentDataCollector::useShard( unsigned int index )
+{
+  theDataCollector->selectShard( index );
+}
+
+
 void KalmanAlignmentDataCollector::config( const edm::ParameterSet & config )
 {
   theConfiguration = config;
+
+  theDefaultBinning = HistogramBinning( theConfiguration.getUntrackedParameter< int >( "NBins", 200 ),
+					theConfiguration.getUntrackedParameter< double >( "XMin", -10. ),
+					theConfiguration.getUntrackedParameter< double >( "XMax", 10. ) );
+
+  if ( theDefaultBinning.nBins < 1 || !( theDefaultBinning.xMin < theDefaultBinning.xMax ) )
+    throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentDataCollector::config] Bad default histogram binning.";
+
+  theBinningOverrides.clear();
+
+  vector< edm::ParameterSet > binningOverrides =
+    theConfiguration.getUntrackedParameter< vector< edm::ParameterSet > >( "HistogramBinning", vector< edm::ParameterSet >() );
+
+  vector< edm::ParameterSet >::iterator itOverride;
+  for ( itOverride = binningOverrides.begin(); itOverride != binningOverrides.end(); ++itOverride )
+  {
+    HistogramBinning binning( itOverride->getUntrackedParameter< int >( "NBins", theDefaultBinning.nBins ),
+			      itOverride->getUntrackedParameter< double >( "XMin", theDefaultBinning.xMin ),
+			      itOverride->getUntrackedParameter< double >( "XMax", theDefaultBinning.xMax ) );
+    if ( binning.nBins < 1 || !( binning.xMin < binning.xMax ) )
+      throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentDataCollector::config] "
+					  << "Bad binning for histograms " << itOverride->getUntrackedParameter< string >( "Name" );
+
+    theBinningOverrides.push_back( make_pair( itOverride->getUntrackedParameter< string >( "Name" ), binning ) );
+  }
+
+  theRawHistoDataFlag = theConfiguration.getUntrackedParameter< bool >( "StoreRawHistogramData", false );
+
+  theSpillBufferSize = theConfiguration.getUntrackedParameter< unsigned int >( "SpillBufferSize", 0 );
+  theSpillDirectory = theConfiguration.getUntrackedParameter< string >( "SpillDirectory", "" );
+
+  vector< string > defaultCategories;
+  defaultCategories.push_back( "TrackQA" );
+  defaultCategories.push_back( "AlignableEvolution" );
+  defaultCategories.push_back( "Timing" );
+
+  vector< string > categories = theConfiguration.getUntrackedParameter< vector< string > >( "Instrumentation", defaultCategories );
+
+  theInstrumentation = 0;
+  vector< string >::iterator itCategory;
+  for ( itCategory = categories.begin(); itCategory != categories.end(); ++itCategory )
+  {
+    if ( *itCategory == "TrackQA" ) theInstrumentation |= TrackQA;
+    else if ( *itCategory == "AlignableEvolution" ) theInstrumentation |= AlignableEvolution;
+    else if ( *itCategory == "Timing" ) theInstrumentation |= Timing;
+    else throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentDataCollector::config] "
+					     << "Unknown instrumentation category: " << *itCategory;
+  }
+
+  theMonitorFileName = theConfiguration.getUntrackedParameter< string >( "MonitorFileName", "" );
+  theMonitorInterval = theConfiguration.getUntrackedParameter< double >( "MonitorInterval", 30. );
+  theLastMonitorWrite = std::chrono::steady_clock::now();
+
+  theGraphSamplings.clear();
+
+  vector< edm::ParameterSet > graphSamplings =
+    theConfiguration.getUntrackedParameter< vector< edm::ParameterSet > >( "GraphSampling", vector< edm::ParameterSet >() );
+
+  vector< edm::ParameterSet >::iterator itSampling;
+  for ( itSampling = graphSamplings.begin(); itSampling != graphSamplings.end(); ++itSampling )
+  {
+    GraphSampling graphSampling;
+    graphSampling.pattern = itSampling->getUntrackedParameter< string >( "Pattern" );
+    graphSampling.n = itSampling->getUntrackedParameter< unsigned int >( "N" );
+
+    string policy = itSampling->getUntrackedParameter< string >( "Policy" );
+    if ( policy == "EveryNth" ) graphSampling.policy = GraphSampling::EveryNth;
+    else if ( policy == "Reservoir" ) graphSampling.policy = GraphSampling::Reservoir;
+    else if ( policy == "LTTB" ) graphSampling.policy = GraphSampling::LTTB;
+    else throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentDataCollector::config] "
+					     << "Unknown graph sampling policy: " << policy;
+
+    const unsigned int minN = ( graphSampling.policy == GraphSampling::LTTB ) ? 3 : 1;
+    if ( graphSampling.n < minN )
+      throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentDataCollector::config] "
+					  << "Graph sampling " << policy << " needs N >= " << minN
+					  << " (pattern " << graphSampling.pattern << ").";
+
+    theGraphSamplings.push_back( graphSampling );
+  }
 }
 
 
-void KalmanAlignmentDataCollector::fillTH1F( string histo_name, float data )
+
+int KalmanAlignmentDataCollector::histogramHandle( const string& histo_name )
+{
+  map< string, int >::iterator itHandle = theHistoHandles.find( histo_name );
+  if ( itHandle != theHistoHandles.end() ) return itHandle->second;
+
+  int handle = theHistoNames.size();
+  theHistoNames.push_back( histo_name );
+  theHistoHandles[histo_name] = handle;
+
+  return handle;
+}
+
+
+int KalmanAlignmentDataCollector::graphHandle( const string& graph_name )
+{
+  map< string, int >::iterator itHandle = theGraphHandles.find( graph_name );
+  if ( itHandle != theGraphHandles.end() ) return itHandle->second;
+
+  int handle = theGraphNames.size();
+  theGraphNames.push_back( graph_name );
+  theGraphHandles[graph_name] = handle;
+
+  return handle;
+}
+
+
+KalmanAlignmentDataCollector::Shard& KalmanAlignmentDataCollector::localShard( void )
 {
-  if ( theHistoData.find( histo_name ) == theHistoData.end() )
+  if ( !theLocalShard )
   {
-    theHistoData[histo_name] = vector< float > ( 1, data );
+    std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+    theShards.push_back( new Shard );
+    theLocalShard = theShards.back();
   }
-  else
+
+  return *theLocalShard;
+}
+
+
+void KalmanAlignmentDataCollector::selectShard( unsigned int index )
+{
+  std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+
+  Shard*& shard = theSelectedShards[index];
+  if ( !shard ) shard = new Shard;
+  theLocalShard = shard;
+}
+
+
+vector< const KalmanAlignmentDataCollector::Shard* > KalmanAlignmentDataCollector::mergeOrder( void ) const
+{
+  vector< const Shard* > result( theShards.begin(), theShards.end() );
+
+  map< unsigned int, Shard* >::const_iterator itSelected;
+  for ( itSelected = theSelectedShards.begin(); itSelected != theSelectedShards.end(); ++itSelected )
+    result.push_back( itSelected->second );
+
+  return result;
+}
+
+
+void KalmanAlignmentDataCollector::fillTH1F( string histo_name, float data )
+{
+  Shard& shard = localShard();
+
+  map< string, int >::iterator itHandle = shard.histoHandles.find( histo_name );
+  if ( itHandle == shard.histoHandles.end() )
   {
-    theHistoData[histo_name].push_back( data );
+    std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+    itHandle = shard.histoHandles.insert( make_pair( histo_name, histogramHandle( histo_name ) ) ).first;
   }
 
-  return;
+  fillTH1F( itHandle->second, data );
 }
 
 
@@ -120,23 +432,66 @@ void KalmanAlignmentDataCollector::fillTH1F( string histo_name, int histo_number
 }
 
 
-void KalmanAlignmentDataCollector::fillTGraph( string graph_name, float x_data, float y_data )
+void KalmanAlignmentDataCollector::fillTH1F( int histo_handle, float data )
 {
-  if ( theXGraphData.find( graph_name ) == theXGraphData.end() )
+  Shard& shard = localShard();
+
+  if ( histo_handle < 0 ) throw cms::Exception( "LogicError" ) << "[KalmanAlignmentDataCollector::fillTH1F] "
+							       << "Invalid histogram handle " << histo_handle;
+
+  if ( histo_handle >= static_cast< int >( shard.histoData.size() ) ) shard.histoData.resize( histo_handle + 1 );
+  HistogramData& histo = shard.histoData[histo_handle];
+
+  if ( histo.contents.empty() )
   {
-    theXGraphData[graph_name] = vector< float > ( 1, x_data );
-    theYGraphData[graph_name] = vector< float > ( 1, y_data );
+    std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+    if ( histo_handle >= static_cast< int >( theHistoNames.size() ) )
+      throw cms::Exception( "LogicError" ) << "[KalmanAlignmentDataCollector::fillTH1F] "
+					   << "Invalid histogram handle " << histo_handle;
+    histo.binning = binning( theHistoNames[histo_handle] );
+    histo.contents.assign( histo.binning.nBins + 2, 0. );
   }
+
+  const HistogramBinning& bins = histo.binning;
+
+  // Same convention as TH1: bin 0 is the underflow, bin nBins+1 the overflow (also for NaN).
+  // The moments are computed from the entries within the range only.
+  int iBin;
+  if ( data < bins.xMin ) iBin = 0;
+  else if ( !( data < bins.xMax ) ) iBin = bins.nBins + 1;
   else
   {
-    theXGraphData[graph_name].push_back( x_data );
-    theYGraphData[graph_name].push_back( y_data );
+    iBin = 1 + static_cast< int >( bins.nBins*( data - bins.xMin )/( bins.xMax - bins.xMin ) );
+    if ( iBin > bins.nBins ) iBin = bins.nBins;
+
+    histo.sumX += data;
+    histo.sumX2 += data*data;
   }
 
+  histo.contents[iBin] += 1.;
+  ++histo.entries;
+
+  if ( theRawHistoDataFlag ) histo.rawData.push_back( data );
+
   return;
 }
 
 
+void KalmanAlignmentDataCollector::fillTGraph( string graph_name, float x_data, float y_data )
+{
+  Shard& shard = localShard();
+
+  map< string, int >::iterator itHandle = shard.graphHandles.find( graph_name );
+  if ( itHandle == shard.graphHandles.end() )
+  {
+    std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+    itHandle = shard.graphHandles.insert( make_pair( graph_name, graphHandle( graph_name ) ) ).first;
+  }
+
+  fillTGraph( itHandle->second, x_data, y_data );
+}
+
+
 void KalmanAlignmentDataCollector::fillTGraph( string graph_name, int graph_number, float x_data, float y_data )
 {
   string full_graph_name = graph_name + toString( graph_number );
@@ -146,15 +501,295 @@ void KalmanAlignmentDataCollector::fillTGraph( string graph_name, int graph_numb
 }
 
 
+void KalmanAlignmentDataCollector::fillTGraph( int graph_handle, float x_data, float y_data )
+{
+  Shard& shard = localShard();
+
+  if ( graph_handle < 0 ) throw cms::Exception( "LogicError" ) << "[KalmanAlignmentDataCollector::fillTGraph] "
+							       << "Invalid graph handle " << graph_handle;
+
+  if ( graph_handle >= static_cast< int >( shard.graphData.size() ) ) shard.graphData.resize( graph_handle + 1 );
+  GraphData& graph = shard.graphData[graph_handle];
+
+  if ( !graph.resolved )
+  {
+    std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+    if ( graph_handle >= static_cast< int >( theGraphNames.size() ) )
+      throw cms::Exception( "LogicError" ) << "[KalmanAlignmentDataCollector::fillTGraph] "
+					   << "Invalid graph handle " << graph_handle;
+    graph.sampling = sampling( theGraphNames[graph_handle] );
+    graph.resolved = true;
+  }
+
+  // Graphs with a bounded number of points are not spilled, hence not counted.
+  if ( addGraphPoint( graph_handle, graph, x_data, y_data ) && !graph.bounded() &&
+       theSpillBufferSize && ++shard.bufferedPoints >= theSpillBufferSize ) spill( shard );
+}
+
+
+bool KalmanAlignmentDataCollector::addGraphPoint( int graph_handle, GraphData& graph, float x_data, float y_data ) const
+{
+  const unsigned long iPoint = graph.seen++;
+
+  if ( !graph.sampling )
+  {
+    graph.xData.push_back( x_data );
+    graph.yData.push_back( y_data );
+    return true;
+  }
+
+  const unsigned int n = graph.sampling->n;
+
+  switch ( graph.sampling->policy )
+  {
+  case GraphSampling::EveryNth:
+    if ( iPoint % n != 0 ) return false;
+    graph.xData.push_back( x_data );
+    graph.yData.push_back( y_data );
+    return true;
+
+  case GraphSampling::Reservoir:
+    if ( graph.xData.size() < n )
+    {
+      graph.xData.push_back( x_data );
+      graph.yData.push_back( y_data );
+      graph.sequence.push_back( iPoint );
+      return true;
+    }
+    else
+    {
+      // Replace a random point with probability n/(iPoint+1).
+      const unsigned long long j = KalmanAlignmentSampling::reservoirIndex( graph_handle, iPoint );
+      if ( j < n )
+      {
+	graph.xData[j] = x_data;
+	graph.yData[j] = y_data;
+	graph.sequence[j] = iPoint;
+      }
+      return false;
+    }
+
+  case GraphSampling::LTTB:
+    graph.xData.push_back( x_data );
+    graph.yData.push_back( y_data );
+    // Streaming reduction: collect up to 2n points, then reduce them to n.
+    if ( graph.xData.size() >= 2*n ) KalmanAlignmentSampling::reduceLTTB( graph.xData, graph.yData, n );
+    return true;
+  }
+
+  return false;
+}
+
+
 void KalmanAlignmentDataCollector::fillTNtuple( std::string ntuple_name, float data )
 {
-  if ( theNtupleData.find( ntuple_name ) == theNtupleData.end() )
+  Shard& shard = localShard();
+
+  shard.ntupleData[ntuple_name].push_back( data );
+
+  if ( theSpillBufferSize && ++shard.bufferedPoints >= theSpillBufferSize ) spill( shard );
+}
+
+
+void KalmanAlignmentDataCollector::fillTNtuple( int ntuple_handle, const float* row, int row_size )
+{
+  Shard& shard = localShard();
+
+  if ( ntuple_handle < 0 ) throw cms::Exception( "LogicError" ) << "[KalmanAlignmentDataCollector::fillTNtuple] "
+								<< "Invalid ntuple handle " << ntuple_handle;
+
+  if ( ntuple_handle >= static_cast< int >( shard.columnNtupleData.size() ) ) shard.columnNtupleData.resize( ntuple_handle + 1 );
+  vector< vector< float > >& columns = shard.columnNtupleData[ntuple_handle].columns;
+
+  if ( columns.empty() )
   {
-    theNtupleData[ntuple_name] = vector< float > ( 1, data );
-   }
+    std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+    if ( ntuple_handle >= static_cast< int >( theColumnNtupleColumns.size() ) )
+      throw cms::Exception( "LogicError" ) << "[KalmanAlignmentDataCollector::fillTNtuple] "
+					   << "Invalid ntuple handle " << ntuple_handle;
+    columns.resize( theColumnNtupleColumns[ntuple_handle].size() );
+  }
+
+  const unsigned int nColumns = columns.size();
+
+  if ( row_size >= 0 && static_cast< unsigned int >( row_size ) != nColumns )
+    throw cms::Exception( "LogicError" ) << "[KalmanAlignmentDataCollector::fillTNtuple] "
+					 << "Row of " << row_size << " values for an ntuple with " << nColumns << " columns.";
+
+  for ( unsigned int iColumn = 0; iColumn < nColumns; ++iColumn ) columns[iColumn].push_back( row[iColumn] );
+
+  if ( theSpillBufferSize && ( shard.bufferedPoints += nColumns ) >= theSpillBufferSize ) spill( shard );
+}
+
+
+void KalmanAlignmentDataCollector::spill( Shard& shard )
+{
+  if ( !shard.spillFile ) shard.spillFile = openSpillFile();
+
+  // Writing always happens at the end of the file, reading (see writeToTFile) seeks explicitly.
+  fseek( shard.spillFile, 0, SEEK_END );
+
+  for ( int iGraph = 0; iGraph < static_cast< int >( shard.graphData.size() ); ++iGraph )
+  {
+    GraphData& graph = shard.graphData[iGraph];
+    if ( graph.xData.empty() || graph.bounded() ) continue;
+
+    SpillChunk chunk = writeToSpillFile( shard.spillFile, graph.xData );
+    writeToSpillFile( shard.spillFile, graph.yData );
+    shard.graphChunks[iGraph].push_back( chunk );
+
+    // Release the memory, not only the content.
+    vector< float >().swap( graph.xData );
+    vector< float >().swap( graph.yData );
+  }
+
+  map< string, vector< float > >::iterator itN;
+  for ( itN = shard.ntupleData.begin(); itN != shard.ntupleData.end(); ++itN )
+  {
+    if ( itN->second.empty() ) continue;
+
+    shard.ntupleChunks[itN->first].push_back( writeToSpillFile( shard.spillFile, itN->second ) );
+    vector< float >().swap( itN->second );
+  }
+
+  for ( int iNtuple = 0; iNtuple < static_cast< int >( shard.columnNtupleData.size() ); ++iNtuple )
+  {
+    vector< vector< float > >& columns = shard.columnNtupleData[iNtuple].columns;
+    if ( columns.empty() || columns.front().empty() ) continue;
+
+    SpillChunk chunk = writeToSpillFile( shard.spillFile, columns.front() );
+    for ( unsigned int iColumn = 1; iColumn < columns.size(); ++iColumn ) writeToSpillFile( shard.spillFile, columns[iColumn] );
+    shard.columnNtupleChunks[iNtuple].push_back( chunk );
+
+    for ( unsigned int iColumn = 0; iColumn < columns.size(); ++iColumn ) vector< float >().swap( columns[iColumn] );
+  }
+
+  shard.bufferedPoints = 0;
+}
+
+
+FILE* KalmanAlignmentDataCollector::openSpillFile( void ) const
+{
+  FILE* file = 0;
+
+  if ( theSpillDirectory.empty() )
+  {
+    file = tmpfile();
+  }
   else
   {
-    theNtupleData[ntuple_name].push_back( data );
+    // The file is unlinked right away and disappears when it is closed.
+    string fileName = theSpillDirectory + string( "/kaaSpillXXXXXX" );
+    vector< char > fileNameBuffer( fileName.begin(), fileName.end() );
+    fileNameBuffer.push_back( '\0' );
+
+    int fd = mkstemp( &fileNameBuffer[0] );
+    if ( fd != -1 )
+    {
+      unlink( &fileNameBuffer[0] );
+      file = fdopen( fd, "w+b" );
+      if ( !file ) close( fd );
+    }
+  }
+
+  if ( !file )
+    throw cms::Exception( "FileOpenError" ) << "[KalmanAlignmentDataCollector::openSpillFile] "
+					    << "Could not create spill file (SpillDirectory = '" << theSpillDirectory << "').";
+
+  return file;
+}
+
+
+KalmanAlignmentDataCollector::SpillChunk
+KalmanAlignmentDataCollector::writeToSpillFile( FILE* file, const vector< float >& data ) const
+{
+  SpillChunk chunk;
+  chunk.offset = ftell( file );
+  chunk.size = data.size();
+
+  if ( fwrite( &data[0], sizeof( float ), data.size(), file ) != data.size() )
+    throw cms::Exception( "FileWriteError" ) << "[KalmanAlignmentDataCollector::writeToSpillFile] "
+					     << "Could not write " << data.size() << " values to the spill file.";
+
+  return chunk;
+}
+
+
+void KalmanAlignmentDataCollector::readFromSpillFile( FILE* file, long offset, unsigned int size, vector< float >& data ) const
+{
+  const unsigned int oldSize = data.size();
+  data.resize( oldSize + size );
+
+  if ( fseek( file, offset, SEEK_SET ) != 0 || fread( &data[oldSize], sizeof( float ), size, file ) != size )
+    throw cms::Exception( "FileReadError" ) << "[KalmanAlignmentDataCollector::readFromSpillFile] "
+					    << "Could not read " << size << " values from the spill file.";
+}
+
+
+unsigned int KalmanAlignmentDataCollector::graphSize( const Shard& shard, int graph_handle ) const
+{
+  unsigned int result = 0;
+
+  map< int, SpillChunkCollection >::const_iterator itChunks = shard.graphChunks.find( graph_handle );
+  if ( itChunks != shard.graphChunks.end() )
+  {
+    SpillChunkCollection::const_iterator itChunk;
+    for ( itChunk = itChunks->second.begin(); itChunk != itChunks->second.end(); ++itChunk ) result += itChunk->size;
+  }
+
+  if ( graph_handle < static_cast< int >( shard.graphData.size() ) ) result += shard.graphData[graph_handle].xData.size();
+
+  return result;
+}
+
+
+void KalmanAlignmentDataCollector::appendGraphData( const Shard& shard, int graph_handle, GraphData& graph ) const
+{
+  // Spilled chunks first, they were filled before the buffered points.
+  map< int, SpillChunkCollection >::const_iterator itChunks = shard.graphChunks.find( graph_handle );
+  if ( itChunks != shard.graphChunks.end() )
+  {
+    SpillChunkCollection::const_iterator itChunk;
+    for ( itChunk = itChunks->second.begin(); itChunk != itChunks->second.end(); ++itChunk )
+    {
+      readFromSpillFile( shard.spillFile, itChunk->offset, itChunk->size, graph.xData );
+      readFromSpillFile( shard.spillFile, itChunk->offset + itChunk->size*sizeof( float ), itChunk->size, graph.yData );
+    }
+  }
+
+  if ( graph_handle < static_cast< int >( shard.graphData.size() ) )
+  {
+    const GraphData& shardGraph = shard.graphData[graph_handle];
+
+    if ( shardGraph.sampling && shardGraph.sampling->policy == GraphSampling::Reservoir )
+    {
+      // Restore the original order of the sampled points.
+      vector< pair< unsigned long, unsigned int > > order;
+      order.reserve( shardGraph.sequence.size() );
+      for ( unsigned int i = 0; i < shardGraph.sequence.size(); ++i ) order.push_back( make_pair( shardGraph.sequence[i], i ) );
+      sort( order.begin(), order.end() );
+
+      vector< pair< unsigned long, unsigned int > >::const_iterator itOrder;
+      for ( itOrder = order.begin(); itOrder != order.end(); ++itOrder )
+      {
+	graph.xData.push_back( shardGraph.xData[itOrder->second] );
+	graph.yData.push_back( shardGraph.yData[itOrder->second] );
+      }
+    }
+    else if ( shardGraph.sampling && shardGraph.sampling->policy == GraphSampling::LTTB )
+    {
+      vector< float > xData( shardGraph.xData );
+      vector< float > yData( shardGraph.yData );
+      KalmanAlignmentSampling::reduceLTTB( xData, yData, shardGraph.sampling->n );
+
+      graph.xData.insert( graph.xData.end(), xData.begin(), xData.end() );
+      graph.yData.insert( graph.yData.end(), yData.begin(), yData.end() );
+    }
+    else
+    {
+      graph.xData.insert( graph.xData.end(), shardGraph.xData.begin(), shardGraph.xData.end() );
+      graph.yData.insert( graph.yData.end(), shardGraph.yData.begin(), shardGraph.yData.end() );
+    }
   }
 }
 
@@ -169,81 +804,133 @@ void KalmanAlignmentDataCollector::writeToTFile( void )
 
 void KalmanAlignmentDataCollector::writeToTFile( string file_name, string mode )
 {
-  int nBins = theConfiguration.getUntrackedParameter< int >( "NBins", 200 );
-  double xMin = theConfiguration.getUntrackedParameter< double >( "XMin", -10. );
-  double xMax = theConfiguration.getUntrackedParameter< double >( "XMax", 10. );
+  std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+
+  const vector< const Shard* > shards = mergeOrder();
+  vector< const Shard* >::const_iterator itShard;
 
   TFile* file = new TFile( file_name.c_str(), mode.c_str() );
 
-  if ( !theHistoData.empty() )
+  // The objects are written ordered by their names. Registered but unfilled ones are skipped.
+  if ( !theHistoHandles.empty() )
   {
-    map< string, vector< float > >::iterator itH = theHistoData.begin();
-    vector< float >::iterator itV;
+    map< string, int >::iterator itH = theHistoHandles.begin();
     TH1F* tempHisto;
 
-    while ( itH != theHistoData.end() )
+    while ( itH != theHistoHandles.end() )
     {
-      tempHisto = new TH1F( itH->first.c_str(), itH->first.c_str(), nBins, xMin, xMax );
+      HistogramData histo;
+      for ( itShard = shards.begin(); itShard != shards.end(); ++itShard )
+	if ( itH->second < static_cast< int >( (*itShard)->histoData.size() ) ) histo.add( (*itShard)->histoData[itH->second] );
+
+      const HistogramBinning& bins = histo.binning;
+
+      if ( histo.contents.empty() ) { ++itH; continue; }
+
+      tempHisto = new TH1F( itH->first.c_str(), itH->first.c_str(), bins.nBins, bins.xMin, bins.xMax );
 
-      itV = itH->second.begin();
-      while ( itV != itH->second.end() ) {
-	tempHisto->Fill( *itV );
-	itV++;
+      double sumW = 0.;
+      for ( int iBin = 0; iBin <= bins.nBins + 1; ++iBin )
+      {
+	tempHisto->SetBinContent( iBin, histo.contents[iBin] );
+	if ( iBin > 0 && iBin <= bins.nBins ) sumW += histo.contents[iBin];
       }
 
+      // Unit weights: sum of weights and sum of squared weights are equal.
+      double stats[4] = { sumW, sumW, histo.sumX, histo.sumX2 };
+      tempHisto->PutStats( stats );
+      tempHisto->SetEntries( histo.entries );
+
       tempHisto->Write();
       delete tempHisto;
 
+      if ( !histo.rawData.empty() )
+      {
+	string rawName = itH->first + "_raw";
+	TNtuple* rawNtuple = new TNtuple( rawName.c_str(), rawName.c_str(), "x" );
+
+	vector< float >::const_iterator itV;
+	for ( itV = histo.rawData.begin(); itV != histo.rawData.end(); ++itV ) rawNtuple->Fill( *itV );
+
+	rawNtuple->Write();
+	delete rawNtuple;
+      }
+
       ++itH;
     }
   }
 
-  if ( !theXGraphData.empty() )
+  if ( !theGraphHandles.empty() )
   {
-    map< string, vector< float > >::iterator itXG = theXGraphData.begin();
-    map< string, vector< float > >::iterator itYG = theYGraphData.begin();
-
-    float* xData;
-    float* yData;
+    map< string, int >::iterator itG = theGraphHandles.begin();
 
     TGraph* tempGraph;
 
-    while ( itXG != theXGraphData.end() )
+    // Number of points offered to each graph before sampling, with one labeled bin per graph. The
+    // labels are matched when merging the outputs of several jobs (e.g. with hadd).
+    TH1D* graphEntries = new TH1D( "DataCollector_GraphEntries", "DataCollector_GraphEntries", 1, 0., 1. );
+
+    while ( itG != theGraphHandles.end() )
     {
-      int nData = itXG->second.size();
+      // Only one graph at a time is held in memory. The number of stored points is an upper bound
+      // of its final size, the LTTB buffers are reduced while appending.
+      unsigned int nData = 0;
+      for ( itShard = shards.begin(); itShard != shards.end(); ++itShard ) nData += graphSize( **itShard, itG->second );
 
-      xData = new float[nData];
-      yData = new float[nData];
+      if ( nData == 0 ) { ++itG; continue; }
 
-      for ( int iData = 0; iData < nData; iData++ )
-      {
-	xData[iData] = itXG->second[iData];
-	yData[iData] = itYG->second[iData];
-      }
+      unsigned long seen = 0;
+      for ( itShard = shards.begin(); itShard != shards.end(); ++itShard )
+	if ( itG->second < static_cast< int >( (*itShard)->graphData.size() ) ) seen += (*itShard)->graphData[itG->second].seen;
+      graphEntries->Fill( itG->first.c_str(), static_cast< double >( seen ) );
+
+      GraphData graph;
+      graph.xData.reserve( nData );
+      graph.yData.reserve( nData );
+      for ( itShard = shards.begin(); itShard != shards.end(); ++itShard ) appendGraphData( **itShard, itG->second, graph );
 
-      tempGraph = new TGraph( nData, xData, yData );
-      tempGraph->SetName( itXG->first.c_str() );
-      tempGraph->SetTitle( itXG->first.c_str() );
+      tempGraph = new TGraph( graph.xData.size(), &graph.xData[0], &graph.yData[0] );
+      tempGraph->SetName( itG->first.c_str() );
+      tempGraph->SetTitle( itG->first.c_str() );
 
       tempGraph->Write();
       delete tempGraph;
 
-      delete[] xData;
-      delete[] yData;
-
-      ++itXG;
-      ++itYG;
+      ++itG;
     }
+
+    if ( graphEntries->GetEntries() > 0 ) graphEntries->Write();
+    delete graphEntries;
   }
 
 
-  if ( !theNtupleData.empty() )
+  map< string, vector< float > > ntupleData;
+  for ( itShard = shards.begin(); itShard != shards.end(); ++itShard )
   {
-    map< string, vector< float > >::iterator itN = theNtupleData.begin();
+    map< string, SpillChunkCollection >::const_iterator itChunks;
+    for ( itChunks = (*itShard)->ntupleChunks.begin(); itChunks != (*itShard)->ntupleChunks.end(); ++itChunks )
+    {
+      vector< float >& data = ntupleData[itChunks->first];
+      SpillChunkCollection::const_iterator itChunk;
+      for ( itChunk = itChunks->second.begin(); itChunk != itChunks->second.end(); ++itChunk )
+	readFromSpillFile( (*itShard)->spillFile, itChunk->offset, itChunk->size, data );
+    }
+
+    map< string, vector< float > >::const_iterator itShardN;
+    for ( itShardN = (*itShard)->ntupleData.begin(); itShardN != (*itShard)->ntupleData.end(); ++itShardN )
+    {
+      vector< float >& data = ntupleData[itShardN->first];
+      data.insert( data.end(), itShardN->second.begin(), itShardN->second.end() );
+    }
+  }
+
+  if ( !ntupleData.empty() )
+  {
+    map< string, vector< float > >::iterator itN = ntupleData.begin();
 
     TNtuple* ntuple;
 
-    while ( itN != theNtupleData.end() )
+    while ( itN != ntupleData.end() )
     {
       ntuple = new TNtuple( itN->first.c_str(), itN->first.c_str(), itN->first.c_str() );
 
@@ -262,6 +949,11 @@ void KalmanAlignmentDataCollector::writeToTFile( string file_name, string mode )
   }
 
 
+  map< string, int >::const_iterator itC;
+  for ( itC = theColumnNtupleHandles.begin(); itC != theColumnNtupleHandles.end(); ++itC )
+    writeColumnNtuple( itC->first, itC->second, shards );
+
+
   file->Write();
   file->Close();
   delete file;
@@ -270,11 +962,146 @@ void KalmanAlignmentDataCollector::writeToTFile( string file_name, string mode )
 }
 
 
+void KalmanAlignmentDataCollector::writeColumnNtuple( const string& ntuple_name,
+						      int ntuple_handle,
+						      const vector< const Shard* >& shards ) const
+{
+  const vector< string >& columnNames = theColumnNtupleColumns[ntuple_handle];
+  const unsigned int nColumns = columnNames.size();
+
+  bool filled = false;
+  vector< const Shard* >::const_iterator itShard;
+  for ( itShard = shards.begin(); itShard != shards.end() && !filled; ++itShard )
+  {
+    filled = ( (*itShard)->columnNtupleChunks.find( ntuple_handle ) != (*itShard)->columnNtupleChunks.end() );
+    if ( ntuple_handle < static_cast< int >( (*itShard)->columnNtupleData.size() ) )
+    {
+      const vector< vector< float > >& columns = (*itShard)->columnNtupleData[ntuple_handle].columns;
+      filled = filled || ( !columns.empty() && !columns.front().empty() );
+    }
+  }
+
+  if ( !filled ) return;
+
+  TTree* tree = new TTree( ntuple_name.c_str(), ntuple_name.c_str() );
+
+  vector< float > row( nColumns );
+  for ( unsigned int iColumn = 0; iColumn < nColumns; ++iColumn )
+    tree->Branch( columnNames[iColumn].c_str(), &row[iColumn], ( columnNames[iColumn] + string( "/F" ) ).c_str() );
+
+  // The rows are filled shard by shard, spilled chunks first. Only one chunk is read at a time.
+  vector< vector< float > > chunkColumns( nColumns );
+  for ( itShard = shards.begin(); itShard != shards.end(); ++itShard )
+  {
+    map< int, SpillChunkCollection >::const_iterator itChunks = (*itShard)->columnNtupleChunks.find( ntuple_handle );
+    if ( itChunks != (*itShard)->columnNtupleChunks.end() )
+    {
+      SpillChunkCollection::const_iterator itChunk;
+      for ( itChunk = itChunks->second.begin(); itChunk != itChunks->second.end(); ++itChunk )
+      {
+	for ( unsigned int iColumn = 0; iColumn < nColumns; ++iColumn )
+	{
+	  chunkColumns[iColumn].clear();
+	  readFromSpillFile( (*itShard)->spillFile, itChunk->offset + iColumn*itChunk->size*sizeof( float ),
+			     itChunk->size, chunkColumns[iColumn] );
+	}
+
+	for ( unsigned int iRow = 0; iRow < itChunk->size; ++iRow )
+	{
+	  for ( unsigned int iColumn = 0; iColumn < nColumns; ++iColumn ) row[iColumn] = chunkColumns[iColumn][iRow];
+	  tree->Fill();
+	}
+      }
+    }
+
+    if ( ntuple_handle >= static_cast< int >( (*itShard)->columnNtupleData.size() ) ) continue;
+
+    const vector< vector< float > >& columns = (*itShard)->columnNtupleData[ntuple_handle].columns;
+    const unsigned int nRows = columns.empty() ? 0 : columns.front().size();
+    for ( unsigned int iRow = 0; iRow < nRows; ++iRow )
+    {
+      for ( unsigned int iColumn = 0; iColumn < nColumns; ++iColumn ) row[iColumn] = columns[iColumn][iRow];
+      tree->Fill();
+    }
+  }
+
+  tree->Write();
+  delete tree;
+}
+
+
 void KalmanAlignmentDataCollector::clearData( void )
 {
-  theHistoData.clear();
-  theXGraphData.clear();
-  theYGraphData.clear();
+  // Keep the registered names and the shards, such that handles remain valid.
+  std::lock_guard< std::mutex > lock( theDataCollectorMutex );
+
+  vector< Shard* > shards( theShards );
+  map< unsigned int, Shard* >::iterator itSelected;
+  for ( itSelected = theSelectedShards.begin(); itSelected != theSelectedShards.end(); ++itSelected )
+    shards.push_back( itSelected->second );
+
+  vector< Shard* >::iterator itShard;
+  for ( itShard = shards.begin(); itShard != shards.end(); ++itShard )
+  {
+    (*itShard)->histoData.clear();
+    (*itShard)->graphData.clear();
+    (*itShard)->ntupleData.clear();
+    (*itShard)->columnNtupleData.clear();
+
+    // Nothing refers to the spilled data anymore, a new spill file is opened when needed.
+    (*itShard)->bufferedPoints = 0;
+    (*itShard)->graphChunks.clear();
+    (*itShard)->ntupleChunks.clear();
+    (*itShard)->columnNtupleChunks.clear();
+    if ( (*itShard)->spillFile )
+    {
+      fclose( (*itShard)->spillFile );
+      (*itShard)->spillFile = 0;
+    }
+  }
+}
+
+
+void KalmanAlignmentDataCollector::HistogramData::add( const HistogramData& other )
+{
+  if ( other.contents.empty() ) return;
+
+  if ( contents.empty() )
+  {
+    *this = other;
+    return;
+  }
+
+  // All shards use the same binning for a given name.
+  for ( unsigned int iBin = 0; iBin < contents.size(); ++iBin ) contents[iBin] += other.contents[iBin];
+
+  entries += other.entries;
+  sumX += other.sumX;
+  sumX2 += other.sumX2;
+  rawData.insert( rawData.end(), other.rawData.begin(), other.rawData.end() );
+}
+
+
+const KalmanAlignmentDataCollector::HistogramBinning&
+KalmanAlignmentDataCollector::binning( const string& histo_name ) const
+{
+  // The first override whose name is a prefix of the histogram name is used.
+  vector< pair< string, HistogramBinning > >::const_iterator itOverride;
+  for ( itOverride = theBinningOverrides.begin(); itOverride != theBinningOverrides.end(); ++itOverride )
+    if ( histo_name.compare( 0, itOverride->first.size(), itOverride->first ) == 0 ) return itOverride->second;
+
+  return theDefaultBinning;
+}
+
+
+const KalmanAlignmentDataCollector::GraphSampling*
+KalmanAlignmentDataCollector::sampling( const string& graph_name ) const
+{
+  vector< GraphSampling >::const_iterator itSampling;
+  for ( itSampling = theGraphSamplings.begin(); itSampling != theGraphSamplings.end(); ++itSampling )
+    if ( fnmatch( itSampling->pattern.c_str(), graph_name.c_str(), 0 ) == 0 ) return &(*itSampling);
+
+  return 0;
 }
 
 
@@ -1,4 +1,5 @@
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentMetricsCalculator.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentCheckpoint.h"
 #include <limits.h>
 
 KalmanAlignmentMetricsCalculator::KalmanAlignmentMetricsCalculator( void ) : theMaxDistance( SHRT_MAX ) {}
@@ -123,6 +124,60 @@ const std::vector< Alignable* > KalmanAlignmentMetricsCalculator::alignables( vo
 }
 
 
+void KalmanAlignmentMetricsCalculator::writeState( std::ostream& out, const KalmanAlignmentCheckpoint& checkpoint ) const
+{
+  KalmanAlignmentCheckpoint::write( out, static_cast< unsigned int >( theDistances.size() ) );
+
+  FullDistancesList::const_iterator itD;
+  for ( itD = theDistances.begin(); itD != theDistances.end(); ++itD )
+  {
+    KalmanAlignmentCheckpoint::write( out, checkpoint.index( itD->first ) );
+    KalmanAlignmentCheckpoint::write( out, static_cast< unsigned int >( itD->second->size() ) );
+
+    SingleDistancesList::const_iterator itL;
+    for ( itL = itD->second->begin(); itL != itD->second->end(); ++itL )
+    {
+      KalmanAlignmentCheckpoint::write( out, checkpoint.index( itL->first ) );
+      KalmanAlignmentCheckpoint::write( out, itL->second );
+    }
+  }
+}
+
+
+void KalmanAlignmentMetricsCalculator::readState( std::istream& in, const KalmanAlignmentCheckpoint& checkpoint )
+{
+  clear();
+
+  unsigned int nLists = 0;
+  KalmanAlignmentCheckpoint::read( in, nLists );
+
+  for ( unsigned int iList = 0; iList < nLists && in.good(); ++iList )
+  {
+    int index = -1;
+    unsigned int nEntries = 0;
+    KalmanAlignmentCheckpoint::read( in, index );
+    KalmanAlignmentCheckpoint::read( in, nEntries );
+
+    SingleDistancesList* distances = new SingleDistancesList;
+
+    for ( unsigned int iEntry = 0; iEntry < nEntries; ++iEntry )
+    {
+      int otherIndex = -1;
+      short int distance = 0;
+      KalmanAlignmentCheckpoint::read( in, otherIndex );
+      KalmanAlignmentCheckpoint::read( in, distance );
+
+      Alignable* other = checkpoint.alignable( otherIndex );
+      if ( other ) (*distances)[other] = distance;
+    }
+
+    Alignable* alignable = checkpoint.alignable( index );
+    if ( alignable && theDistances.find( alignable ) == theDistances.end() ) theDistances[alignable] = distances;
+    else delete distances;
+  }
+}
+
+
 void KalmanAlignmentMetricsCalculator::clearDistances( FullDistancesList& dist )
 {
   FullDistancesList::iterator itD;
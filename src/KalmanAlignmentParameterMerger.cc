@@ -0,0 +1,95 @@
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentParameterMerger.h"
+
+
+void KalmanAlignmentParameterMerger::add( const AlgebraicVector& parameters, const AlgebraicSymMatrix& covariance, bool weightedMerge )
+{
+  const int nRow = parameters.num_row();
+
+  if ( theNumberOfInputs == 0 )
+  {
+    theWeightedFlag = weightedMerge;
+    theSum = AlgebraicVector( nRow, 0 );
+    theCovarianceSum = AlgebraicSymMatrix( nRow, 0 );
+    theWeightedSum = AlgebraicVector( nRow, 0 );
+    theInformation = AlgebraicSymMatrix( nRow, 0 );
+  }
+
+  theSum += parameters;
+  theCovarianceSum += covariance;
+  ++theNumberOfInputs;
+
+  if ( !theWeightedFlag ) return;
+
+  // Inputs without invertible covariance make the alignable fall back to equal weights.
+  int ierr = 0;
+  AlgebraicSymMatrix invCovariance = covariance.inverse( ierr );
+  if ( ierr != 0 )
+  {
+    theWeightedFlag = false;
+    return;
+  }
+
+  theInformation += invCovariance;
+  theWeightedSum += invCovariance*parameters;
+}
+
+
+void KalmanAlignmentParameterMerger::result( AlgebraicVector& parameters,
+					     AlgebraicSymMatrix& covariance,
+					     const AlgebraicVector* priorParameters,
+					     const AlgebraicSymMatrix* priorCovariance )
+{
+  thePriorRemovedFlag = false;
+
+  if ( theNumberOfInputs == 0 )
+  {
+    parameters = AlgebraicVector();
+    covariance = AlgebraicSymMatrix();
+    return;
+  }
+
+  const int nRow = theSum.num_row();
+
+  if ( theWeightedFlag )
+  {
+    int ierr = 0;
+
+    if ( priorParameters && priorCovariance && theNumberOfInputs > 1 &&
+	 priorParameters->num_row() == nRow && priorCovariance->num_row() == nRow )
+    {
+      AlgebraicSymMatrix invPrior = priorCovariance->inverse( ierr );
+      if ( ierr == 0 )
+      {
+	const double nPrior = theNumberOfInputs - 1;
+	AlgebraicSymMatrix information = theInformation - nPrior*invPrior;
+	AlgebraicSymMatrix mergedCovariance = information.inverse( ierr );
+
+	bool positive = ( ierr == 0 );
+	for ( int i = 0; i < nRow && positive; ++i ) positive = ( mergedCovariance[i][i] > 0. );
+
+	if ( positive )
+	{
+	  parameters = mergedCovariance*( theWeightedSum - nPrior*( invPrior*(*priorParameters) ) );
+	  covariance = mergedCovariance;
+	  thePriorRemovedFlag = true;
+	  return;
+	}
+      }
+    }
+
+    AlgebraicSymMatrix mergedCovariance = theInformation.inverse( ierr );
+    if ( ierr == 0 )
+    {
+      parameters = mergedCovariance*theWeightedSum;
+      covariance = mergedCovariance;
+      return;
+    }
+
+    theWeightedFlag = false;
+  }
+
+  // Equal weights: the mean and its covariance.
+  parameters = theSum/theNumberOfInputs;
+  covariance = theCovarianceSum/( static_cast< double >( theNumberOfInputs )*theNumberOfInputs );
+}
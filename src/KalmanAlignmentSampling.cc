@@ -0,0 +1,73 @@
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentSampling.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+
+unsigned long long KalmanAlignmentSampling::reservoirIndex( int graph_handle, unsigned long iPoint )
+{
+  unsigned long long z = ( static_cast< unsigned long long >( graph_handle ) << 40 ) + iPoint + 0x9e3779b97f4a7c15ULL;
+  z = ( z ^ ( z >> 30 ) )*0xbf58476d1ce4e5b9ULL;
+  z = ( z ^ ( z >> 27 ) )*0x94d049bb133111ebULL;
+  z = z ^ ( z >> 31 );
+
+  return z % ( iPoint + 1 );
+}
+
+
+void KalmanAlignmentSampling::reduceLTTB( vector< float >& xData, vector< float >& yData, unsigned int n )
+{
+  const unsigned int nData = xData.size();
+  if ( nData <= n || n < 3 ) return;
+
+  vector< float > xReduced;
+  vector< float > yReduced;
+  xReduced.reserve( n );
+  yReduced.reserve( n );
+
+  // The first and the last point are always kept, the other points are divided into n-2 buckets.
+  // From each bucket the point is selected that spans the largest triangle with the previously
+  // selected point and the average of the next bucket.
+  const double bucketSize = static_cast< double >( nData - 2 )/( n - 2 );
+
+  xReduced.push_back( xData[0] );
+  yReduced.push_back( yData[0] );
+  unsigned int iSelected = 0;
+
+  for ( unsigned int iBucket = 0; iBucket < n - 2; ++iBucket )
+  {
+    const unsigned int begin = static_cast< unsigned int >( floor( iBucket*bucketSize ) ) + 1;
+    const unsigned int end = static_cast< unsigned int >( floor( ( iBucket + 1 )*bucketSize ) ) + 1;
+
+    const unsigned int nextBegin = end;
+    const unsigned int nextEnd = std::min( static_cast< unsigned int >( floor( ( iBucket + 2 )*bucketSize ) ) + 1, nData );
+
+    double xAverage = 0.;
+    double yAverage = 0.;
+    for ( unsigned int i = nextBegin; i < nextEnd; ++i ) { xAverage += xData[i]; yAverage += yData[i]; }
+    if ( nextEnd > nextBegin ) { xAverage /= nextEnd - nextBegin; yAverage /= nextEnd - nextBegin; }
+    else { xAverage = xData[nData-1]; yAverage = yData[nData-1]; }
+
+    double maxArea = -1.;
+    unsigned int iMax = begin;
+    for ( unsigned int i = begin; i < end; ++i )
+    {
+      const double area = fabs( ( xData[iSelected] - xAverage )*( yData[i] - yData[iSelected] ) -
+				 ( xData[iSelected] - xData[i] )*( yAverage - yData[iSelected] ) );
+      if ( area > maxArea ) { maxArea = area; iMax = i; }
+    }
+
+    xReduced.push_back( xData[iMax] );
+    yReduced.push_back( yData[iMax] );
+    iSelected = iMax;
+  }
+
+  xReduced.push_back( xData[nData-1] );
+  yReduced.push_back( yData[nData-1] );
+
+  xData.swap( xReduced );
+  yData.swap( yReduced );
+}
@@ -18,9 +18,12 @@ KalmanAlignmentSetup::KalmanAlignmentSetup( const std::string& id,
 							    const std::vector< SubDetId >& externalIds,
 							    const unsigned int minExternalHits,
 							    const SortingDirection externalSortingDir,
+							    const std::string& externalFitterId,
 							    TrajectoryFactoryBase* trajectoryFactory,
 							    KalmanAlignmentUpdator* alignmentUpdator,
-							    KalmanAlignmentMetricsUpdator* metricsUpdator ) :
+							    KalmanAlignmentMetricsUpdator* metricsUpdator,
+							    const double minChi2Prob,
+							    const double maxChi2Prob ) :
   theId( id ),
   theFitter( fitter->clone() ),
   thePropagator( propagator->clone() ),
@@ -32,9 +35,11 @@ KalmanAlignmentSetup::KalmanAlignmentSetup( const std::string& id,
   theExternalTrackingSubDetIds( externalIds ),
   theMinExternalHits( minExternalHits ),
   theExternalSortingDir( externalSortingDir ),
+  theExternalFitterId( externalFitterId ),
   theTrajectoryFactory( trajectoryFactory ),
   theAlignmentUpdator( alignmentUpdator ),
-  theMetricsUpdator( metricsUpdator )
+  theMetricsUpdator( metricsUpdator ),
+  theTrackChi2Probability( minChi2Prob, maxChi2Prob )
 {}
 
 
@@ -50,9 +55,11 @@ KalmanAlignmentSetup::KalmanAlignmentSetup( const KalmanAlignmentSetup& setup )
   theExternalTrackingSubDetIds( setup.getExternalTrackingSubDetIds() ),
   theMinExternalHits( setup.minExternalHits() ),
   theExternalSortingDir( setup.externalSortingDirection() ),
+  theExternalFitterId( setup.externalFitterId() ),
   theTrajectoryFactory( setup.trajectoryFactory() ),
   theAlignmentUpdator( setup.alignmentUpdator() ),
-  theMetricsUpdator( setup.metricsUpdator() )
+  theMetricsUpdator( setup.metricsUpdator() ),
+  theTrackChi2Probability( setup.trackChi2Probability() )
 {}
 
 
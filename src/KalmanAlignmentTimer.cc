@@ -0,0 +1,193 @@
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentTimer.h"
+
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+  // Bin i holds the durations within [ 2^(i/4), 2^((i+1)/4) ) ns, the last bin everything above.
+  const int theNumberOfBins = 4*48;
+
+  struct TimingData
+  {
+    TimingData( void )
+    {
+      for ( int iStage = 0; iStage < KalmanAlignmentTimer::NumberOfStages; ++iStage )
+      {
+	calls[iStage] = 0;
+	total[iStage] = 0.;
+	for ( int iBin = 0; iBin < theNumberOfBins; ++iBin ) bins[iStage][iBin] = 0;
+      }
+    }
+
+    void add( const TimingData& other )
+    {
+      for ( int iStage = 0; iStage < KalmanAlignmentTimer::NumberOfStages; ++iStage )
+      {
+	calls[iStage] += other.calls[iStage];
+	total[iStage] += other.total[iStage];
+	for ( int iBin = 0; iBin < theNumberOfBins; ++iBin ) bins[iStage][iBin] += other.bins[iStage][iBin];
+      }
+    }
+
+    /// Estimate of the quantile in ns (center of the bin that holds it).
+    double quantile( int stage, double q ) const
+    {
+      const double target = q*calls[stage];
+      unsigned long sum = 0;
+      for ( int iBin = 0; iBin < theNumberOfBins; ++iBin )
+      {
+	sum += bins[stage][iBin];
+	if ( sum > 0 && sum >= target ) return pow( 2., 0.25*( iBin + 0.5 ) );
+      }
+      return pow( 2., 0.25*theNumberOfBins );
+    }
+
+    unsigned long calls[KalmanAlignmentTimer::NumberOfStages];
+    double total[KalmanAlignmentTimer::NumberOfStages]; // in ns
+    unsigned long bins[KalmanAlignmentTimer::NumberOfStages][theNumberOfBins];
+  };
+
+  std::mutex& timerMutex( void )
+  {
+    static std::mutex theTimerMutex;
+    return theTimerMutex;
+  }
+
+  // Data of the threads that have already finished.
+  TimingData& finishedData( void )
+  {
+    static TimingData theFinishedData;
+    return theFinishedData;
+  }
+
+  std::set< TimingData* >& runningData( void )
+  {
+    static std::set< TimingData* > theRunningData;
+    return theRunningData;
+  }
+
+  // The accumulator of a thread registers itself at the first measurement of the thread and
+  // hands its data over when the thread finishes.
+  struct ThreadTimingData : public TimingData
+  {
+    ThreadTimingData( void )
+    {
+      std::lock_guard< std::mutex > lock( timerMutex() );
+      runningData().insert( this );
+    }
+
+    ~ThreadTimingData( void )
+    {
+      std::lock_guard< std::mutex > lock( timerMutex() );
+      finishedData().add( *this );
+      runningData().erase( this );
+    }
+  };
+
+  thread_local ThreadTimingData theThreadTimingData;
+}
+
+
+void KalmanAlignmentTimer::add( Stage stage, std::chrono::steady_clock::duration duration )
+{
+  const double ns = std::chrono::duration< double, std::nano >( duration ).count();
+
+  int bin = ( ns > 1. ) ? static_cast< int >( 4.*log2( ns ) ) : 0;
+  if ( bin >= theNumberOfBins ) bin = theNumberOfBins - 1;
+
+  TimingData& data = theThreadTimingData;
+  ++data.calls[stage];
+  data.total[stage] += ns;
+  ++data.bins[stage][bin];
+}
+
+
+const char* KalmanAlignmentTimer::stageName( Stage stage )
+{
+  switch ( stage )
+  {
+  case Refit: return "Refit";
+  case ReferenceTrajectories: return "ReferenceTrajectories";
+  case MetricsUpdate: return "MetricsUpdate";
+  case AdditionalAlignables: return "AdditionalAlignables";
+  case SelectParameters: return "SelectParameters";
+  case GainComputation: return "GainComputation";
+  case StoreUpdate: return "StoreUpdate";
+  case UserVariablesUpdate: return "UserVariablesUpdate";
+  default: return "Unknown";
+  }
+}
+
+
+void KalmanAlignmentTimer::write( const std::string& fileName )
+{
+  if ( !KalmanAlignmentDataCollector::instrumented( KalmanAlignmentDataCollector::Timing ) ) return;
+
+  TimingData data;
+  {
+    std::lock_guard< std::mutex > lock( timerMutex() );
+    data.add( finishedData() );
+    set< TimingData* >::const_iterator itData;
+    for ( itData = runningData().begin(); itData != runningData().end(); ++itData ) data.add( **itData );
+  }
+
+  ofstream out;
+  if ( !fileName.empty() )
+  {
+    out.open( fileName.c_str(), ios::out | ios::trunc );
+    if ( !out ) cout << "[KalmanAlignmentTimer::write] Could not open " << fileName << endl;
+  }
+  const bool writeFile = out.is_open() && out.good();
+
+  if ( writeFile )
+  {
+    out << setw( 24 ) << left << "stage" << right << setw( 12 ) << "calls" << setw( 12 ) << "total[s]"
+	<< setw( 12 ) << "mean[us]" << setw( 12 ) << "p50[us]" << setw( 12 ) << "p90[us]" << setw( 12 ) << "p99[us]" << endl;
+  }
+
+  vector< string > columns;
+  columns.push_back( "stage" );
+  columns.push_back( "calls" );
+  columns.push_back( "total" );
+  columns.push_back( "mean" );
+  columns.push_back( "p50" );
+  columns.push_back( "p90" );
+  columns.push_back( "p99" );
+  int ntuple = KalmanAlignmentDataCollector::registerNtuple( "Timing", columns );
+
+  for ( int iStage = 0; iStage < NumberOfStages; ++iStage )
+  {
+    if ( data.calls[iStage] == 0 ) continue;
+
+    // Totals in s, everything else in us.
+    vector< float > row( 7 );
+    row[0] = iStage;
+    row[1] = data.calls[iStage];
+    row[2] = 1e-9*data.total[iStage];
+    row[3] = 1e-3*data.total[iStage]/data.calls[iStage];
+    row[4] = 1e-3*data.quantile( iStage, 0.5 );
+    row[5] = 1e-3*data.quantile( iStage, 0.9 );
+    row[6] = 1e-3*data.quantile( iStage, 0.99 );
+
+    KalmanAlignmentDataCollector::fillNtuple( ntuple, row );
+
+    if ( writeFile )
+    {
+      out << setw( 24 ) << left << stageName( static_cast< Stage >( iStage ) ) << right
+	  << setw( 12 ) << data.calls[iStage] << fixed << setprecision( 3 );
+      for ( int iColumn = 2; iColumn < 7; ++iColumn ) out << setw( 12 ) << row[iColumn];
+      out << endl;
+    }
+  }
+
+  if ( writeFile ) cout << "[KalmanAlignmentTimer::write] Timing written to " << fileName << endl;
+}
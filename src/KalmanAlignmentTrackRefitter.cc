@@ -11,31 +11,88 @@
 #include "TrackingTools/GeomPropagators/interface/AnalyticalPropagator.h"
 #include "TrackingTools/MaterialEffects/interface/PropagatorWithMaterial.h"
 
+#include "Geometry/CommonDetUnit/interface/TrackingGeometry.h"
+#include "Geometry/CommonDetUnit/interface/GeomDet.h"
+
 #include "DataFormats/BeamSpot/interface/BeamSpot.h"
 
+#include "FWCore/Utilities/interface/Exception.h"
+
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentDataCollector.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/CurrentAlignmentKFUpdator.h"
 
-#include "CLHEP/GenericFunctions/CumulativeChiSquare.hh"
+#include "TMath.h"
 
 #include <iostream>
+#include <algorithm>
 
 using namespace std;
 using namespace reco;
-using namespace Genfun;
 
 
-KalmanAlignmentTrackRefitter::KalmanAlignmentTrackRefitter( const edm::ParameterSet& config, AlignableNavigator* navigator ) :
+KalmanAlignmentTrackRefitter::KalmanAlignmentTrackRefitter( const edm::ParameterSet& config,
+							    AlignableNavigator* navigator,
+							    const std::vector< Alignable* >& alignables ) :
   theRefitterAlgo( config ),
   theNavigator( navigator ),
-  theDebugFlag( config.getUntrackedParameter<bool>( "debug", true ) )
+  theDebugFlag( config.getUntrackedParameter<bool>( "debug", true ) ),
+  theNumberOfDroppedHits( 0 ),
+  theNumberOfThreads( config.getUntrackedParameter<unsigned int>( "NumberOfThreads", 1 ) ),
+  theSerializeFlag( config.getUntrackedParameter<bool>( "SerializeSharedServices", true ) ),
+  theWorkerPool( 0 ),
+  theValidationFlag( config.getUntrackedParameter<bool>( "ValidateThreadedRefit", false ) ),
+  theNumberOfValidatedEvents( 0 ),
+  theNumberOfMismatches( 0 ),
+  theNumberOfRefitCalls( 0 )
 {
   TrackProducerBase< reco::Track >::setConf( config );
   TrackProducerBase< reco::Track >::setSrc( config.getParameter< edm::InputTag >( "src" ),
 					    config.getParameter< edm::InputTag >( "bsSrc" ) );
+
+  if ( theNumberOfThreads < 1 ) theNumberOfThreads = 1;
+  cout << "[KalmanAlignmentTrackRefitter] Use " << theNumberOfThreads << " thread(s) for refitting";
+  if ( theNumberOfThreads > 1 && !theSerializeFlag ) cout << ", calls to shared services are not serialized";
+  if ( theNumberOfThreads > 1 && theSerializeFlag ) cout << ", the fits are serialized (no significant speedup)";
+  cout << "." << endl;
+
+  // TrackProducerAlgorithm::buildTrack is not const, hence every worker gets its own instance.
+  for ( unsigned int iWorker = 1; iWorker < theNumberOfThreads; ++iWorker )
+    theWorkerAlgos.push_back( new RefitterAlgorithm( config ) );
+
+  // Worker i fills the debug data of shard i.
+  theWorkerPool = new KalmanAlignmentWorkerPool( theNumberOfThreads, 0 );
+
+  std::vector< Alignable* >::const_iterator itAli;
+  for ( itAli = alignables.begin(); itAli != alignables.end(); ++itAli ) collectDetIds( *itAli );
+
+  registerDebugHistograms( "RefitSingle_" );
+  registerDebugHistograms( "OrigFullTrack" );
+
+  sort( theKnownDetIds.begin(), theKnownDetIds.end() );
+  theKnownDetIds.erase( unique( theKnownDetIds.begin(), theKnownDetIds.end() ), theKnownDetIds.end() );
+  cout << "[KalmanAlignmentTrackRefitter] Number of known DetIds: " << theKnownDetIds.size() << endl;
+
+  // The DetIds must be exactly those of the navigator: all of them are found (it throws otherwise)
+  // and there are as many as in its map.
+  std::vector< unsigned int >::const_iterator itDetId;
+  for ( itDetId = theKnownDetIds.begin(); itDetId != theKnownDetIds.end(); ++itDetId )
+    theNavigator->alignableFromDetId( DetId( *itDetId ) );
+
+  if ( static_cast< int >( theKnownDetIds.size() ) != theNavigator->size() )
+    throw cms::Exception( "LogicError" ) << "[KalmanAlignmentTrackRefitter] "
+					 << "Collected " << theKnownDetIds.size() << " DetIds, but the navigator knows "
+					 << theNavigator->size() << ". The navigator must be built from the same alignables.";
 }
 
 
-KalmanAlignmentTrackRefitter::~KalmanAlignmentTrackRefitter( void ) {}
+KalmanAlignmentTrackRefitter::~KalmanAlignmentTrackRefitter( void )
+{
+  delete theWorkerPool;
+  clearWorkerSetups();
+
+  std::vector< RefitterAlgorithm* >::iterator itAlgo;
+  for ( itAlgo = theWorkerAlgos.begin(); itAlgo != theWorkerAlgos.end(); ++itAlgo ) delete *itAlgo;
+}
 
 
 KalmanAlignmentTrackRefitter::TrackletCollection
@@ -55,145 +112,388 @@ KalmanAlignmentTrackRefitter::refitTracks( const edm::EventSetup& setup,
   getFromES( setup, aGeometry, aMagneticField, aTrajectoryFitter, aPropagator, theMeasTk, aRecHitBuilder );
 
   TrackletCollection result;
-  TrackCollection fullTracks;
 
-  ConstTrajTrackPairCollection refittedFullTracks;
-  ConstTrajTrackPairCollection::const_iterator itTrack;
+  AlignmentSetupCollection::const_iterator itSetup;
+  for ( itSetup = algoSetups.begin(); itSetup != algoSetups.end(); ++itSetup )
+  {
+    registerDebugHistograms( (*itSetup)->id() );
+    if ( theDebugFlag ) registerDebugHistograms( string("External") + (*itSetup)->id() );
+  }
 
-  for( itTrack = tracks.begin(); itTrack != tracks.end(); ++itTrack )
+  unsigned int nWorkers = std::min( theNumberOfThreads, static_cast< unsigned int >( tracks.size() ) );
+
+  if ( nWorkers < 2 )
   {
-    TransientTrack fullTrack( *(*itTrack).second, aMagneticField.product() );
+    AnalyticalPropagator predictionPropagator( aMagneticField.product(), anyDirection );
 
-    AlignmentSetupCollection::const_iterator itSetup;
-    for ( itSetup = algoSetups.begin(); itSetup != algoSetups.end(); ++itSetup )
+    ConstTrajTrackPairCollection::const_iterator itTrack;
+    for( itTrack = tracks.begin(); itTrack != tracks.end(); ++itTrack )
+      refitTrack( *itTrack, algoSetups, algoSetups, theRefitterAlgo, aGeometry.product(), aMagneticField.product(),
+		  aRecHitBuilder.product(), &predictionPropagator, beamSpot, result );
+  }
+  else
+  {
+    prepareWorkerSetups( algoSetups, nWorkers );
+
+    // The tracks are distributed among the workers in a fixed, interleaved pattern. The tracklets
+    // are stored per track and merged afterwards in the original order of the tracks.
+    std::vector< TrackletCollection > trackletsPerTrack( tracks.size() );
+
+    // The workers read the alignment parameters from the same snapshot as the calling thread.
+    const CurrentAlignmentKFUpdator::Snapshot* snapshot = CurrentAlignmentKFUpdator::snapshot();
+
+    theWorkerPool->run( [&]( unsigned int iWorker )
     {
-      RecHitContainer trackingRecHits;
-      RecHitContainer externalTrackingRecHits;
+      CurrentAlignmentKFUpdator::useSnapshot( snapshot );
 
-      ////RecHitContainer pixelRecHits;
-      RecHitContainer zPlusRecHits;
-      RecHitContainer zMinusRecHits;
+      // There may be less tracks than threads.
+      if ( iWorker >= nWorkers ) return;
 
-      // Extract collection with TrackingRecHits
-      Trajectory::ConstRecHitContainer hits = (*itTrack).first->recHits();
-      Trajectory::ConstRecHitContainer::iterator itHits;
+      const AlignmentSetupCollection& fitterSetups = ( iWorker == 0 ) ? algoSetups : theWorkerSetups[iWorker-1];
+      AnalyticalPropagator predictionPropagator( aMagneticField.product(), anyDirection );
 
-      for ( itHits = hits.begin(); itHits != hits.end(); ++itHits )
-      {
-	if ( !(*itHits)->isValid() ) continue;
+      for ( unsigned int iTrack = iWorker; iTrack < tracks.size(); iTrack += nWorkers )
+	refitTrack( tracks[iTrack], algoSetups, fitterSetups, refitterAlgorithm( iWorker ),
+		    aGeometry.product(), aMagneticField.product(), aRecHitBuilder.product(),
+		    &predictionPropagator, beamSpot, trackletsPerTrack[iTrack] );
+    } );
 
- 	try
-	{
-	  //if ( !theNavigator->alignableFromDetId( (*itHits)->geographicalId() )->alignmentParameters() ) continue;
-	  theNavigator->alignableFromDetId( (*itHits)->geographicalId() );	  
-	} catch(...) { continue; }
+    std::vector< TrackletCollection >::iterator itTracklets;
+    for ( itTracklets = trackletsPerTrack.begin(); itTracklets != trackletsPerTrack.end(); ++itTracklets )
+      result.insert( result.end(), itTracklets->begin(), itTracklets->end() );
 
-	if ( (*itSetup)->useForTracking( *itHits ) )
-	{
-	  trackingRecHits.push_back( (*itHits)->hit()->clone() );
+    if ( theValidationFlag )
+    {
+      // The debug histograms are filled a second time by the sequential refit.
+      TrackletCollection sequentialResult;
+      AnalyticalPropagator predictionPropagator( aMagneticField.product(), anyDirection );
 
-	  ( (*itHits)->det()->position().z() > 0. ) ?
-	    zPlusRecHits.push_back( (*itHits)->hit()->clone() ) :
-	    zMinusRecHits.push_back( (*itHits)->hit()->clone() );
+      ConstTrajTrackPairCollection::const_iterator itTrack;
+      for( itTrack = tracks.begin(); itTrack != tracks.end(); ++itTrack )
+	refitTrack( *itTrack, algoSetups, algoSetups, theRefitterAlgo, aGeometry.product(), aMagneticField.product(),
+		    aRecHitBuilder.product(), &predictionPropagator, beamSpot, sequentialResult );
 
-	  ////const int subdetId( (*itHits)->det()->geographicalId().subdetId() );
-	  ////if ( subdetId == 1 ) pixelRecHits.push_back( (*itHits)->hit()->clone() );
-	}
-	else if ( (*itSetup)->useForExternalTracking( *itHits ) )
-	{
-	  externalTrackingRecHits.push_back( (*itHits)->hit()->clone() );
-	}
+      ++theNumberOfValidatedEvents;
+      if ( !equivalentTracklets( result, sequentialResult ) )
+      {
+	++theNumberOfMismatches;
+	cout << "[KalmanAlignmentTrackRefitter::refitTracks] Threaded refit differs from the sequential refit ("
+	     << result.size() << "/" << sequentialResult.size() << " tracklets)." << endl;
       }
+    }
+  }
 
-      //edm::LogInfo( "KalmanAlignmentTrackRefitter" ) << "Hits for tracking/external: " << trackingRecHits.size() << "/" << externalTrackingRecHits.size();
+  ++theNumberOfRefitCalls;
 
-      //if ( !zPlusRecHits.size() || !zMinusRecHits.size() ) continue;
-      ////if ( pixelRecHits.size() < 3 || !zPlusRecHits.size() || !zMinusRecHits.size() ) continue;
+  return result;
+}
 
-      if ( trackingRecHits.empty() ) continue;
 
-      if ( externalTrackingRecHits.empty() )
-      {
-	if ( ( (*itSetup)->getExternalTrackingSubDetIds().size() == 0 ) && // O.K., no external hits expected,
-	     ( trackingRecHits.size() >= (*itSetup)->minTrackingHits() ) )
-	{
-	  TrajTrackPairCollection refitted = refitSingleTracklet( aGeometry.product(), aMagneticField.product(),
-								  (*itSetup)->fitter(), (*itSetup)->propagator(), 
-								  aRecHitBuilder.product(), fullTrack,
-								  trackingRecHits, beamSpot,
-								  (*itSetup)->sortingDirection(), false, true );
+void KalmanAlignmentTrackRefitter::refitTrack( const ConstTrajTrackPair& track,
+					       const AlignmentSetupCollection& algoSetups,
+					       const AlignmentSetupCollection& fitterSetups,
+					       RefitterAlgorithm& refitterAlgo,
+					       const TrackingGeometry* geometry,
+					       const MagneticField* magneticField,
+					       const TransientTrackingRecHitBuilder* recHitBuilder,
+					       const Propagator* predictionPropagator,
+					       const reco::BeamSpot* beamSpot,
+					       TrackletCollection& result )
+{
+  TransientTrack fullTrack( *track.second, magneticField );
 
-	  // The refitting did not work ... Try next!
-	  if ( refitted.empty() ) continue;
-	  if ( rejectTrack( refitted.front().second ) ) continue;
+  // External fits of this track, shared between the alignment setups.
+  ExternalTrackletCache externalCache;
 
-	  if ( theDebugFlag )
-	  {
-	    debugTrackData( (*itSetup)->id(), refitted.front().first, refitted.front().second, beamSpot );
-	    debugTrackData( "OrigFullTrack", (*itTrack).first, (*itTrack).second, beamSpot );
-	  }
+  // Extract collection with valid TrackingRecHits on dets known to the navigator.
+  Trajectory::ConstRecHitContainer allHits = track.first->recHits();
+  Trajectory::ConstRecHitContainer hits;
+  hits.reserve( allHits.size() );
 
+  unsigned long nDroppedHits = 0;
+  Trajectory::ConstRecHitContainer::const_iterator itAllHits;
+  for ( itAllHits = allHits.begin(); itAllHits != allHits.end(); ++itAllHits )
+  {
+    if ( !(*itAllHits)->isValid() ) continue;
 
-	  TrackletPtr trackletPtr( new KalmanAlignmentTracklet( refitted.front(), *itSetup ) );
-	  result.push_back( trackletPtr );
-	}
-	else { continue; } // Expected external hits but found none or not enough hits.
+    if ( !isKnownDetId( (*itAllHits)->geographicalId() ) )
+    {
+      ++nDroppedHits;
+      continue;
+    }
+
+    hits.push_back( *itAllHits );
+  }
+  theNumberOfDroppedHits += nDroppedHits;
+
+  for ( unsigned int iSetup = 0; iSetup < algoSetups.size(); ++iSetup )
+  {
+    KalmanAlignmentSetup* algoSetup = algoSetups[iSetup];
+    const KalmanAlignmentSetup* fitterSetup = fitterSetups[iSetup];
+
+    RecHitContainer trackingRecHits;
+    RecHitContainer externalTrackingRecHits;
+
+    ////RecHitContainer pixelRecHits;
+    RecHitContainer zPlusRecHits;
+    RecHitContainer zMinusRecHits;
+
+    Trajectory::ConstRecHitContainer::const_iterator itHits;
+    for ( itHits = hits.begin(); itHits != hits.end(); ++itHits )
+    {
+      if ( algoSetup->useForTracking( *itHits ) )
+      {
+	trackingRecHits.push_back( (*itHits)->hit()->clone() );
+
+	( (*itHits)->det()->position().z() > 0. ) ?
+	  zPlusRecHits.push_back( (*itHits)->hit()->clone() ) :
+	  zMinusRecHits.push_back( (*itHits)->hit()->clone() );
+
+	////const int subdetId( (*itHits)->det()->geographicalId().subdetId() );
+	////if ( subdetId == 1 ) pixelRecHits.push_back( (*itHits)->hit()->clone() );
       }
-      else if ( ( trackingRecHits.size() >= (*itSetup)->minTrackingHits() ) &&
-		( externalTrackingRecHits.size() >= (*itSetup)->minExternalHits() ) ) 
+      else if ( algoSetup->useForExternalTracking( *itHits ) )
       {
-	// Create an instance of KalmanAlignmentTracklet with an external prediction.
-
-	TrajTrackPairCollection external = refitSingleTracklet( aGeometry.product(), aMagneticField.product(),
-								(*itSetup)->externalFitter(), (*itSetup)->externalPropagator(),
-								aRecHitBuilder.product(), fullTrack,
-								externalTrackingRecHits, beamSpot,
-								(*itSetup)->externalSortingDirection(),
-								false, true );
-	//if ( external.empty() || rejectTrack( external.front().second ) ) { continue; }
-	if ( external.empty() ) { continue; }
-
-	TransientTrack externalTrack( *external.front().second, aMagneticField.product() );
-
-	TrajTrackPairCollection refitted = refitSingleTracklet( aGeometry.product(), aMagneticField.product(),
-								(*itSetup)->fitter(), (*itSetup)->propagator(),
-								aRecHitBuilder.product(), externalTrack,
-								trackingRecHits, beamSpot,
-								(*itSetup)->sortingDirection(),
-								false, true, (*itSetup)->id() );
+	externalTrackingRecHits.push_back( (*itHits)->hit()->clone() );
+      }
+    }
+
+    //edm::LogInfo( "KalmanAlignmentTrackRefitter" ) << "Hits for tracking/external: " << trackingRecHits.size() << "/" << externalTrackingRecHits.size();
+
+    //if ( !zPlusRecHits.size() || !zMinusRecHits.size() ) continue;
+    ////if ( pixelRecHits.size() < 3 || !zPlusRecHits.size() || !zMinusRecHits.size() ) continue;
+
+    if ( trackingRecHits.empty() ) continue;
 
-	if ( refitted.empty() ) { continue; }
-	if ( rejectTrack( refitted.front().second ) ) continue;
+    if ( externalTrackingRecHits.empty() )
+    {
+      if ( ( algoSetup->getExternalTrackingSubDetIds().size() == 0 ) && // O.K., no external hits expected,
+	   ( trackingRecHits.size() >= algoSetup->minTrackingHits() ) )
+      {
+	TrajTrackPairCollection refitted = refitSingleTracklet( refitterAlgo, geometry, magneticField,
+								fitterSetup->fitter(), fitterSetup->propagator(), 
+								recHitBuilder, fullTrack,
+								trackingRecHits, beamSpot,
+								algoSetup->sortingDirection(), false, true );
 
- 	//const Surface& surface = refitted.front().first->firstMeasurement().updatedState().surface();
-	const Surface& surface = refitted.front().first->lastMeasurement().updatedState().surface();
- 	TrajectoryStateOnSurface externalTsos = externalTrack.impactPointState();
-	AnalyticalPropagator externalPredictionPropagator( aMagneticField.product(), anyDirection );
- 	TrajectoryStateOnSurface externalPrediction = externalPredictionPropagator.propagate( externalTsos, surface );
-	if ( !externalPrediction.isValid() ) continue;
+	// The refitting did not work ... Try next!
+	if ( refitted.empty() ) continue;
+	if ( rejectTrack( refitted.front().second, algoSetup ) ) continue;
 
-	if ( theDebugFlag )
+	if ( theDebugFlag && KalmanAlignmentDataCollector::instrumented( KalmanAlignmentDataCollector::TrackQA ) )
 	{
-	  debugTrackData( string("External") + (*itSetup)->id(), external.front().first, external.front().second, beamSpot );
-	  debugTrackData( (*itSetup)->id(), refitted.front().first, refitted.front().second, beamSpot );
-	  debugTrackData( "OrigFullTrack", (*itTrack).first, (*itTrack).second, beamSpot );
+	  debugTrackData( debugHistograms( algoSetup->id() ), refitted.front().first, refitted.front().second, beamSpot );
+	  debugTrackData( debugHistograms( "OrigFullTrack" ), track.first, track.second, beamSpot );
 	}
 
- 	TrackletPtr trackletPtr( new KalmanAlignmentTracklet( refitted.front(), externalPrediction, *itSetup ) );
-	result.push_back( trackletPtr );
 
-	delete external.front().first;
-	delete external.front().second;
+	TrackletPtr trackletPtr( new KalmanAlignmentTracklet( refitted.front(), algoSetup ) );
+	result.push_back( trackletPtr );
       }
+      else { continue; } // Expected external hits but found none or not enough hits.
+    }
+    else if ( ( trackingRecHits.size() >= algoSetup->minTrackingHits() ) &&
+	      ( externalTrackingRecHits.size() >= algoSetup->minExternalHits() ) ) 
+    {
+      // Create an instance of KalmanAlignmentTracklet with an external prediction.
+
+      const ExternalTracklet* external = externalTracklet( externalCache, algoSetup, fitterSetup, refitterAlgo,
+							   geometry, magneticField, recHitBuilder, fullTrack,
+							   externalTrackingRecHits, beamSpot );
+      //if ( !external || rejectTrack( external->trajTrackPair.second, algoSetup ) ) { continue; }
+      if ( !external ) { continue; }
+
+      const TransientTrack& externalTrack = external->transientTrack;
+
+      TrajTrackPairCollection refitted = refitSingleTracklet( refitterAlgo, geometry, magneticField,
+							      fitterSetup->fitter(), fitterSetup->propagator(),
+							      recHitBuilder, externalTrack,
+							      trackingRecHits, beamSpot,
+							      algoSetup->sortingDirection(),
+							      false, true, algoSetup->id() );
+
+      if ( refitted.empty() ) { continue; }
+      if ( rejectTrack( refitted.front().second, algoSetup ) ) continue;
+
+      //const Surface& surface = refitted.front().first->firstMeasurement().updatedState().surface();
+      const Surface& surface = refitted.front().first->lastMeasurement().updatedState().surface();
+      std::unique_lock< std::mutex > sharedServicesLock = lockSharedServices();
+      TrajectoryStateOnSurface externalTsos = externalTrack.impactPointState();
+      TrajectoryStateOnSurface externalPrediction = predictionPropagator->propagate( externalTsos, surface );
+      sharedServicesLock.unlock();
+      if ( !externalPrediction.isValid() ) continue;
+
+      if ( theDebugFlag && KalmanAlignmentDataCollector::instrumented( KalmanAlignmentDataCollector::TrackQA ) )
+      {
+	debugTrackData( debugHistograms( string("External") + algoSetup->id() ),
+			external->trajTrackPair.first, external->trajTrackPair.second, beamSpot );
+	debugTrackData( debugHistograms( algoSetup->id() ), refitted.front().first, refitted.front().second, beamSpot );
+	debugTrackData( debugHistograms( "OrigFullTrack" ), track.first, track.second, beamSpot );
+      }
+
+      TrackletPtr trackletPtr( new KalmanAlignmentTracklet( refitted.front(), externalPrediction, algoSetup ) );
+      result.push_back( trackletPtr );
     }
   }
 
-  return result;
+  clearExternalTracklets( externalCache );
+}
+
+
+const KalmanAlignmentTrackRefitter::ExternalTracklet*
+KalmanAlignmentTrackRefitter::externalTracklet( ExternalTrackletCache& cache,
+						const KalmanAlignmentSetup* algoSetup,
+						const KalmanAlignmentSetup* fitterSetup,
+						RefitterAlgorithm& refitterAlgo,
+						const TrackingGeometry* geometry,
+						const MagneticField* magneticField,
+						const TransientTrackingRecHitBuilder* recHitBuilder,
+						const TransientTrack& fullTrack,
+						RecHitContainer& recHits,
+						const reco::BeamSpot* beamSpot )
+{
+  std::vector< unsigned int > detIds;
+  detIds.reserve( recHits.size() );
+  RecHitContainer::const_iterator itRecHit;
+  for ( itRecHit = recHits.begin(); itRecHit != recHits.end(); ++itRecHit )
+    detIds.push_back( itRecHit->geographicalId().rawId() );
+
+  ExternalTrackletCache::const_iterator itCache;
+  for ( itCache = cache.begin(); itCache != cache.end(); ++itCache )
+  {
+    if ( itCache->sortingDir == algoSetup->externalSortingDirection() &&
+	 itCache->fitterId == algoSetup->externalFitterId() &&
+	 itCache->detIds == detIds )
+      return itCache->trajTrackPair.second ? &(*itCache) : 0;
+  }
+
+  TrajTrackPairCollection external = refitSingleTracklet( refitterAlgo, geometry, magneticField,
+							  fitterSetup->externalFitter(), fitterSetup->externalPropagator(),
+							  recHitBuilder, fullTrack,
+							  recHits, beamSpot,
+							  algoSetup->externalSortingDirection(),
+							  false, true );
+
+  // Failed fits are cached as well.
+  ExternalTracklet entry;
+  entry.detIds.swap( detIds );
+  entry.fitterId = algoSetup->externalFitterId();
+  entry.sortingDir = algoSetup->externalSortingDirection();
+  entry.trajTrackPair = external.empty() ? KalmanAlignmentTracklet::TrajTrackPair( 0, 0 ) : external.front();
+  if ( !external.empty() ) entry.transientTrack = TransientTrack( *external.front().second, magneticField );
+  cache.push_back( entry );
+
+  return cache.back().trajTrackPair.second ? &cache.back() : 0;
+}
+
+
+void KalmanAlignmentTrackRefitter::clearExternalTracklets( ExternalTrackletCache& cache ) const
+{
+  ExternalTrackletCache::iterator itCache;
+  for ( itCache = cache.begin(); itCache != cache.end(); ++itCache )
+  {
+    delete itCache->trajTrackPair.first;
+    delete itCache->trajTrackPair.second;
+  }
+  cache.clear();
+}
+
+
+void KalmanAlignmentTrackRefitter::collectDetIds( const Alignable* alignable )
+{
+  // Same recursion as AlignableNavigator::recursiveGetId.
+  const align::StructureType type = alignable->alignableObjectId();
+  if ( type == align::AlignableDet || type == align::AlignableDetUnit ) theKnownDetIds.push_back( alignable->id() );
+
+  if ( type == align::AlignableDetUnit ) return;
+
+  const std::vector< Alignable* >& components = alignable->components();
+  std::vector< Alignable* >::const_iterator itComp;
+  for ( itComp = components.begin(); itComp != components.end(); ++itComp ) collectDetIds( *itComp );
+}
+
+
+void KalmanAlignmentTrackRefitter::prepareWorkerSetups( const AlignmentSetupCollection& algoSetups, unsigned int nWorkers )
+{
+  // The copies are only valid as long as the setups they were copied from do not change.
+  bool valid = true;
+  std::vector< AlignmentSetupCollection >::iterator itWorker;
+  for ( itWorker = theWorkerSetups.begin(); itWorker != theWorkerSetups.end(); ++itWorker )
+  {
+    if ( itWorker->size() != algoSetups.size() ) { valid = false; break; }
+    for ( unsigned int iSetup = 0; iSetup < algoSetups.size(); ++iSetup )
+      if ( (*itWorker)[iSetup]->id() != algoSetups[iSetup]->id() ) valid = false;
+  }
+  if ( !valid ) clearWorkerSetups();
+
+  // The first worker uses the original setups.
+  while ( theWorkerSetups.size() + 1 < nWorkers )
+  {
+    AlignmentSetupCollection copies;
+    AlignmentSetupCollection::const_iterator itSetup;
+    for ( itSetup = algoSetups.begin(); itSetup != algoSetups.end(); ++itSetup )
+      copies.push_back( new KalmanAlignmentSetup( **itSetup ) );
+    theWorkerSetups.push_back( copies );
+  }
+}
+
+
+void KalmanAlignmentTrackRefitter::clearWorkerSetups( void )
+{
+  std::vector< AlignmentSetupCollection >::iterator itWorker;
+  for ( itWorker = theWorkerSetups.begin(); itWorker != theWorkerSetups.end(); ++itWorker )
+  {
+    AlignmentSetupCollection::iterator itSetup;
+    for ( itSetup = itWorker->begin(); itSetup != itWorker->end(); ++itSetup ) delete *itSetup;
+  }
+  theWorkerSetups.clear();
+}
+
+
+std::unique_lock< std::mutex > KalmanAlignmentTrackRefitter::lockSharedServices( void ) const
+{
+  std::unique_lock< std::mutex > lock( theSharedServicesMutex, std::defer_lock );
+  if ( theSerializeFlag ) lock.lock();
+  return lock;
+}
+
+
+bool KalmanAlignmentTrackRefitter::equivalentTracklets( const TrackletCollection& tracklets1,
+							const TrackletCollection& tracklets2 ) const
+{
+  if ( tracklets1.size() != tracklets2.size() ) return false;
+
+  for ( unsigned int iTracklet = 0; iTracklet < tracklets1.size(); ++iTracklet )
+  {
+    const KalmanAlignmentTracklet& tracklet1 = *tracklets1[iTracklet];
+    const KalmanAlignmentTracklet& tracklet2 = *tracklets2[iTracklet];
+
+    if ( tracklet1.alignmentSetup() != tracklet2.alignmentSetup() ) return false;
+
+    const reco::Track* track1 = tracklet1.track();
+    const reco::Track* track2 = tracklet2.track();
+    if ( track1->chi2() != track2->chi2() || track1->ndof() != track2->ndof() ) return false;
+    if ( !( track1->parameters() == track2->parameters() ) ) return false;
+
+    const std::vector< TrajectoryMeasurement >& measurements1 = tracklet1.trajectory()->measurements();
+    const std::vector< TrajectoryMeasurement >& measurements2 = tracklet2.trajectory()->measurements();
+    if ( measurements1.size() != measurements2.size() ) return false;
+    for ( unsigned int iMeas = 0; iMeas < measurements1.size(); ++iMeas )
+      if ( measurements1[iMeas].recHit()->geographicalId() != measurements2[iMeas].recHit()->geographicalId() ) return false;
+
+    if ( tracklet1.externalPredictionAvailable() != tracklet2.externalPredictionAvailable() ) return false;
+    if ( tracklet1.externalPredictionAvailable() &&
+	 !( tracklet1.externalPrediction().localParameters().vector() == tracklet2.externalPrediction().localParameters().vector() ) )
+      return false;
+  }
+
+  return true;
 }
 
 
 KalmanAlignmentTrackRefitter::TrajTrackPairCollection
-KalmanAlignmentTrackRefitter::refitSingleTracklet( const TrackingGeometry* geometry,
+KalmanAlignmentTrackRefitter::refitSingleTracklet( RefitterAlgorithm& refitterAlgo,
+						   const TrackingGeometry* geometry,
 						   const MagneticField* magneticField,
 						   const TrajectoryFitter* fitter,
 						   const Propagator* propagator,
@@ -211,20 +511,31 @@ KalmanAlignmentTrackRefitter::refitSingleTracklet( const TrackingGeometry* geome
 
   if ( recHits.size() < 2 ) return result;
 
-  sortRecHits( recHits, recHitBuilder, sortingDir );
+  sortRecHits( recHits, geometry, sortingDir );
+
+  // The hit builder (CPE) and the magnetic field are used from here until the track is built. The
+  // CPEs use the magnetic field as well, hence the hit building cannot be locked separately.
+  std::unique_lock< std::mutex > sharedServicesLock = lockSharedServices();
 
+  // Build every transient hit exactly once. The first slot is reserved for the momentum constraint
+  // (see below), such that the final container does not have to be copied.
   TransientTrackingRecHit::RecHitContainer hits;
+  hits.reserve( recHits.size() + 1 );
+  hits.push_back( TransientTrackingRecHit::ConstRecHitPointer() );
+
   RecHitContainer::iterator itRecHit;
   for ( itRecHit = recHits.begin(); itRecHit != recHits.end(); ++itRecHit )
     hits.push_back( recHitBuilder->build( &(*itRecHit) ) );
 
-  TransientTrackingRecHit::ConstRecHitPointer firstHit = hits.front();
+  TransientTrackingRecHit::ConstRecHitPointer firstHit = hits[1];
 
   AnalyticalPropagator firstStatePropagator( magneticField, anyDirection );
   TrajectoryStateOnSurface firstState = firstStatePropagator.propagate( fullTrack.impactPointState(), firstHit->det()->surface() );
 
-  KalmanAlignmentDataCollector::fillHistogram( identifier + string("_IPPt"), 
-					       1e-2*fullTrack.impactPointState().globalParameters().momentum().perp() );
+  const DebugHistograms& histograms = debugHistograms( identifier );
+  if ( KalmanAlignmentDataCollector::instrumented( KalmanAlignmentDataCollector::TrackQA ) )
+    KalmanAlignmentDataCollector::fillHistogram( histograms.ipPt,
+						 1e-2*fullTrack.impactPointState().globalParameters().momentum().perp() );
 
   if ( !firstState.isValid() ) return result;
 
@@ -261,8 +572,9 @@ KalmanAlignmentTrackRefitter::refitSingleTracklet( const TrackingGeometry* geome
 //   LocalTrajectoryParameters cosmicsStateParameters( firstStateParamVec, firstStateParameters.pzSign(), true );
 //   TrajectoryStateOnSurface tsos( cosmicsStateParameters, startError, firstState.surface(), magneticField );
 
-  KalmanAlignmentDataCollector::fillHistogram( identifier + string("_FSPt"),
-					       1e-2*firstState.globalParameters().momentum().perp() );
+  if ( KalmanAlignmentDataCollector::instrumented( KalmanAlignmentDataCollector::TrackQA ) )
+    KalmanAlignmentDataCollector::fillHistogram( histograms.fsPt,
+						 1e-2*firstState.globalParameters().momentum().perp() );
 
   firstState.rescaleError( 100 );
   TrajectoryStateOnSurface tsos( firstState.localParameters(), firstState.localError(),
@@ -283,15 +595,10 @@ KalmanAlignmentTrackRefitter::refitSingleTracklet( const TrackingGeometry* geome
   TransientTrackingRecHit::RecHitPointer testhit =
     TRecHit1DMomConstraint::build( charge, momentum, 1e-10, &tsos.surface() );
 
-  //no insert in OwnVector...
-  TransientTrackingRecHit::RecHitContainer tmpHits;
-  tmpHits.push_back(testhit);
-  for (TransientTrackingRecHit::RecHitContainer::const_iterator i=hits.begin(); i!=hits.end(); i++){
-    tmpHits.push_back(*i);
-  }
-  hits.swap(tmpHits);
+  hits.front() = testhit;
 
-  theRefitterAlgo.buildTrack( fitter, propagator, algoResult, hits, tsos, seed, 0, *beamSpot, candidate.seedRef());
+  refitterAlgo.buildTrack( fitter, propagator, algoResult, hits, tsos, seed, 0, *beamSpot, candidate.seedRef());
+  sharedServicesLock.unlock();
 
   for ( AlgoProductCollection::iterator it = algoResult.begin(); it != algoResult.end(); ++it )
     result.push_back( make_pair( (*it).first, (*it).second.first ) );
@@ -301,30 +608,21 @@ KalmanAlignmentTrackRefitter::refitSingleTracklet( const TrackingGeometry* geome
 
 
 void KalmanAlignmentTrackRefitter::sortRecHits( RecHitContainer& hits,
-						const TransientTrackingRecHitBuilder* builder,
+						const TrackingGeometry* geometry,
 						const SortingDirection& sortingDir ) const
 {
   // Don't start sorting if there is only 1 or even 0 elements.
   if ( hits.size() < 2 ) return;
 
-  TransientTrackingRecHit::RecHitPointer firstHit = builder->build( &hits.front() );
-  double firstRadius = firstHit->det()->surface().toGlobal( firstHit->localPosition() ).mag();
-  double firstY = firstHit->det()->surface().toGlobal( firstHit->localPosition() ).y();
-
-  TransientTrackingRecHit::RecHitPointer lastHit = builder->build( &hits.back() );
-  double lastRadius = lastHit->det()->surface().toGlobal( lastHit->localPosition() ).mag();
-  double lastY = lastHit->det()->surface().toGlobal( lastHit->localPosition() ).y();
-
-  bool insideOut = firstRadius < lastRadius;
-  bool upsideDown = lastY < firstY;
+  // The global positions are computed directly from the geometry, no transient hits are built here.
+  const GlobalPoint firstPosition = geometry->idToDet( hits.front().geographicalId() )->surface().toGlobal( hits.front().localPosition() );
+  const GlobalPoint lastPosition = geometry->idToDet( hits.back().geographicalId() )->surface().toGlobal( hits.back().localPosition() );
 
-  if ( ( insideOut && ( sortingDir == KalmanAlignmentSetup::sortInsideOut ) ) ||
-       ( !insideOut && ( sortingDir == KalmanAlignmentSetup::sortOutsideIn ) ) ||
-       ( upsideDown && ( sortingDir == KalmanAlignmentSetup::sortUpsideDown ) ) ||
-       ( !upsideDown && ( sortingDir == KalmanAlignmentSetup::sortDownsideUp ) ) ) return;
+  if ( !reverseHitOrder( firstPosition, lastPosition, sortingDir ) ) return;
 
   // Fill temporary container with reversed hits.
   RecHitContainer tmp;
+  tmp.reserve( hits.size() );
   RecHitContainer::iterator itHit = hits.end();
   do { --itHit; tmp.push_back( ( *itHit ).clone() ); } while ( itHit != hits.begin() );
 
@@ -335,23 +633,50 @@ void KalmanAlignmentTrackRefitter::sortRecHits( RecHitContainer& hits,
 }
 
 
-bool KalmanAlignmentTrackRefitter::rejectTrack( const Track* track ) const
+bool KalmanAlignmentTrackRefitter::reverseHitOrder( const GlobalPoint& firstPosition,
+						    const GlobalPoint& lastPosition,
+						    const SortingDirection& sortingDir )
+{
+  bool insideOut = firstPosition.mag() < lastPosition.mag();
+  bool upsideDown = lastPosition.y() < firstPosition.y();
+
+  return !( ( insideOut && ( sortingDir == KalmanAlignmentSetup::sortInsideOut ) ) ||
+	    ( !insideOut && ( sortingDir == KalmanAlignmentSetup::sortOutsideIn ) ) ||
+	    ( upsideDown && ( sortingDir == KalmanAlignmentSetup::sortUpsideDown ) ) ||
+	    ( !upsideDown && ( sortingDir == KalmanAlignmentSetup::sortDownsideUp ) ) );
+}
+
+
+bool KalmanAlignmentTrackRefitter::rejectTrack( const Track* track, const KalmanAlignmentSetup* setup ) const
 {
   double trackChi2 = track->chi2();
   unsigned int ndof = static_cast<unsigned int>( track->ndof() );
   if ( trackChi2 <= 0. || ndof <= 0 ) return false;
 
-  //FIXME: should be configurable (via KalmanAlignmentSetup)
-  double minChi2Prob = 0;//1e-6;
-  double maxChi2Prob = 1.0;
+  return !setup->trackChi2Probability().accept( trackChi2, ndof );
+}
+
 
-  GENFUNCTION cumulativeChi2 = Genfun::CumulativeChiSquare( ndof );
-  double chi2Prob = 1. - cumulativeChi2( trackChi2 );
-  return ( chi2Prob < minChi2Prob ) || ( chi2Prob > maxChi2Prob ); 
+void KalmanAlignmentTrackRefitter::registerDebugHistograms( const string& identifier )
+{
+  if ( theDebugHistograms.find( identifier ) != theDebugHistograms.end() ) return;
+
+  DebugHistograms& histograms = theDebugHistograms[identifier];
+  histograms.ipPt = KalmanAlignmentDataCollector::registerHistogram( identifier + string("_IPPt") );
+  histograms.fsPt = KalmanAlignmentDataCollector::registerHistogram( identifier + string("_FSPt") );
+  histograms.cumChi2 = KalmanAlignmentDataCollector::registerHistogram( identifier + string("_CumChi2") );
+  histograms.nHits = KalmanAlignmentDataCollector::registerHistogram( identifier + string("_NHits") );
+  histograms.pt = KalmanAlignmentDataCollector::registerHistogram( identifier + string("_Pt") );
+  histograms.eta = KalmanAlignmentDataCollector::registerHistogram( identifier + string("_Eta") );
+  histograms.phi = KalmanAlignmentDataCollector::registerHistogram( identifier + string("_Phi") );
+  histograms.normChi2 = KalmanAlignmentDataCollector::registerHistogram( identifier + string("_NormChi2") );
+  histograms.dz = KalmanAlignmentDataCollector::registerHistogram( identifier + string("_DZ") );
+  histograms.dxyBS = KalmanAlignmentDataCollector::registerHistogram( identifier + string("_DXY_BS") );
+  histograms.dxy = KalmanAlignmentDataCollector::registerHistogram( identifier + string("_DXY") );
 }
 
 
-void KalmanAlignmentTrackRefitter::debugTrackData( const string identifier,
+void KalmanAlignmentTrackRefitter::debugTrackData( const DebugHistograms& histograms,
 						   const Trajectory* traj,
 						   const Track* track,
 						   const reco::BeamSpot* bs )
@@ -360,22 +685,20 @@ void KalmanAlignmentTrackRefitter::debugTrackData( const string identifier,
   double trackChi2 = track->chi2();
   if ( ( trackChi2 > 0. ) && ( ndof > 0 ) )
   {
-    GENFUNCTION cumulativeChi2 = Genfun::CumulativeChiSquare( ndof );
-    KalmanAlignmentDataCollector::fillHistogram( identifier + string("_CumChi2"), 1. - cumulativeChi2( trackChi2 ) );
+    KalmanAlignmentDataCollector::fillHistogram( histograms.cumChi2, TMath::Prob( trackChi2, ndof ) );
   } else if ( ndof == 0 ) {
-    KalmanAlignmentDataCollector::fillHistogram( identifier + string("_CumChi2"), -1. );
+    KalmanAlignmentDataCollector::fillHistogram( histograms.cumChi2, -1. );
   } else {
-    KalmanAlignmentDataCollector::fillHistogram( identifier + string("_CumChi2"), -2. );
+    KalmanAlignmentDataCollector::fillHistogram( histograms.cumChi2, -2. );
   }
 
-  KalmanAlignmentDataCollector::fillHistogram( identifier + string("_NHits"), traj->foundHits() );
-  KalmanAlignmentDataCollector::fillHistogram( identifier + string("_Pt"), 1e-2*track->pt() );
-  KalmanAlignmentDataCollector::fillHistogram( identifier + string("_Eta"), track->eta() );
-  KalmanAlignmentDataCollector::fillHistogram( identifier + string("_Phi"), track->phi() );
-  KalmanAlignmentDataCollector::fillHistogram( identifier + string("_NormChi2"), track->normalizedChi2() );
-  KalmanAlignmentDataCollector::fillHistogram( identifier + string("_DZ"), track->dz() );
+  KalmanAlignmentDataCollector::fillHistogram( histograms.nHits, traj->foundHits() );
+  KalmanAlignmentDataCollector::fillHistogram( histograms.pt, 1e-2*track->pt() );
+  KalmanAlignmentDataCollector::fillHistogram( histograms.eta, track->eta() );
+  KalmanAlignmentDataCollector::fillHistogram( histograms.phi, track->phi() );
+  KalmanAlignmentDataCollector::fillHistogram( histograms.normChi2, track->normalizedChi2() );
+  KalmanAlignmentDataCollector::fillHistogram( histograms.dz, track->dz() );
 
-  KalmanAlignmentDataCollector::fillHistogram( identifier + string("_DXY_BS"), fabs( track->dxy( bs->position() ) ) );
-  KalmanAlignmentDataCollector::fillHistogram( identifier + string("_DXY"), fabs( track->dxy() ) );
-  //KalmanAlignmentDataCollector::fillHistogram( identifier + string("_D0"), fabs( track->d0() ) );
+  KalmanAlignmentDataCollector::fillHistogram( histograms.dxyBS, fabs( track->dxy( bs->position() ) ) );
+  KalmanAlignmentDataCollector::fillHistogram( histograms.dxy, fabs( track->dxy() ) );
 }
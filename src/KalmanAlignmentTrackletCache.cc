@@ -0,0 +1,434 @@
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentTrackletCache.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentCheckpoint.h"
+
+#include "DataFormats/TrackingRecHit/interface/RecHit1D.h"
+#include "DataFormats/TrackingRecHit/interface/RecHit2DLocalPos.h"
+#include "DataFormats/TrackReco/interface/Track.h"
+#include "DataFormats/TrajectorySeed/interface/TrajectorySeed.h"
+
+#include "TrackingTools/TransientTrackingRecHit/interface/GenericTransientTrackingRecHit.h"
+
+#include "Geometry/CommonDetUnit/interface/TrackingGeometry.h"
+#include "Geometry/CommonDetUnit/interface/GeomDet.h"
+
+#include "FWCore/Utilities/interface/Exception.h"
+
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+// Identifies tracklet cache files. Increase the version if the layout of the file changes.
+static const char theMagicWord[8] = { 'K', 'A', 'A', 'T', 'R', 'K', 'C', '1' };
+
+// Size of the stream buffer, the cache is written and read in large sequential chunks.
+static const unsigned int theBufferSize = 1 << 22;
+
+namespace
+{
+  // Hits rebuilt from the cache. They only keep the local position and error of the cached hit.
+
+  class CachedRecHit1D : public RecHit1D
+  {
+  public:
+    CachedRecHit1D( const DetId& id, const LocalPoint& position, const LocalError& error ) :
+      RecHit1D( id ), thePosition( position ), theError( error ) {}
+
+    virtual CachedRecHit1D* clone( void ) const { return new CachedRecHit1D( *this ); }
+
+    virtual LocalPoint localPosition( void ) const { return thePosition; }
+    virtual LocalError localPositionError( void ) const { return theError; }
+
+    virtual std::vector< const TrackingRecHit* > recHits( void ) const { return std::vector< const TrackingRecHit* >(); }
+    virtual std::vector< TrackingRecHit* > recHits( void ) { return std::vector< TrackingRecHit* >(); }
+
+  private:
+    LocalPoint thePosition;
+    LocalError theError;
+  };
+
+  class CachedRecHit2D : public RecHit2DLocalPos
+  {
+  public:
+    CachedRecHit2D( const DetId& id, const LocalPoint& position, const LocalError& error ) :
+      RecHit2DLocalPos( id ), thePosition( position ), theError( error ) {}
+
+    virtual CachedRecHit2D* clone( void ) const { return new CachedRecHit2D( *this ); }
+
+    virtual LocalPoint localPosition( void ) const { return thePosition; }
+    virtual LocalError localPositionError( void ) const { return theError; }
+
+  private:
+    LocalPoint thePosition;
+    LocalError theError;
+  };
+
+  inline bool cachedHit( const TransientTrackingRecHit::ConstRecHitPointer& hit )
+    { return hit->isValid() && hit->det(); }
+
+  void writeString( ostream& out, const string& value )
+    { KalmanAlignmentCheckpoint::write( out, vector< char >( value.begin(), value.end() ) ); }
+
+  string readString( istream& in )
+  {
+    vector< char > value;
+    KalmanAlignmentCheckpoint::read( in, value );
+    return string( value.begin(), value.end() );
+  }
+}
+
+
+KalmanAlignmentTrackletCache::KalmanAlignmentTrackletCache( const string& fileName, bool readMode ) :
+  theBuffer( theBufferSize ),
+  theFileName( fileName ),
+  theReadMode( readMode ),
+  theNumberOfEvents( 0 ),
+  theNumberOfTracklets( 0 )
+{
+  theStream.rdbuf()->pubsetbuf( &theBuffer[0], theBuffer.size() );
+
+  if ( theReadMode )
+  {
+    theStream.open( theFileName.c_str(), ios::in | ios::binary );
+    if ( !theStream )
+      throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentTrackletCache] Could not open " << theFileName;
+
+    char magicWord[sizeof( theMagicWord )];
+    theStream.read( magicWord, sizeof( magicWord ) );
+    if ( !theStream.good() || memcmp( magicWord, theMagicWord, sizeof( theMagicWord ) ) != 0 )
+      throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentTrackletCache] "
+					  << theFileName << " is not a valid tracklet cache.";
+  }
+  else
+  {
+    theStream.open( theFileName.c_str(), ios::out | ios::binary | ios::trunc );
+    if ( !theStream )
+      throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentTrackletCache] Could not open " << theFileName;
+
+    theStream.write( theMagicWord, sizeof( theMagicWord ) );
+  }
+}
+
+
+KalmanAlignmentTrackletCache::~KalmanAlignmentTrackletCache( void )
+{
+  theStream.close();
+
+  if ( !theReadMode )
+    cout << "[KalmanAlignmentTrackletCache] Wrote " << theNumberOfTracklets << " tracklet(s) of "
+	 << theNumberOfEvents << " events to " << theFileName << endl;
+}
+
+
+void KalmanAlignmentTrackletCache::write( const TrackletCollection& tracklets, const reco::BeamSpot& beamSpot )
+{
+  TrackletCollection cached;
+  TrackletCollection::const_iterator itTracklet;
+  for ( itTracklet = tracklets.begin(); itTracklet != tracklets.end(); ++itTracklet )
+    if ( cacheable( &(**itTracklet) ) ) cached.push_back( *itTracklet );
+
+  if ( cached.empty() ) return;
+
+  KalmanAlignmentCheckpoint::write( theStream, static_cast< unsigned int >( cached.size() ) );
+
+  KalmanAlignmentCheckpoint::write( theStream, beamSpot.x0() );
+  KalmanAlignmentCheckpoint::write( theStream, beamSpot.y0() );
+  KalmanAlignmentCheckpoint::write( theStream, beamSpot.z0() );
+  KalmanAlignmentCheckpoint::write( theStream, beamSpot.sigmaZ() );
+  KalmanAlignmentCheckpoint::write( theStream, beamSpot.dxdz() );
+  KalmanAlignmentCheckpoint::write( theStream, beamSpot.dydz() );
+  KalmanAlignmentCheckpoint::write( theStream, beamSpot.BeamWidthX() );
+  KalmanAlignmentCheckpoint::write( theStream, beamSpot.BeamWidthY() );
+  KalmanAlignmentCheckpoint::write( theStream, static_cast< int >( beamSpot.type() ) );
+  for ( int i = 0; i < reco::BeamSpot::dimension; ++i )
+    for ( int j = 0; j <= i; ++j ) KalmanAlignmentCheckpoint::write( theStream, beamSpot.covariance( i, j ) );
+
+  for ( itTracklet = cached.begin(); itTracklet != cached.end(); ++itTracklet )
+  {
+    const Trajectory* trajectory = (*itTracklet)->trajectory();
+    const reco::Track* track = (*itTracklet)->track();
+
+    writeString( theStream, (*itTracklet)->alignmentSetup()->id() );
+
+    KalmanAlignmentCheckpoint::write( theStream, (*itTracklet)->externalPredictionAvailable() );
+    if ( (*itTracklet)->externalPredictionAvailable() )
+      write( (*itTracklet)->externalPrediction(), surfaceId( (*itTracklet)->externalPrediction(), trajectory ) );
+
+    // Refitted track.
+    KalmanAlignmentCheckpoint::write( theStream, track->chi2() );
+    KalmanAlignmentCheckpoint::write( theStream, track->ndof() );
+    KalmanAlignmentCheckpoint::write( theStream, track->vx() );
+    KalmanAlignmentCheckpoint::write( theStream, track->vy() );
+    KalmanAlignmentCheckpoint::write( theStream, track->vz() );
+    KalmanAlignmentCheckpoint::write( theStream, track->px() );
+    KalmanAlignmentCheckpoint::write( theStream, track->py() );
+    KalmanAlignmentCheckpoint::write( theStream, track->pz() );
+    KalmanAlignmentCheckpoint::write( theStream, static_cast< int >( track->charge() ) );
+    for ( int i = 0; i < reco::Track::dimension; ++i )
+      for ( int j = 0; j <= i; ++j ) KalmanAlignmentCheckpoint::write( theStream, track->covariance( i, j ) );
+
+    // Trajectory measurements, in their original order.
+    const Trajectory::DataContainer& measurements = trajectory->measurements();
+
+    unsigned int nHits = 0;
+    Trajectory::DataContainer::const_iterator itMeas;
+    for ( itMeas = measurements.begin(); itMeas != measurements.end(); ++itMeas )
+      if ( cachedHit( itMeas->recHit() ) ) ++nHits;
+
+    KalmanAlignmentCheckpoint::write( theStream, static_cast< int >( trajectory->direction() ) );
+    KalmanAlignmentCheckpoint::write( theStream, nHits );
+
+    for ( itMeas = measurements.begin(); itMeas != measurements.end(); ++itMeas )
+    {
+      const TransientTrackingRecHit::ConstRecHitPointer& hit = itMeas->recHit();
+      if ( !cachedHit( hit ) ) continue;
+
+      const LocalPoint position = hit->localPosition();
+      const LocalError error = hit->localPositionError();
+
+      KalmanAlignmentCheckpoint::write( theStream, static_cast< unsigned int >( hit->geographicalId().rawId() ) );
+      KalmanAlignmentCheckpoint::write( theStream, hit->dimension() );
+      KalmanAlignmentCheckpoint::write( theStream, static_cast< float >( position.x() ) );
+      KalmanAlignmentCheckpoint::write( theStream, static_cast< float >( position.y() ) );
+      KalmanAlignmentCheckpoint::write( theStream, static_cast< float >( error.xx() ) );
+      KalmanAlignmentCheckpoint::write( theStream, static_cast< float >( error.xy() ) );
+      KalmanAlignmentCheckpoint::write( theStream, static_cast< float >( error.yy() ) );
+      KalmanAlignmentCheckpoint::write( theStream, static_cast< float >( itMeas->estimate() ) );
+
+      const unsigned int stateId = itMeas->updatedState().isValid() ? surfaceId( itMeas->updatedState(), trajectory ) : 0;
+      KalmanAlignmentCheckpoint::write( theStream, ( stateId != 0 ) );
+      if ( stateId != 0 ) write( itMeas->updatedState(), stateId );
+    }
+  }
+
+  if ( !theStream )
+    throw cms::Exception( "LogicError" ) << "[KalmanAlignmentTrackletCache::write] Could not write to " << theFileName;
+
+  ++theNumberOfEvents;
+  theNumberOfTracklets += cached.size();
+}
+
+
+bool KalmanAlignmentTrackletCache::read( const AlignmentSetupCollection& setups,
+					 const TrackingGeometry* geometry,
+					 const MagneticField* magneticField,
+					 TrackletCollection& tracklets,
+					 reco::BeamSpot& beamSpot )
+{
+  tracklets.clear();
+
+  unsigned int nTracklets = 0;
+  KalmanAlignmentCheckpoint::read( theStream, nTracklets );
+  if ( theStream.eof() ) return false;
+
+  double x0, y0, z0, sigmaZ, dxdz, dydz, widthX, widthY;
+  int type;
+  KalmanAlignmentCheckpoint::read( theStream, x0 );
+  KalmanAlignmentCheckpoint::read( theStream, y0 );
+  KalmanAlignmentCheckpoint::read( theStream, z0 );
+  KalmanAlignmentCheckpoint::read( theStream, sigmaZ );
+  KalmanAlignmentCheckpoint::read( theStream, dxdz );
+  KalmanAlignmentCheckpoint::read( theStream, dydz );
+  KalmanAlignmentCheckpoint::read( theStream, widthX );
+  KalmanAlignmentCheckpoint::read( theStream, widthY );
+  KalmanAlignmentCheckpoint::read( theStream, type );
+
+  reco::BeamSpot::CovarianceMatrix beamSpotCovariance;
+  for ( int i = 0; i < reco::BeamSpot::dimension; ++i )
+    for ( int j = 0; j <= i; ++j ) KalmanAlignmentCheckpoint::read( theStream, beamSpotCovariance( i, j ) );
+
+  beamSpot = reco::BeamSpot( reco::BeamSpot::Point( x0, y0, z0 ), sigmaZ, dxdz, dydz, widthX,
+			     beamSpotCovariance, static_cast< reco::BeamSpot::BeamType >( type ) );
+  beamSpot.setBeamWidthY( widthY );
+
+  for ( unsigned int iTracklet = 0; iTracklet < nTracklets; ++iTracklet )
+  {
+    const string setupId = readString( theStream );
+
+    KalmanAlignmentSetup* setup = 0;
+    AlignmentSetupCollection::const_iterator itSetup;
+    for ( itSetup = setups.begin(); itSetup != setups.end(); ++itSetup )
+      if ( (*itSetup)->id() == setupId ) setup = *itSetup;
+
+    if ( !setup )
+      throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentTrackletCache::read] "
+					  << theFileName << " holds tracklets of the unknown alignment setup \'" << setupId << "\'.";
+
+    bool externalFlag = false;
+    TrajectoryStateOnSurface externalPrediction;
+    KalmanAlignmentCheckpoint::read( theStream, externalFlag );
+    if ( externalFlag ) externalPrediction = readState( geometry, magneticField );
+
+    double chi2, ndof, vx, vy, vz, px, py, pz;
+    int charge;
+    KalmanAlignmentCheckpoint::read( theStream, chi2 );
+    KalmanAlignmentCheckpoint::read( theStream, ndof );
+    KalmanAlignmentCheckpoint::read( theStream, vx );
+    KalmanAlignmentCheckpoint::read( theStream, vy );
+    KalmanAlignmentCheckpoint::read( theStream, vz );
+    KalmanAlignmentCheckpoint::read( theStream, px );
+    KalmanAlignmentCheckpoint::read( theStream, py );
+    KalmanAlignmentCheckpoint::read( theStream, pz );
+    KalmanAlignmentCheckpoint::read( theStream, charge );
+
+    reco::Track::CovarianceMatrix trackCovariance;
+    for ( int i = 0; i < reco::Track::dimension; ++i )
+      for ( int j = 0; j <= i; ++j ) KalmanAlignmentCheckpoint::read( theStream, trackCovariance( i, j ) );
+
+    int direction = 0;
+    unsigned int nHits = 0;
+    KalmanAlignmentCheckpoint::read( theStream, direction );
+    KalmanAlignmentCheckpoint::read( theStream, nHits );
+
+    Trajectory* trajectory = new Trajectory( TrajectorySeed(), static_cast< PropagationDirection >( direction ) );
+
+    for ( unsigned int iHit = 0; iHit < nHits && theStream.good(); ++iHit )
+    {
+      unsigned int rawId = 0;
+      int dimension = 0;
+      float x, y, xx, xy, yy, estimate;
+      bool stateFlag = false;
+      KalmanAlignmentCheckpoint::read( theStream, rawId );
+      KalmanAlignmentCheckpoint::read( theStream, dimension );
+      KalmanAlignmentCheckpoint::read( theStream, x );
+      KalmanAlignmentCheckpoint::read( theStream, y );
+      KalmanAlignmentCheckpoint::read( theStream, xx );
+      KalmanAlignmentCheckpoint::read( theStream, xy );
+      KalmanAlignmentCheckpoint::read( theStream, yy );
+      KalmanAlignmentCheckpoint::read( theStream, estimate );
+      KalmanAlignmentCheckpoint::read( theStream, stateFlag );
+
+      TrajectoryStateOnSurface state;
+      if ( stateFlag ) state = readState( geometry, magneticField );
+
+      const GeomDet* det = geometry->idToDet( DetId( rawId ) );
+      if ( !det )
+      {
+	delete trajectory;
+	throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentTrackletCache::read] "
+					    << theFileName << " holds hits on DetId " << rawId << ", which is not in the geometry.";
+      }
+
+      TransientTrackingRecHit::RecHitPointer hit;
+      if ( dimension == 1 )
+      {
+	CachedRecHit1D cachedHit( DetId( rawId ), LocalPoint( x, y ), LocalError( xx, xy, yy ) );
+	hit = GenericTransientTrackingRecHit::build( det, &cachedHit );
+      }
+      else
+      {
+	CachedRecHit2D cachedHit( DetId( rawId ), LocalPoint( x, y ), LocalError( xx, xy, yy ) );
+	hit = GenericTransientTrackingRecHit::build( det, &cachedHit );
+      }
+
+      trajectory->push( TrajectoryMeasurement( state, state, state, hit, estimate ) );
+    }
+
+    if ( !theStream )
+    {
+      delete trajectory;
+      throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentTrackletCache::read] " << theFileName << " is truncated.";
+    }
+
+    reco::Track* track = new reco::Track( chi2, ndof, reco::Track::Point( vx, vy, vz ),
+					  reco::Track::Vector( px, py, pz ), charge, trackCovariance );
+
+    KalmanAlignmentTracklet::TrajTrackPair trajTrackPair( trajectory, track );
+    TrackletPtr tracklet( externalFlag ?
+			  new KalmanAlignmentTracklet( trajTrackPair, externalPrediction, setup ) :
+			  new KalmanAlignmentTracklet( trajTrackPair, setup ) );
+    tracklets.push_back( tracklet );
+  }
+
+  ++theNumberOfEvents;
+  theNumberOfTracklets += tracklets.size();
+
+  return true;
+}
+
+
+unsigned int KalmanAlignmentTrackletCache::surfaceId( const TrajectoryStateOnSurface& state, const Trajectory* trajectory )
+{
+  const Trajectory::DataContainer& measurements = trajectory->measurements();
+  Trajectory::DataContainer::const_iterator itMeas;
+  for ( itMeas = measurements.begin(); itMeas != measurements.end(); ++itMeas )
+  {
+    const TransientTrackingRecHit::ConstRecHitPointer& hit = itMeas->recHit();
+    if ( cachedHit( hit ) && &hit->det()->surface() == &state.surface() ) return hit->geographicalId().rawId();
+  }
+
+  return 0;
+}
+
+
+bool KalmanAlignmentTrackletCache::cacheable( const KalmanAlignmentTracklet* tracklet )
+{
+  const Trajectory::DataContainer& measurements = tracklet->trajectory()->measurements();
+
+  unsigned int nHits = 0;
+  Trajectory::DataContainer::const_iterator itMeas;
+  for ( itMeas = measurements.begin(); itMeas != measurements.end(); ++itMeas )
+    if ( cachedHit( itMeas->recHit() ) ) ++nHits;
+
+  if ( nHits < 2 ) return false;
+
+  return ( !tracklet->externalPredictionAvailable() ||
+	   surfaceId( tracklet->externalPrediction(), tracklet->trajectory() ) != 0 );
+}
+
+
+void KalmanAlignmentTrackletCache::write( const TrajectoryStateOnSurface& state, unsigned int surfaceId )
+{
+  const AlgebraicVector5 parameters = state.localParameters().vector();
+
+  KalmanAlignmentCheckpoint::write( theStream, surfaceId );
+  KalmanAlignmentCheckpoint::write( theStream, static_cast< int >( state.surfaceSide() ) );
+  KalmanAlignmentCheckpoint::write( theStream, static_cast< int >( state.localParameters().charge() ) );
+  KalmanAlignmentCheckpoint::write( theStream, static_cast< double >( state.localParameters().pzSign() ) );
+  for ( int i = 0; i < 5; ++i ) KalmanAlignmentCheckpoint::write( theStream, parameters[i] );
+
+  KalmanAlignmentCheckpoint::write( theStream, state.hasError() );
+  if ( !state.hasError() ) return;
+
+  const AlgebraicSymMatrix55& error = state.localError().matrix();
+  for ( int i = 0; i < 5; ++i )
+    for ( int j = 0; j <= i; ++j ) KalmanAlignmentCheckpoint::write( theStream, error( i, j ) );
+}
+
+
+TrajectoryStateOnSurface KalmanAlignmentTrackletCache::readState( const TrackingGeometry* geometry,
+								  const MagneticField* magneticField )
+{
+  unsigned int rawId = 0;
+  int side = 0;
+  int charge = 0;
+  double pzSign = 0.;
+  AlgebraicVector5 parameters;
+  bool errorFlag = false;
+
+  KalmanAlignmentCheckpoint::read( theStream, rawId );
+  KalmanAlignmentCheckpoint::read( theStream, side );
+  KalmanAlignmentCheckpoint::read( theStream, charge );
+  KalmanAlignmentCheckpoint::read( theStream, pzSign );
+  for ( int i = 0; i < 5; ++i ) KalmanAlignmentCheckpoint::read( theStream, parameters[i] );
+  KalmanAlignmentCheckpoint::read( theStream, errorFlag );
+
+  AlgebraicSymMatrix55 error;
+  if ( errorFlag )
+    for ( int i = 0; i < 5; ++i )
+      for ( int j = 0; j <= i; ++j ) KalmanAlignmentCheckpoint::read( theStream, error( i, j ) );
+
+  const GeomDet* det = geometry->idToDet( DetId( rawId ) );
+  if ( !det )
+    throw cms::Exception( "BadConfig" ) << "[KalmanAlignmentTrackletCache::read] "
+					<< theFileName << " holds states on DetId " << rawId << ", which is not in the geometry.";
+
+  // The states are placed on the surfaces of the current geometry.
+  const LocalTrajectoryParameters localParameters( parameters, pzSign, charge != 0 );
+  const SurfaceSideDefinition::SurfaceSide surfaceSide = static_cast< SurfaceSideDefinition::SurfaceSide >( side );
+
+  return errorFlag ?
+    TrajectoryStateOnSurface( localParameters, LocalTrajectoryError( error ), det->surface(), magneticField, surfaceSide ) :
+    TrajectoryStateOnSurface( localParameters, det->surface(), magneticField, surfaceSide );
+}
@@ -1,29 +1,47 @@
 
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentUpdator.h"
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentUserVariables.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentCheckpoint.h"
 #include "Alignment/CommonAlignment/interface/AlignmentParameters.h"
 
+#include <algorithm>
 
-void KalmanAlignmentUpdator::updateUserVariables( const std::vector< Alignable* > & alignables ) const
+
+void KalmanAlignmentUpdator::writeState( std::ostream& out ) const
 {
-  std::vector< Alignable* > updated;
-  std::vector< Alignable* >::const_iterator itAlignable = alignables.begin();
+  KalmanAlignmentCheckpoint::write( out, theNumberOfProcessedTrajectories );
+  KalmanAlignmentCheckpoint::write( out, theNumberOfRejectedUpdates );
+  KalmanAlignmentCheckpoint::write( out, theNumberOfSkippedTrajectories );
+}
 
-  while ( itAlignable != alignables.end() )
-  {
-    AlignmentParameters* alignmentParameters = ( *itAlignable )->alignmentParameters();
 
-    if ( std::find(updated.begin(),updated.end(),*itAlignable) == updated.end() && alignmentParameters != 0 )
-    {
-      KalmanAlignmentUserVariables* userVariables =
-	dynamic_cast< KalmanAlignmentUserVariables* >( alignmentParameters->userVariables() );
+void KalmanAlignmentUpdator::readState( std::istream& in )
+{
+  KalmanAlignmentCheckpoint::read( in, theNumberOfProcessedTrajectories );
+  KalmanAlignmentCheckpoint::read( in, theNumberOfRejectedUpdates );
+  KalmanAlignmentCheckpoint::read( in, theNumberOfSkippedTrajectories );
+}
 
-      if ( userVariables != 0 ) userVariables->update();
 
-      updated.push_back( *itAlignable );
-    }
+std::mutex& KalmanAlignmentUpdator::storeMutex( void )
+{
+  static std::mutex theStoreMutex;
+  return theStoreMutex;
+}
 
-    ++itAlignable;
+
+void KalmanAlignmentUpdator::updateUserVariables( const std::vector< Alignable* > & alignables ) const
+{
+  // Alignables hit more than once are updated only once: they are marked with the current epoch.
+  const unsigned long epoch = KalmanAlignmentUserVariables::newEpoch();
+
+  std::vector< Alignable* >::const_iterator itAlignable;
+  for ( itAlignable = alignables.begin(); itAlignable != alignables.end(); ++itAlignable )
+  {
+    int index = KalmanAlignmentUserVariables::index( *itAlignable );
+
+    if ( index >= 0 && ( *itAlignable )->alignmentParameters() != 0 && KalmanAlignmentUserVariables::mark( index, epoch ) )
+      KalmanAlignmentUserVariables::update( index );
   }
 }
 
@@ -45,11 +63,42 @@ KalmanAlignmentUpdator::alignablesFromAlignableDets( std::vector< AlignableDetOr
 }
 
 
+bool KalmanAlignmentUpdator::allConverged( const std::vector< Alignable* >& alignables ) const
+{
+  std::vector< Alignable* >::const_iterator itAlignable;
+  for ( itAlignable = alignables.begin(); itAlignable != alignables.end(); ++itAlignable )
+  {
+    int index = KalmanAlignmentUserVariables::index( *itAlignable );
+    if ( index < 0 || !KalmanAlignmentUserVariables::converged( index ) ) return false;
+  }
+
+  return true;
+}
+
+
 unsigned int
 KalmanAlignmentUpdator::nDifferentAlignables( const std::vector<Alignable*>& ali ) const
 {
-  std::set< Alignable* > list;
-  list.insert( ali.begin(), ali.end() );
-  unsigned int ndiff = list.size();
+  const unsigned long epoch = KalmanAlignmentUserVariables::newEpoch();
+
+  unsigned int ndiff = 0;
+  std::vector< Alignable* > others;
+
+  std::vector< Alignable* >::const_iterator itAlignable;
+  for ( itAlignable = ali.begin(); itAlignable != ali.end(); ++itAlignable )
+  {
+    int index = KalmanAlignmentUserVariables::index( *itAlignable );
+
+    if ( index < 0 ) others.push_back( *itAlignable );
+    else if ( KalmanAlignmentUserVariables::mark( index, epoch ) ) ++ndiff;
+  }
+
+  // Alignables without KalmanAlignmentUserVariables (should not happen, but be safe).
+  if ( !others.empty() )
+  {
+    std::sort( others.begin(), others.end() );
+    ndiff += std::unique( others.begin(), others.end() ) - others.begin();
+  }
+
   return ndiff;
 }
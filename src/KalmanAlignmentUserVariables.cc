@@ -1,6 +1,7 @@
 
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentUserVariables.h"
 #include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentDataCollector.h"
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentCheckpoint.h"
 
 #include "Alignment/CommonAlignment/interface/AlignmentParameters.h"
 #include "Alignment/CommonAlignment/interface/Utilities.h"
@@ -16,18 +17,34 @@ using namespace std;
 
 const TrackerAlignableId* KalmanAlignmentUserVariables::theAlignableId = new TrackerAlignableId;
 
+vector< KalmanAlignmentUserVariables::Bookkeeping > KalmanAlignmentUserVariables::theBookkeeping;
+vector< KalmanAlignmentUserVariables::Evolution > KalmanAlignmentUserVariables::theEvolution;
+unordered_map< const Alignable*, int > KalmanAlignmentUserVariables::theIndexMap;
+std::atomic< unsigned long > KalmanAlignmentUserVariables::theEpoch( 0 );
+
+unsigned int KalmanAlignmentUserVariables::theSnapshotBufferSize = 64;
+
+unsigned int KalmanAlignmentUserVariables::theConvergenceWindow = 0;
+double KalmanAlignmentUserVariables::theConvergenceThreshold = 0.01;
+
 KalmanAlignmentUserVariables::KalmanAlignmentUserVariables( Alignable* parent,
                                                             const TrackerTopology* tTopo,
 							    int frequency ) :
-    theParentAlignable( parent ),
-    theNumberOfHits( 0 ),
-    theNumberOfUpdates( 0 ),
-    theUpdateFrequency( frequency ),
-    theFirstUpdate( true ),
-    theAlignmentFlag( false )
+    theIndex( -1 )
 {
   if ( parent )
   {
+    theIndex = theBookkeeping.size();
+    theIndexMap[parent] = theIndex;
+
+    theBookkeeping.push_back( Bookkeeping() );
+    theEvolution.push_back( Evolution() );
+
+    Evolution& evolution = theEvolution.back();
+    evolution.parent = parent;
+    evolution.updateFrequency = frequency;
+    evolution.snapshots.reserve( theSnapshotBufferSize + 1 );
+
     pair< int, int > typeAndLayer = theAlignableId->typeAndLayerFromDetId( parent->geomDetId(), tTopo );
 
     int iType = typeAndLayer.first;
@@ -39,171 +56,282 @@ KalmanAlignmentUserVariables::KalmanAlignmentUserVariables( Alignable* parent,
     string strLayer = string( "Layer" ) + toString( iLayer ) + string( "_" );
     string strId =  string( "Id" ) + toString( iId );
 
-    theTypeAndLayer = strType + strLayer;
-    theIdentifier = theTypeAndLayer + strName + strId;
-    
+    evolution.typeAndLayer = strType + strLayer;
+    evolution.identifier = evolution.typeAndLayer + strName + strId;
+
+#ifdef USE_LOCAL_PARAMETERS
+    const string strDelta( "LocalDelta" );
+#else
+    const string strDelta( "GlobalDelta" );
+#endif
+
+    for ( int i = 0; i < theNumberOfParameters; ++i )
+    {
+      string parameterId = selectedParameter( i ) + string( "_" ) + evolution.identifier;
+      evolution.deltaGraphs[i] = KalmanAlignmentDataCollector::registerGraph( strDelta + parameterId );
+      evolution.sigmaGraphs[i] = KalmanAlignmentDataCollector::registerGraph( string("LocalSigma") + parameterId );
+    }
   }
-  else theIdentifier = string( "NoAlignable" );
 }
 
 
 //KalmanAlignmentUserVariables::~KalmanAlignmentUserVariables( void ) {}
 
 
-void KalmanAlignmentUserVariables::update( bool enforceUpdate )
+int KalmanAlignmentUserVariables::index( const Alignable* alignable )
+{
+  unordered_map< const Alignable*, int >::const_iterator itIndex = theIndexMap.find( alignable );
+  return ( itIndex == theIndexMap.end() ) ? -1 : itIndex->second;
+}
+
+
+void KalmanAlignmentUserVariables::update( int index, bool enforceUpdate )
 {
-  if ( theParentAlignable )
+  Bookkeeping& bookkeeping = theBookkeeping[index];
+  const Evolution& evolution = theEvolution[index];
+
+  ++bookkeeping.numberOfUpdates;
+
+  if ( theConvergenceWindow > 0 &&
+       bookkeeping.numberOfUpdates - bookkeeping.windowStart >= static_cast< int >( theConvergenceWindow ) )
+    checkConvergence( index );
+
+  if ( ( ( bookkeeping.numberOfUpdates % evolution.updateFrequency == 0  ) || enforceUpdate ) &&
+       KalmanAlignmentDataCollector::instrumented( KalmanAlignmentDataCollector::AlignableEvolution ) )
   {
-    ++theNumberOfUpdates;
+    recordSnapshot( index );
+    if ( enforceUpdate || evolution.snapshots.size() >= theSnapshotBufferSize ) flushSnapshots( index );
+  }
+}
 
-    if ( ( ( theNumberOfUpdates % theUpdateFrequency == 0  ) || enforceUpdate ) )
-    {
 
-#ifdef USE_LOCAL_PARAMETERS
+void KalmanAlignmentUserVariables::writeState( ostream& out, const KalmanAlignmentCheckpoint& checkpoint )
+{
+  KalmanAlignmentCheckpoint::write( out, static_cast< unsigned int >( theBookkeeping.size() ) );
 
-      const AlgebraicVector parameters = theParentAlignable->alignmentParameters()->selectedParameters();
-      const AlgebraicSymMatrix covariance = theParentAlignable->alignmentParameters()->selectedCovariance();
-      const vector< bool >& selector = theParentAlignable->alignmentParameters()->selector();
+  for ( unsigned int index = 0; index < theBookkeeping.size(); ++index )
+  {
+    const Bookkeeping& bookkeeping = theBookkeeping[index];
+
+    KalmanAlignmentCheckpoint::write( out, checkpoint.index( theEvolution[index].parent ) );
+    KalmanAlignmentCheckpoint::write( out, bookkeeping.numberOfHits );
+    KalmanAlignmentCheckpoint::write( out, bookkeeping.numberOfUpdates );
+    KalmanAlignmentCheckpoint::write( out, bookkeeping.firstUpdate );
+    KalmanAlignmentCheckpoint::write( out, bookkeeping.alignmentFlag );
+    KalmanAlignmentCheckpoint::write( out, bookkeeping.windowStart );
+    KalmanAlignmentCheckpoint::write( out, bookkeeping.windowVariance );
+    KalmanAlignmentCheckpoint::write( out, bookkeeping.converged );
+  }
+}
 
-      AlgebraicVector trueParameters( extractTrueParameters() );
 
-      const int nParameter = 6;
-      int selected = 0;
-      
-      for ( int i = 0; i < nParameter; ++i )
-      {
-	if ( selector[i] )
-	{
-	  string parameterId = selectedParameter( i ) + string( "_" ) + theIdentifier;
+void KalmanAlignmentUserVariables::readState( istream& in, const KalmanAlignmentCheckpoint& checkpoint )
+{
+  unsigned int nEntries = 0;
+  KalmanAlignmentCheckpoint::read( in, nEntries );
 
-	  if ( theFirstUpdate )
-	  {
-	    KalmanAlignmentDataCollector::fillGraph( string("LocalDelta") + parameterId, 0, -trueParameters[i]/selectedScaling(i) );
-	    KalmanAlignmentDataCollector::fillGraph( string("LocalSigma") + parameterId, 0, sqrt(covariance[selected][selected])/selectedScaling(i) );
-	  }
+  for ( unsigned int iEntry = 0; iEntry < nEntries && in.good(); ++iEntry )
+  {
+    int alignableIndex = -1;
+    Bookkeeping bookkeeping;
+
+    KalmanAlignmentCheckpoint::read( in, alignableIndex );
+    KalmanAlignmentCheckpoint::read( in, bookkeeping.numberOfHits );
+    KalmanAlignmentCheckpoint::read( in, bookkeeping.numberOfUpdates );
+    KalmanAlignmentCheckpoint::read( in, bookkeeping.firstUpdate );
+    KalmanAlignmentCheckpoint::read( in, bookkeeping.alignmentFlag );
+    KalmanAlignmentCheckpoint::read( in, bookkeeping.windowStart );
+    KalmanAlignmentCheckpoint::read( in, bookkeeping.windowVariance );
+    KalmanAlignmentCheckpoint::read( in, bookkeeping.converged );
+
+    int index = KalmanAlignmentUserVariables::index( checkpoint.alignable( alignableIndex ) );
+    if ( index >= 0 ) theBookkeeping[index] = bookkeeping;
+  }
+}
 
-	  KalmanAlignmentDataCollector::fillGraph( string("LocalDelta") + parameterId, theNumberOfUpdates/theUpdateFrequency, (parameters[selected]-trueParameters[i])/selectedScaling(i) );
-	  KalmanAlignmentDataCollector::fillGraph( string("LocalSigma") + parameterId, theNumberOfUpdates/theUpdateFrequency, sqrt(covariance[selected][selected])/selectedScaling(i) );
 
-	  selected++;
-	}
-      }
+void KalmanAlignmentUserVariables::checkConvergence( int index )
+{
+  Bookkeeping& bookkeeping = theBookkeeping[index];
+  const AlignmentParameters* parameters = theEvolution[index].parent->alignmentParameters();
 
-      if ( theFirstUpdate ) theFirstUpdate = false;
+  const AlgebraicSymMatrix& covariance = parameters->covariance();
+  const vector< bool >& selector = parameters->selector();
 
-#else
+  float variance = 0.;
+  for ( int i = 0; i < theNumberOfParameters; ++i )
+    if ( selector[i] ) variance += covariance[i][i];
 
-      const AlgebraicVector& parameters = theParentAlignable->alignmentParameters()->parameters();
-      const AlgebraicSymMatrix& covariance = theParentAlignable->alignmentParameters()->covariance();
+  // The first window only provides the reference.
+  if ( bookkeeping.windowVariance > 0. )
+    bookkeeping.converged = ( bookkeeping.windowVariance - variance < theConvergenceThreshold*bookkeeping.windowVariance );
 
-      const AlignableSurface& surface = theParentAlignable->surface();
+  bookkeeping.windowStart = bookkeeping.numberOfUpdates;
+  bookkeeping.windowVariance = variance;
+}
 
-      // Get global euler angles.
-      align::EulerAngles localEulerAngles( parameters.sub( 4, 6 ) );
-      const align::RotationType localRotation = align::toMatrix( localEulerAngles );
-      const align::RotationType globalRotation = surface.toGlobal( localRotation );
-      align::EulerAngles globalEulerAngles = align::toAngles( globalRotation );
 
-      // Get global shifts.
-      align::LocalVector localShifts( parameters[0], parameters[1], parameters[2] );
-      align::GlobalVector globalShifts( surface.toGlobal( localShifts ) );
+void KalmanAlignmentUserVariables::recordSnapshot( int index )
+{
+  Bookkeeping& bookkeeping = theBookkeeping[index];
+  Evolution& evolution = theEvolution[index];
 
-      const int nParameter = 6;
-      AlgebraicVector globalParameters( nParameter );
-      globalParameters[0] = globalShifts.x();
-      globalParameters[1] = globalShifts.y();
-      globalParameters[2] = globalShifts.z();
-      globalParameters[3] = globalEulerAngles[0];
-      globalParameters[4] = globalEulerAngles[1];
-      globalParameters[5] = globalEulerAngles[2];
+  const AlgebraicVector& parameters = evolution.parent->alignmentParameters()->parameters();
+  const AlgebraicSymMatrix& covariance = evolution.parent->alignmentParameters()->covariance();
 
-      AlgebraicVector trueParameters( extractTrueParameters() );
-      
-      for ( int i = 0; i < nParameter; ++i )
-      {
-	string parameterId = selectedParameter( i ) + string( "_" ) + theIdentifier;
+  EvolutionSnapshot snapshot;
+  snapshot.step = bookkeeping.numberOfUpdates/evolution.updateFrequency;
+  snapshot.first = bookkeeping.firstUpdate;
 
-	if ( theFirstUpdate )
-	{
-	  KalmanAlignmentDataCollector::fillGraph( string("GlobalDelta") + parameterId, 0, -trueParameters[i]/selectedScaling(i) );
-	  KalmanAlignmentDataCollector::fillGraph( string("LocalSigma") + parameterId, 0, sqrt(covariance[i][i])/selectedScaling(i) );
-	}
+  for ( int i = 0; i < theNumberOfParameters; ++i )
+  {
+    snapshot.parameters[i] = parameters[i];
+    snapshot.sigmas[i] = sqrt( covariance[i][i] );
+  }
 
-	KalmanAlignmentDataCollector::fillGraph( string("GlobalDelta") + parameterId, theNumberOfUpdates/theUpdateFrequency, (globalParameters[i]-trueParameters[i])/selectedScaling(i) );
-	KalmanAlignmentDataCollector::fillGraph( string("LocalSigma") + parameterId, theNumberOfUpdates/theUpdateFrequency, sqrt(covariance[i][i])/selectedScaling(i) );
-      }
+  evolution.snapshots.push_back( snapshot );
+
+  if ( bookkeeping.firstUpdate ) bookkeeping.firstUpdate = false;
+}
 
-      if ( theFirstUpdate ) theFirstUpdate = false;
 
+void KalmanAlignmentUserVariables::flushSnapshots( int index )
+{
+  Evolution& evolution = theEvolution[index];
+
+  if ( evolution.snapshots.empty() ) return;
+
+  AlgebraicVector trueParameters( extractTrueParameters( evolution.parent ) );
+
+#ifdef USE_LOCAL_PARAMETERS
+  const vector< bool >& selector = evolution.parent->alignmentParameters()->selector();
+#else
+  const AlignableSurface& surface = evolution.parent->surface();
 #endif
 
+  EvolutionBuffer::const_iterator itSnapshot;
+  for ( itSnapshot = evolution.snapshots.begin(); itSnapshot != evolution.snapshots.end(); ++itSnapshot )
+  {
+    float values[theNumberOfParameters];
+
+#ifdef USE_LOCAL_PARAMETERS
+
+    for ( int i = 0; i < theNumberOfParameters; ++i ) values[i] = itSnapshot->parameters[i];
+
+#else
+
+    // Get global euler angles.
+    align::EulerAngles localEulerAngles( 3 );
+    localEulerAngles[0] = itSnapshot->parameters[3];
+    localEulerAngles[1] = itSnapshot->parameters[4];
+    localEulerAngles[2] = itSnapshot->parameters[5];
+    const align::RotationType localRotation = align::toMatrix( localEulerAngles );
+    const align::RotationType globalRotation = surface.toGlobal( localRotation );
+    align::EulerAngles globalEulerAngles = align::toAngles( globalRotation );
+
+    // Get global shifts.
+    align::LocalVector localShifts( itSnapshot->parameters[0], itSnapshot->parameters[1], itSnapshot->parameters[2] );
+    align::GlobalVector globalShifts( surface.toGlobal( localShifts ) );
+
+    values[0] = globalShifts.x();
+    values[1] = globalShifts.y();
+    values[2] = globalShifts.z();
+    values[3] = globalEulerAngles[0];
+    values[4] = globalEulerAngles[1];
+    values[5] = globalEulerAngles[2];
+
+#endif
+
+    for ( int i = 0; i < theNumberOfParameters; ++i )
+    {
+#ifdef USE_LOCAL_PARAMETERS
+      if ( !selector[i] ) continue;
+#endif
+
+      if ( itSnapshot->first )
+      {
+	KalmanAlignmentDataCollector::fillGraph( evolution.deltaGraphs[i], 0, -trueParameters[i]/selectedScaling(i) );
+	KalmanAlignmentDataCollector::fillGraph( evolution.sigmaGraphs[i], 0, itSnapshot->sigmas[i]/selectedScaling(i) );
+      }
+
+      KalmanAlignmentDataCollector::fillGraph( evolution.deltaGraphs[i], itSnapshot->step, (values[i]-trueParameters[i])/selectedScaling(i) );
+      KalmanAlignmentDataCollector::fillGraph( evolution.sigmaGraphs[i], itSnapshot->step, itSnapshot->sigmas[i]/selectedScaling(i) );
     }
   }
+
+  evolution.snapshots.clear();
 }
 
 
 void KalmanAlignmentUserVariables::update( const AlignmentParameters* param )
 {
-  if ( theParentAlignable )
+  if ( theIndex >= 0 )
   {
-    ++theNumberOfUpdates;
+    Bookkeeping& bookkeeping = theBookkeeping[theIndex];
+    const Evolution& evolution = theEvolution[theIndex];
+
+    ++bookkeeping.numberOfUpdates;
+
+    if ( !KalmanAlignmentDataCollector::instrumented( KalmanAlignmentDataCollector::AlignableEvolution ) ) return;
 
     const AlgebraicVector& parameters = param->selectedParameters();
     const AlgebraicSymMatrix& covariance = param->selectedCovariance();
     const vector< bool >& selector = param->selector();
 
-    AlgebraicVector trueParameters( extractTrueParameters() );
+    AlgebraicVector trueParameters( extractTrueParameters( evolution.parent ) );
 
     const int nParameter = 6;
     int selected = 0;
-      
+
     for ( int i = 0; i < nParameter; ++i )
     {
       if ( selector[i] )
       {
-	string parameterId = selectedParameter( i ) + string( "_" ) + theIdentifier;
+	string parameterId = selectedParameter( i ) + string( "_" ) + evolution.identifier;
 
-	KalmanAlignmentDataCollector::fillGraph( string("Delta") + parameterId, theNumberOfUpdates/theUpdateFrequency, (parameters[selected]-trueParameters[i])/selectedScaling(i) );
-	KalmanAlignmentDataCollector::fillGraph( string("Sigma") + parameterId, theNumberOfUpdates/theUpdateFrequency, sqrt(covariance[selected][selected])/selectedScaling(i) );
+	KalmanAlignmentDataCollector::fillGraph( string("Delta") + parameterId, bookkeeping.numberOfUpdates/evolution.updateFrequency, (parameters[selected]-trueParameters[i])/selectedScaling(i) );
+	KalmanAlignmentDataCollector::fillGraph( string("Sigma") + parameterId, bookkeeping.numberOfUpdates/evolution.updateFrequency, sqrt(covariance[selected][selected])/selectedScaling(i) );
 
 	selected++;
       }
     }
 
-    if ( theFirstUpdate ) theFirstUpdate = false;
+    if ( bookkeeping.firstUpdate ) bookkeeping.firstUpdate = false;
   }
 }
 
 
 void KalmanAlignmentUserVariables::histogramParameters( string histoNamePrefix )
 {
-  if ( theParentAlignable )
+  if ( theIndex >= 0 )
   {
+    const Alignable* parent = theEvolution[theIndex].parent;
+    const string& typeAndLayer = theEvolution[theIndex].typeAndLayer;
 
 #ifdef USE_LOCAL_PARAMETERS
 
-    AlgebraicVector parameters = theParentAlignable->alignmentParameters()->selectedParameters();
-    AlgebraicSymMatrix covariance = theParentAlignable->alignmentParameters()->selectedCovariance();
-    vector< bool > selector = theParentAlignable->alignmentParameters()->selector();
+    AlgebraicVector parameters = parent->alignmentParameters()->selectedParameters();
+    AlgebraicSymMatrix covariance = parent->alignmentParameters()->selectedCovariance();
+    vector< bool > selector = parent->alignmentParameters()->selector();
 
-    AlgebraicVector trueParameters = extractTrueParameters();
+    AlgebraicVector trueParameters = extractTrueParameters( parent );
 
     const int nParameter = 6;
     int selected = 0;
 
-    //histoNamePrefix += theTypeAndLayer;
+    //histoNamePrefix += typeAndLayer;
       
     for ( int i = 0; i < nParameter; ++i )
     {
       if ( selector[i] )
       {
-	string startHistoName = histoNamePrefix + theTypeAndLayer + string( "_Start" ) + selectedParameter( i );
+	string startHistoName = histoNamePrefix + typeAndLayer + string( "_Start" ) + selectedParameter( i );
 	KalmanAlignmentDataCollector::fillHistogram( startHistoName, -trueParameters[i]/selectedScaling(i) );
 
-	string deltaHistoName = histoNamePrefix + theTypeAndLayer + string( "_Delta" ) + selectedParameter( i );
+	string deltaHistoName = histoNamePrefix + typeAndLayer + string( "_Delta" ) + selectedParameter( i );
 	KalmanAlignmentDataCollector::fillHistogram( deltaHistoName, (parameters[selected]-trueParameters[i])/selectedScaling(i) );
 
-	string pullsHistoName = histoNamePrefix + theTypeAndLayer + string( "_Pulls" ) + selectedParameter( i );
+	string pullsHistoName = histoNamePrefix + typeAndLayer + string( "_Pulls" ) + selectedParameter( i );
 	KalmanAlignmentDataCollector::fillHistogram( pullsHistoName, (parameters[selected]-trueParameters[i])/sqrt(covariance[selected][selected]) );
 
 	startHistoName = histoNamePrefix + string( "_Start" ) + selectedParameter( i );
@@ -221,9 +349,9 @@ void KalmanAlignmentUserVariables::histogramParameters( string histoNamePrefix )
 
 #else
 
-    const AlgebraicVector& parameters = theParentAlignable->alignmentParameters()->parameters();
+    const AlgebraicVector& parameters = parent->alignmentParameters()->parameters();
 
-    const AlignableSurface& surface = theParentAlignable->surface();
+    const AlignableSurface& surface = parent->surface();
 
     // Get global euler angles.
     align::EulerAngles localEulerAngles( parameters.sub( 4, 6 ) );
@@ -244,11 +372,11 @@ void KalmanAlignmentUserVariables::histogramParameters( string histoNamePrefix )
     globalParameters[4] = globalEulerAngles[1];
     globalParameters[5] = globalEulerAngles[2];
 
-    AlgebraicVector trueParameters( extractTrueParameters() );
+    AlgebraicVector trueParameters( extractTrueParameters( parent ) );
 
-    KalmanAlignmentDataCollector::fillGraph( "y_vs_dx", theParentAlignable->globalPosition().y(), trueParameters[0]-globalParameters[0] );
-    KalmanAlignmentDataCollector::fillGraph( "r_vs_dx", theParentAlignable->globalPosition().perp(), trueParameters[0]-globalParameters[0] );
-    KalmanAlignmentDataCollector::fillGraph( "y_vs_dx_true", theParentAlignable->globalPosition().y(), trueParameters[0] );
+    KalmanAlignmentDataCollector::fillGraph( "y_vs_dx", parent->globalPosition().y(), trueParameters[0]-globalParameters[0] );
+    KalmanAlignmentDataCollector::fillGraph( "r_vs_dx", parent->globalPosition().perp(), trueParameters[0]-globalParameters[0] );
+    KalmanAlignmentDataCollector::fillGraph( "y_vs_dx_true", parent->globalPosition().y(), trueParameters[0] );
       
     for ( int i = 0; i < nParameter; ++i )
     {
@@ -261,13 +389,13 @@ void KalmanAlignmentUserVariables::histogramParameters( string histoNamePrefix )
       string valueHistoName = histoNamePrefix + string( "_Value" ) + selectedParameter( i );
       KalmanAlignmentDataCollector::fillHistogram( valueHistoName, globalParameters[i]/selectedScaling(i) );
 
-      startHistoName = histoNamePrefix + theTypeAndLayer + string( "_Start" ) + selectedParameter( i );
+      startHistoName = histoNamePrefix + typeAndLayer + string( "_Start" ) + selectedParameter( i );
       KalmanAlignmentDataCollector::fillHistogram( startHistoName, -trueParameters[i]/selectedScaling(i) );
 
-      deltaHistoName = histoNamePrefix + theTypeAndLayer + string( "_Delta" ) + selectedParameter( i );
+      deltaHistoName = histoNamePrefix + typeAndLayer + string( "_Delta" ) + selectedParameter( i );
       KalmanAlignmentDataCollector::fillHistogram( deltaHistoName, (globalParameters[i]-trueParameters[i])/selectedScaling(i) );
 
-      valueHistoName = histoNamePrefix + theTypeAndLayer + string( "_Value" ) + selectedParameter( i );
+      valueHistoName = histoNamePrefix + typeAndLayer + string( "_Value" ) + selectedParameter( i );
       KalmanAlignmentDataCollector::fillHistogram( valueHistoName, globalParameters[i]/selectedScaling(i) );
     }
 
@@ -279,39 +407,41 @@ void KalmanAlignmentUserVariables::histogramParameters( string histoNamePrefix )
 
 void KalmanAlignmentUserVariables::fixAlignable( void )
 {
-  AlignmentParameters* oldParameters = theParentAlignable->alignmentParameters();
+  Alignable* parent = theEvolution[theIndex].parent;
+  AlignmentParameters* oldParameters = parent->alignmentParameters();
   AlgebraicSymMatrix fixedCovariance = 1e-6*oldParameters->covariance();
   AlignmentParameters* newParameters = oldParameters->clone( oldParameters->parameters(), fixedCovariance );
-  theParentAlignable->setAlignmentParameters( newParameters );
+  parent->setAlignmentParameters( newParameters );
 }
 
 
 void KalmanAlignmentUserVariables::unfixAlignable( void )
 {
-  AlignmentParameters* oldParameters = theParentAlignable->alignmentParameters();
+  Alignable* parent = theEvolution[theIndex].parent;
+  AlignmentParameters* oldParameters = parent->alignmentParameters();
   AlgebraicSymMatrix fixedCovariance = 1e6*oldParameters->covariance();
   AlignmentParameters* newParameters = oldParameters->clone( oldParameters->parameters(), fixedCovariance );
-  theParentAlignable->setAlignmentParameters( newParameters );
+  parent->setAlignmentParameters( newParameters );
 }
 
 
-const AlgebraicVector KalmanAlignmentUserVariables::extractTrueParameters( void ) const
+const AlgebraicVector KalmanAlignmentUserVariables::extractTrueParameters( const Alignable* alignable )
 {
 
 #ifdef USE_LOCAL_PARAMETERS
 
   // get surface of alignable
-  const AlignableSurface& surface = theParentAlignable->surface();
+  const AlignableSurface& surface = alignable->surface();
 
   // get global rotation
-  const align::RotationType& globalRotation = theParentAlignable->rotation();
+  const align::RotationType& globalRotation = alignable->rotation();
   // get local rotation
   align::RotationType localRotation = surface.toLocal( globalRotation );
   // get euler angles (local frame)
   align::EulerAngles localEulerAngles = align::toAngles( localRotation );
 
   // get global shifts
-  align::GlobalVector globalShifts( globalRotation.multiplyInverse( theParentAlignable->displacement().basicVector() ) );
+  align::GlobalVector globalShifts( globalRotation.multiplyInverse( alignable->displacement().basicVector() ) );
   // get local shifts
   align::LocalVector localShifts = surface.toLocal( globalShifts );
 
@@ -326,12 +456,12 @@ const AlgebraicVector KalmanAlignmentUserVariables::extractTrueParameters( void
 #else
 
   // get global rotation
-  const align::RotationType& globalRotation = theParentAlignable->rotation();
+  const align::RotationType& globalRotation = alignable->rotation();
   // get euler angles (global frame)
   align::EulerAngles globalEulerAngles = align::toAngles( globalRotation );
 
   // get global shifts
-  align::GlobalVector globalShifts( globalRotation.multiplyInverse( theParentAlignable->displacement().basicVector() ) );
+  align::GlobalVector globalShifts( globalRotation.multiplyInverse( alignable->displacement().basicVector() ) );
 
   AlgebraicVector trueParameters( 6 );
   trueParameters[0] = -globalShifts.x();
@@ -347,7 +477,7 @@ const AlgebraicVector KalmanAlignmentUserVariables::extractTrueParameters( void
 }
 
 
-const string KalmanAlignmentUserVariables::selectedParameter( const int& selected ) const
+const string KalmanAlignmentUserVariables::selectedParameter( const int& selected )
 {
   switch ( selected )
   {
@@ -376,7 +506,7 @@ const string KalmanAlignmentUserVariables::selectedParameter( const int& selecte
 }
 
 
-float KalmanAlignmentUserVariables::selectedScaling( const int& selected ) const
+float KalmanAlignmentUserVariables::selectedScaling( const int& selected )
 {
   const float micron = 1e-4;
   const float millirad = 1e-3;
@@ -402,7 +532,7 @@ float KalmanAlignmentUserVariables::selectedScaling( const int& selected ) const
 }
 
 
-const string KalmanAlignmentUserVariables::toString( const int& i ) const
+const string KalmanAlignmentUserVariables::toString( const int& i )
 {
   char temp[10];
   snprintf( temp, sizeof(temp), "%u", i );
@@ -0,0 +1,110 @@
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentWorkerPool.h"
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentDataCollector.h"
+
+#include "FWCore/Utilities/interface/Exception.h"
+
+
+KalmanAlignmentWorkerPool::KalmanAlignmentWorkerPool( unsigned int nWorkers, unsigned int firstShard ) :
+  theNumberOfWorkers( nWorkers ),
+  theFirstShard( firstShard ),
+  theJobNumber( 0 ),
+  theNumberOfRunningJobs( 0 ),
+  theRunningFlag( false ),
+  theStopFlag( false ),
+  theJobExceptions( nWorkers )
+{
+  if ( theNumberOfWorkers < 1 )
+    throw cms::Exception( "LogicError" ) << "[KalmanAlignmentWorkerPool] At least one worker is needed.";
+}
+
+
+KalmanAlignmentWorkerPool::~KalmanAlignmentWorkerPool( void )
+{
+  {
+    std::unique_lock< std::mutex > lock( theWorkMutex );
+    theDoneCondition.wait( lock, [this]() { return theNumberOfRunningJobs == 0; } );
+    theStopFlag = true;
+  }
+  theWorkCondition.notify_all();
+
+  std::vector< std::thread >::iterator itWorker;
+  for ( itWorker = theWorkers.begin(); itWorker != theWorkers.end(); ++itWorker ) itWorker->join();
+}
+
+
+void KalmanAlignmentWorkerPool::start( const Job& job )
+{
+  if ( theRunningFlag )
+    throw cms::Exception( "LogicError" ) << "[KalmanAlignmentWorkerPool::start] "
+					 << "The previous job has not been waited for.";
+
+  if ( theWorkers.empty() )
+  {
+    for ( unsigned int iWorker = 0; iWorker < theNumberOfWorkers; ++iWorker )
+      theWorkers.push_back( std::thread( &KalmanAlignmentWorkerPool::runWorker, this, iWorker ) );
+  }
+
+  std::lock_guard< std::mutex > lock( theWorkMutex );
+
+  theJob = job;
+  theNumberOfRunningJobs = theWorkers.size();
+  theRunningFlag = true;
+  ++theJobNumber;
+  theWorkCondition.notify_all();
+}
+
+
+void KalmanAlignmentWorkerPool::wait( void )
+{
+  if ( !theRunningFlag ) return;
+
+  std::exception_ptr exception;
+  {
+    std::unique_lock< std::mutex > lock( theWorkMutex );
+
+    theDoneCondition.wait( lock, [this]() { return theNumberOfRunningJobs == 0; } );
+    theJob = Job();
+    theRunningFlag = false;
+
+    std::vector< std::exception_ptr >::iterator itException;
+    for ( itException = theJobExceptions.begin(); itException != theJobExceptions.end(); ++itException )
+    {
+      if ( *itException && !exception ) exception = *itException;
+      *itException = std::exception_ptr();
+    }
+  }
+
+  if ( exception ) std::rethrow_exception( exception );
+}
+
+
+void KalmanAlignmentWorkerPool::runWorker( unsigned int iWorker )
+{
+  // Each worker fills its own part of the debug data, merged in a fixed order when written.
+  KalmanAlignmentDataCollector::useShard( theFirstShard + iWorker );
+
+  unsigned long lastJobNumber = 0;
+
+  while ( true )
+  {
+    Job job;
+    {
+      std::unique_lock< std::mutex > lock( theWorkMutex );
+      theWorkCondition.wait( lock, [&]() { return theStopFlag || theJobNumber != lastJobNumber; } );
+      if ( theStopFlag ) return;
+
+      lastJobNumber = theJobNumber;
+      job = theJob;
+    }
+
+    std::exception_ptr exception;
+    try { job( iWorker ); }
+    catch(...) { exception = std::current_exception(); }
+
+    std::lock_guard< std::mutex > lock( theWorkMutex );
+    theJobExceptions[iWorker] = exception;
+    if ( --theNumberOfRunningJobs == 0 ) theDoneCondition.notify_all();
+  }
+}
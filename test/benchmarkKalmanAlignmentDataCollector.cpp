@@ -0,0 +1,68 @@
+// Benchmark of the fill functions of the KalmanAlignmentDataCollector: the fills by name, as the
+// callers did before the handles were introduced (name built for every entry), compared to the
+// fills via a registered handle.
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentDataCollector.h"
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const unsigned int theNumberOfFills = 2000000;
+static const unsigned int theNumberOfObjects = 20;
+
+static double nsPerFill( std::chrono::steady_clock::time_point start )
+{
+  return std::chrono::duration< double, std::nano >( std::chrono::steady_clock::now() - start ).count()/theNumberOfFills;
+}
+
+
+int main( void )
+{
+  vector< string > identifiers;
+  vector< int > histoHandles;
+  vector< int > graphHandles;
+  for ( unsigned int iObject = 0; iObject < theNumberOfObjects; ++iObject )
+  {
+    ostringstream identifier;
+    identifier << "Setup" << iObject;
+    identifiers.push_back( identifier.str() );
+    histoHandles.push_back( KalmanAlignmentDataCollector::registerHistogram( identifier.str() + string( "_Pt" ) ) );
+    graphHandles.push_back( KalmanAlignmentDataCollector::registerGraph( identifier.str() + string( "_Evolution" ) ) );
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for ( unsigned int iFill = 0; iFill < theNumberOfFills; ++iFill )
+    KalmanAlignmentDataCollector::fillHistogram( identifiers[iFill%theNumberOfObjects] + string( "_Pt" ), 1e-3*iFill );
+  const double histoByName = nsPerFill( start );
+
+  start = std::chrono::steady_clock::now();
+  for ( unsigned int iFill = 0; iFill < theNumberOfFills; ++iFill )
+    KalmanAlignmentDataCollector::fillHistogram( histoHandles[iFill%theNumberOfObjects], 1e-3*iFill );
+  const double histoByHandle = nsPerFill( start );
+
+  start = std::chrono::steady_clock::now();
+  for ( unsigned int iFill = 0; iFill < theNumberOfFills; ++iFill )
+    KalmanAlignmentDataCollector::fillGraph( identifiers[iFill%theNumberOfObjects] + string( "_Evolution" ), iFill, 1e-3*iFill );
+  const double graphByName = nsPerFill( start );
+
+  KalmanAlignmentDataCollector::clear();
+
+  start = std::chrono::steady_clock::now();
+  for ( unsigned int iFill = 0; iFill < theNumberOfFills; ++iFill )
+    KalmanAlignmentDataCollector::fillGraph( graphHandles[iFill%theNumberOfObjects], iFill, 1e-3*iFill );
+  const double graphByHandle = nsPerFill( start );
+
+  KalmanAlignmentDataCollector::clear();
+
+  cout << "Histogram fill by name:   " << histoByName << " ns" << endl;
+  cout << "Histogram fill by handle: " << histoByHandle << " ns" << endl;
+  cout << "Graph fill by name:       " << graphByName << " ns" << endl;
+  cout << "Graph fill by handle:     " << graphByHandle << " ns" << endl;
+
+  return 0;
+}
@@ -0,0 +1,219 @@
+// Benchmark of the hit handling per tracklet in KalmanAlignmentTrackRefitter::refitSingleTracklet:
+// sortRecHits building transient hits for the first and the last hit and the transient hits being
+// copied to prepend the momentum constraint, as done before, compared to the global positions taken
+// from the geometry and the hit container reserved once with a slot for the constraint. The
+// geometry, the hits and the hit builder are simple models of the CMSSW classes, hence the times do
+// not include the cost of the CPE. The allocations are counted per tracklet.
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+static const unsigned int theNumberOfTracklets = 200000;
+static const unsigned int theNumberOfHits = 14;
+static const unsigned int theNumberOfDets = 1000;
+
+static unsigned long theNumberOfAllocations = 0;
+
+void* operator new( size_t size )
+{
+  ++theNumberOfAllocations;
+  void* pointer = malloc( size ? size : 1 );
+  if ( !pointer ) throw bad_alloc();
+  return pointer;
+}
+
+void operator delete( void* pointer ) noexcept { free( pointer ); }
+void operator delete( void* pointer, size_t ) noexcept { free( pointer ); }
+
+
+struct Point { double x, y, z; };
+
+/// A det with its surface: rotation and position.
+struct Det
+{
+  double rotation[3][3];
+  Point position;
+
+  Point toGlobal( const Point& local ) const
+  {
+    Point global;
+    global.x = position.x + rotation[0][0]*local.x + rotation[1][0]*local.y + rotation[2][0]*local.z;
+    global.y = position.y + rotation[0][1]*local.x + rotation[1][1]*local.y + rotation[2][1]*local.z;
+    global.z = position.z + rotation[0][2]*local.x + rotation[1][2]*local.y + rotation[2][2]*local.z;
+    return global;
+  }
+};
+
+/// The geometry: the det of a hit is looked up by its id.
+struct Geometry
+{
+  vector< Det > dets;
+  const Det* idToDet( unsigned int detId ) const { return &dets[detId]; }
+};
+
+/// A rec hit as stored in the OwnVector, cloned when the hits are reversed.
+struct RecHit
+{
+  unsigned int detId;
+  Point localPosition;
+  RecHit* clone( void ) const { return new RecHit( *this ); }
+};
+
+/// A transient hit with its det, built on the heap and reference counted as in CMSSW.
+struct TransientHit
+{
+  TransientHit( const Det* d, const Point& p ) : det( d ), localPosition( p ) {}
+  const Det* det;
+  Point localPosition;
+};
+
+typedef shared_ptr< const TransientHit > TransientHitPointer;
+typedef vector< TransientHitPointer > TransientHitContainer;
+
+/// Owns its hits, like edm::OwnVector.
+struct RecHitContainer
+{
+  ~RecHitContainer( void ) { clear(); }
+  void clear( void ) { for ( unsigned int i = 0; i < hits.size(); ++i ) delete hits[i]; hits.clear(); }
+  void swap( RecHitContainer& other ) { hits.swap( other.hits ); }
+  vector< RecHit* > hits;
+};
+
+static TransientHitPointer build( const Geometry& geometry, const RecHit* hit )
+{
+  // One allocation, as for the intrusive reference counting of the CMSSW hits.
+  return make_shared< const TransientHit >( geometry.idToDet( hit->detId ), hit->localPosition );
+}
+
+static double mag( const Point& p ) { return sqrt( p.x*p.x + p.y*p.y + p.z*p.z ); }
+
+/// Inside-out sorting: true if the order of the hits has to be reversed.
+static bool reverse( const Point& first, const Point& last ) { return mag( first ) > mag( last ); }
+
+static void reverseHits( RecHitContainer& hits, bool reserve )
+{
+  RecHitContainer tmp;
+  if ( reserve ) tmp.hits.reserve( hits.hits.size() );
+  for ( unsigned int i = hits.hits.size(); i > 0; --i ) tmp.hits.push_back( hits.hits[i-1]->clone() );
+  hits.swap( tmp );
+}
+
+
+/// The hit handling per tracklet before: transient hits for the sorting, the global positions
+/// computed twice, no reserve, and the container copied to prepend the constraint.
+static double before( const Geometry& geometry, RecHitContainer& recHits )
+{
+  TransientHitPointer firstHit = build( geometry, recHits.hits.front() );
+  double firstRadius = mag( firstHit->det->toGlobal( firstHit->localPosition ) );
+  double firstY = firstHit->det->toGlobal( firstHit->localPosition ).y;
+  TransientHitPointer lastHit = build( geometry, recHits.hits.back() );
+  double lastRadius = mag( lastHit->det->toGlobal( lastHit->localPosition ) );
+  double lastY = lastHit->det->toGlobal( lastHit->localPosition ).y;
+  if ( firstRadius > lastRadius ) reverseHits( recHits, false );
+
+  TransientHitContainer hits;
+  for ( unsigned int i = 0; i < recHits.hits.size(); ++i ) hits.push_back( build( geometry, recHits.hits[i] ) );
+
+  TransientHitPointer constraint = make_shared< const TransientHit >( hits.front()->det, Point() );
+  TransientHitContainer tmpHits;
+  tmpHits.push_back( constraint );
+  for ( TransientHitContainer::const_iterator it = hits.begin(); it != hits.end(); ++it ) tmpHits.push_back( *it );
+  hits.swap( tmpHits );
+
+  return hits.size() + firstY - lastY;
+}
+
+
+/// The hit handling per tracklet now: the global positions from the geometry, reserved containers
+/// and the constraint written into the first slot.
+static double after( const Geometry& geometry, RecHitContainer& recHits )
+{
+  const RecHit* first = recHits.hits.front();
+  const RecHit* last = recHits.hits.back();
+  const Point firstPosition = geometry.idToDet( first->detId )->toGlobal( first->localPosition );
+  const Point lastPosition = geometry.idToDet( last->detId )->toGlobal( last->localPosition );
+  if ( reverse( firstPosition, lastPosition ) ) reverseHits( recHits, true );
+
+  TransientHitContainer hits;
+  hits.reserve( recHits.hits.size() + 1 );
+  hits.push_back( TransientHitPointer() );
+  for ( unsigned int i = 0; i < recHits.hits.size(); ++i ) hits.push_back( build( geometry, recHits.hits[i] ) );
+
+  hits.front() = make_shared< const TransientHit >( hits[1]->det, Point() );
+
+  return hits.size() + firstPosition.y - lastPosition.y;
+}
+
+
+/// The hits of a tracklet, every second one ordered outside-in (hence reversed).
+static void fillHits( RecHitContainer& recHits, unsigned int iTracklet )
+{
+  for ( unsigned int iHit = 0; iHit < theNumberOfHits; ++iHit )
+  {
+    const unsigned int layer = ( iTracklet%2 ) ? theNumberOfHits - 1 - iHit : iHit;
+    RecHit* hit = new RecHit;
+    hit->detId = ( 37*iTracklet + 50*layer )%theNumberOfDets;
+    hit->localPosition.x = 0.1*layer;
+    hit->localPosition.y = -0.2*layer;
+    hit->localPosition.z = 0.;
+    recHits.hits.push_back( hit );
+  }
+}
+
+
+static void measure( const char* name, double (*function)( const Geometry&, RecHitContainer& ), const Geometry& geometry )
+{
+  // Only the hit handling is measured, not the filling of the input hits.
+  double checksum = 0.;
+  unsigned long allocations = 0;
+  std::chrono::steady_clock::duration duration( 0 );
+
+  RecHitContainer recHits;
+  recHits.hits.reserve( theNumberOfHits );
+  for ( unsigned int iTracklet = 0; iTracklet < theNumberOfTracklets; ++iTracklet )
+  {
+    recHits.clear();
+    fillHits( recHits, iTracklet );
+
+    const unsigned long startAllocations = theNumberOfAllocations;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    checksum += function( geometry, recHits );
+    duration += std::chrono::steady_clock::now() - start;
+    allocations += theNumberOfAllocations - startAllocations;
+  }
+
+  cout << name << std::chrono::duration< double, std::nano >( duration ).count()/theNumberOfTracklets << " ns, "
+       << static_cast< double >( allocations )/theNumberOfTracklets << " allocations per tracklet"
+       << " (checksum " << checksum << ")" << endl;
+}
+
+
+int main( void )
+{
+  Geometry geometry;
+  geometry.dets.resize( theNumberOfDets );
+  for ( unsigned int iDet = 0; iDet < theNumberOfDets; ++iDet )
+  {
+    const double phi = 0.01*iDet;
+    Det& det = geometry.dets[iDet];
+    det.rotation[0][0] = cos( phi ); det.rotation[0][1] = sin( phi ); det.rotation[0][2] = 0.;
+    det.rotation[1][0] = -sin( phi ); det.rotation[1][1] = cos( phi ); det.rotation[1][2] = 0.;
+    det.rotation[2][0] = 0.; det.rotation[2][1] = 0.; det.rotation[2][2] = 1.;
+    det.position.x = ( 4. + 0.1*iDet )*cos( phi );
+    det.position.y = ( 4. + 0.1*iDet )*sin( phi );
+    det.position.z = 0.05*iDet;
+  }
+
+  cout << theNumberOfHits << " hits per tracklet, every second tracklet reversed" << endl;
+  measure( "Before: ", before, geometry );
+  measure( "After:  ", after, geometry );
+
+  return 0;
+}
@@ -0,0 +1,59 @@
+#!/usr/bin/bash
+
+# Scaling and equivalence check of the threaded track refit.
+#
+# The given cfg is run once for every number of threads with the timing enabled. For more than one
+# thread, it is run a second time with ValidateThreadedRefit, which compares every event to the
+# sequential refit. The cfg should process a fixed, moderate number of events.
+#
+# Usage: refit-scaling.sh cfg [nThreads ...]    (default: 1 2 4 8 16)
+
+if [ $# -lt 1 ]; then
+  echo "Usage: refit-scaling.sh cfg [nThreads ...]"
+  exit 1
+fi
+
+CFG=$1
+shift
+THREADS=${@:-1 2 4 8 16}
+
+WORKDIR=refit-scaling
+mkdir -p $WORKDIR
+
+# Run the cfg with the given number of threads and validation flag.
+run_refit()
+{
+  NTHREADS=$1
+  VALIDATE=$2
+  NAME=$WORKDIR/threads$NTHREADS$3
+
+  cp $CFG ${NAME}_cfg.py
+  cat >> ${NAME}_cfg.py <<EOT
+
+process.AlignmentProducer.algoConfig.TrackRefitter.NumberOfThreads = cms.untracked.uint32( $NTHREADS )
+process.AlignmentProducer.algoConfig.TrackRefitter.ValidateThreadedRefit = cms.untracked.bool( $VALIDATE )
+process.AlignmentProducer.algoConfig.DataCollector.Instrumentation = cms.untracked.vstring( "Timing" )
+process.AlignmentProducer.algoConfig.TimingLogFile = cms.untracked.string( "${NAME}_timing.log" )
+EOT
+
+  cmsRun ${NAME}_cfg.py > ${NAME}.log 2>&1 || { echo "cmsRun failed, see ${NAME}.log"; exit 1; }
+}
+
+printf "%8s %12s %12s %10s %12s\n" threads "refit[s]" "mean[us]" speedup mismatches
+
+for NTHREADS in $THREADS; do
+  run_refit $NTHREADS False
+
+  TOTAL=`awk '$1 == "Refit" { print $3 }' $WORKDIR/threads${NTHREADS}_timing.log`
+  MEAN=`awk '$1 == "Refit" { print $4 }' $WORKDIR/threads${NTHREADS}_timing.log`
+  if [ -z "$REFERENCE" ]; then REFERENCE=$TOTAL; fi
+  SPEEDUP=`echo "$REFERENCE $TOTAL" | awk '{ if ( $2 > 0 ) printf "%.2f", $1/$2 }'`
+
+  MISMATCHES="-"
+  if [ $NTHREADS -gt 1 ]; then
+    run_refit $NTHREADS True _validate
+    MISMATCHES=`sed -n 's/.*Threaded refit compared.*mismatches: \([0-9]*\).*/\1/p' $WORKDIR/threads${NTHREADS}_validate.log`
+  fi
+
+  printf "%8s %12s %12s %10s %12s\n" $NTHREADS $TOTAL $MEAN $SPEEDUP $MISMATCHES
+done
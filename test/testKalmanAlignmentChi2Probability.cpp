@@ -0,0 +1,65 @@
+// Unit test of KalmanAlignmentChi2Probability: the precomputed chi2 cuts must give the same
+// decision as computing the chi2-probability of every track, also beyond the cached ndof.
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentChi2Probability.h"
+
+#include "TMath.h"
+
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+
+static int theNumberOfFailures = 0;
+
+static void check( bool condition, const char* what, double minProb, double maxProb, double chi2, unsigned int ndof )
+{
+  if ( condition ) return;
+  cout << "FAILED: " << what << " (window [" << minProb << "," << maxProb << "], chi2 = " << chi2 << ", ndof = " << ndof << ")" << endl;
+  ++theNumberOfFailures;
+}
+
+
+static void checkWindow( double minProb, double maxProb )
+{
+  // Cache only up to ndof = 50, such that the direct computation is tested as well.
+  const unsigned int maxCachedNdof = 50;
+  KalmanAlignmentChi2Probability window( minProb, maxProb, maxCachedNdof );
+
+  for ( unsigned int ndof = 1; ndof <= 2*maxCachedNdof; ++ndof )
+  {
+    for ( double chi2 = 0.01; chi2 < 5.*ndof + 50.; chi2 *= 1.1 )
+    {
+      const double prob = TMath::Prob( chi2, ndof );
+
+      // The cuts are only as precise as the quantile, skip chi2 values right at the edges.
+      if ( fabs( prob - minProb ) < 1e-6 || fabs( prob - maxProb ) < 1e-6 ) continue;
+
+      const bool expected = ( prob >= minProb ) && ( prob <= maxProb );
+      check( window.accept( chi2, ndof ) == expected, "accept", minProb, maxProb, chi2, ndof );
+    }
+  }
+}
+
+
+int main( void )
+{
+  // The full window accepts everything, without any cuts.
+  KalmanAlignmentChi2Probability fullWindow;
+  check( fullWindow.accept( 1e10, 5 ), "full window", 0., 1., 1e10, 5 );
+  check( fullWindow.accept( 0., 500 ), "full window", 0., 1., 0., 500 );
+
+  checkWindow( 0.01, 1. );
+  checkWindow( 0., 0.99 );
+  checkWindow( 0.05, 0.95 );
+  checkWindow( 0.3, 0.4 );
+
+  // Tracks without degrees of freedom are never rejected.
+  KalmanAlignmentChi2Probability window( 0.1, 0.9 );
+  check( window.accept( 100., 0 ), "ndof = 0", 0.1, 0.9, 100., 0 );
+
+  if ( theNumberOfFailures ) cout << theNumberOfFailures << " check(s) failed" << endl;
+  else cout << "All checks passed" << endl;
+
+  return theNumberOfFailures ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+// Unit test of the write path of the KalmanAlignmentDataCollector: graphs with LTTB sampling are
+// reduced to their N points when written, also if their buffer holds more points at that time.
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentDataCollector.h"
+
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+
+#include "TFile.h"
+#include "TGraph.h"
+
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static int theNumberOfFailures = 0;
+
+static void check( bool condition, const char* what )
+{
+  if ( condition ) return;
+  cout << "FAILED: " << what << endl;
+  ++theNumberOfFailures;
+}
+
+
+static float value( int x ) { return 2.*x + ( x%3 ); }
+
+
+/// The graph must hold nPoints of the filled points x = 0 ... nFilled-1, in order, including the
+/// first and the last one.
+static void checkGraph( TFile& file, const char* name, int nPoints, int nFilled )
+{
+  TGraph* graph = dynamic_cast< TGraph* >( file.Get( name ) );
+  check( graph != 0, name );
+  if ( !graph ) return;
+
+  check( graph->GetN() == nPoints, "number of points" );
+  if ( graph->GetN() != nPoints ) return;
+
+  const double* x = graph->GetX();
+  const double* y = graph->GetY();
+
+  check( x[0] == 0. && x[nPoints-1] == nFilled - 1, "first and last point kept" );
+
+  for ( int i = 0; i < nPoints; ++i )
+  {
+    const int filled = static_cast< int >( x[i] );
+    check( x[i] == filled && filled >= 0 && filled < nFilled, "x is a filled point" );
+    check( y[i] == value( filled ), "y belongs to x" );
+    if ( i > 0 ) check( x[i] > x[i-1], "points in order" );
+  }
+}
+
+
+int main( void )
+{
+  const unsigned int nSampled = 10;
+  const string fileName = "testKalmanAlignmentDataCollector.root";
+
+  edm::ParameterSet sampling;
+  sampling.addUntrackedParameter< string >( "Pattern", "LTTB_*" );
+  sampling.addUntrackedParameter< string >( "Policy", "LTTB" );
+  sampling.addUntrackedParameter< unsigned int >( "N", nSampled );
+
+  edm::ParameterSet config;
+  config.addUntrackedParameter< vector< edm::ParameterSet > >( "GraphSampling", vector< edm::ParameterSet >( 1, sampling ) );
+  KalmanAlignmentDataCollector::configure( config );
+
+  // The LTTB buffer is reduced to N points when it reaches 2N points. After 2N+5 points it holds
+  // N+5 points, which have to be reduced again when writing.
+  const int nBuffered = 2*nSampled + 5;
+  const int handle = KalmanAlignmentDataCollector::registerGraph( "LTTB_Buffered" );
+  for ( int x = 0; x < nBuffered; ++x ) KalmanAlignmentDataCollector::fillGraph( handle, x, value( x ) );
+
+  // Fewer points than N are kept as they are.
+  const int nFew = nSampled - 3;
+  for ( int x = 0; x < nFew; ++x ) KalmanAlignmentDataCollector::fillGraph( "LTTB_Few", x, value( x ) );
+
+  // Graphs without sampling keep all points.
+  const int nAll = 3*nSampled;
+  for ( int x = 0; x < nAll; ++x ) KalmanAlignmentDataCollector::fillGraph( "Unsampled", x, value( x ) );
+
+  KalmanAlignmentDataCollector::write( fileName );
+
+  TFile file( fileName.c_str(), "READ" );
+  checkGraph( file, "LTTB_Buffered", nSampled, nBuffered );
+  checkGraph( file, "LTTB_Few", nFew, nFew );
+  checkGraph( file, "Unsampled", nAll, nAll );
+  file.Close();
+
+  if ( theNumberOfFailures ) cout << theNumberOfFailures << " check(s) failed" << endl;
+  else cout << "All checks passed" << endl;
+
+  return theNumberOfFailures ? 1 : 0;
+}
@@ -0,0 +1,52 @@
+// Unit test of the decision of KalmanAlignmentTrackRefitter::sortRecHits, which is based on the
+// global positions of the first and the last hit.
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentTrackRefitter.h"
+
+#include <iostream>
+
+using namespace std;
+
+static int theNumberOfFailures = 0;
+
+static void check( bool condition, const char* what )
+{
+  if ( condition ) return;
+  cout << "FAILED: " << what << endl;
+  ++theNumberOfFailures;
+}
+
+
+int main( void )
+{
+  // A cosmic track from the top of the detector through the center.
+  const GlobalPoint upper( 10., 100., 20. );
+  const GlobalPoint center( 1., 2., 3. );
+
+  // Hits ordered from the center to the top: inside-out and downside-up.
+  check( !KalmanAlignmentTrackRefitter::reverseHitOrder( center, upper, KalmanAlignmentSetup::sortInsideOut ), "inside-out kept" );
+  check( KalmanAlignmentTrackRefitter::reverseHitOrder( center, upper, KalmanAlignmentSetup::sortOutsideIn ), "inside-out reversed" );
+  check( KalmanAlignmentTrackRefitter::reverseHitOrder( center, upper, KalmanAlignmentSetup::sortUpsideDown ), "downside-up reversed" );
+  check( !KalmanAlignmentTrackRefitter::reverseHitOrder( center, upper, KalmanAlignmentSetup::sortDownsideUp ), "downside-up kept" );
+
+  // Hits ordered from the top to the center: outside-in and upside-down.
+  check( KalmanAlignmentTrackRefitter::reverseHitOrder( upper, center, KalmanAlignmentSetup::sortInsideOut ), "outside-in reversed" );
+  check( !KalmanAlignmentTrackRefitter::reverseHitOrder( upper, center, KalmanAlignmentSetup::sortOutsideIn ), "outside-in kept" );
+  check( !KalmanAlignmentTrackRefitter::reverseHitOrder( upper, center, KalmanAlignmentSetup::sortUpsideDown ), "upside-down kept" );
+  check( KalmanAlignmentTrackRefitter::reverseHitOrder( upper, center, KalmanAlignmentSetup::sortDownsideUp ), "upside-down reversed" );
+
+  // Sorting twice is stable: after reversing, the order is kept.
+  for ( int dir = KalmanAlignmentSetup::sortInsideOut; dir <= KalmanAlignmentSetup::sortDownsideUp; ++dir )
+  {
+    const KalmanAlignmentSetup::SortingDirection sortingDir = static_cast< KalmanAlignmentSetup::SortingDirection >( dir );
+    const bool reversed = KalmanAlignmentTrackRefitter::reverseHitOrder( center, upper, sortingDir );
+    const GlobalPoint& first = reversed ? upper : center;
+    const GlobalPoint& last = reversed ? center : upper;
+    check( !KalmanAlignmentTrackRefitter::reverseHitOrder( first, last, sortingDir ), "sorting is idempotent" );
+  }
+
+  if ( theNumberOfFailures ) cout << theNumberOfFailures << " check(s) failed" << endl;
+  else cout << "All checks passed" << endl;
+
+  return theNumberOfFailures ? 1 : 0;
+}
@@ -0,0 +1,182 @@
+// Unit test of KalmanAlignmentParameterMerger: the weighted merge of several jobs that start from
+// the same prior must equal the combined fit of all their data, also when merged in groups, and the
+// equal-weight fallback must keep a usable covariance.
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentParameterMerger.h"
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+static int theNumberOfFailures = 0;
+
+static void check( bool condition, const char* what )
+{
+  if ( condition ) return;
+  cout << "FAILED: " << what << endl;
+  ++theNumberOfFailures;
+}
+
+
+static bool equal( const AlgebraicVector& a, const AlgebraicVector& b )
+{
+  if ( a.num_row() != b.num_row() ) return false;
+  for ( int i = 0; i < a.num_row(); ++i )
+    if ( fabs( a[i] - b[i] ) > 1e-9*( 1. + fabs( b[i] ) ) ) return false;
+  return true;
+}
+
+
+static bool equal( const AlgebraicSymMatrix& a, const AlgebraicSymMatrix& b )
+{
+  if ( a.num_row() != b.num_row() ) return false;
+  for ( int i = 0; i < a.num_row(); ++i )
+    for ( int j = 0; j < a.num_row(); ++j )
+      if ( fabs( a[i][j] - b[i][j] ) > 1e-9*( 1. + fabs( b[i][j] ) ) ) return false;
+  return true;
+}
+
+
+static AlgebraicSymMatrix inverse( const AlgebraicSymMatrix& matrix )
+{
+  int ierr = 0;
+  AlgebraicSymMatrix result = matrix.inverse( ierr );
+  check( ierr == 0, "test matrix invertible" );
+  return result;
+}
+
+
+static AlgebraicVector vector2( double a, double b )
+{
+  AlgebraicVector result( 2, 0 );
+  result[0] = a; result[1] = b;
+  return result;
+}
+
+
+static AlgebraicSymMatrix matrix2( double a, double b, double c )
+{
+  AlgebraicSymMatrix result( 2, 0 );
+  result[0][0] = a; result[0][1] = b; result[1][0] = b; result[1][1] = c;
+  return result;
+}
+
+
+/// The result of a job that updates the prior with the measurement 'data' of information 'dataInfo'.
+static void fitJob( const AlgebraicVector& prior, const AlgebraicSymMatrix& priorCov,
+		    const AlgebraicVector& data, const AlgebraicSymMatrix& dataInfo,
+		    AlgebraicVector& parameters, AlgebraicSymMatrix& covariance )
+{
+  AlgebraicSymMatrix invPrior = inverse( priorCov );
+  covariance = inverse( invPrior + dataInfo );
+  parameters = covariance*( invPrior*prior + dataInfo*data );
+}
+
+
+int main( void )
+{
+  const AlgebraicVector prior = vector2( 0.1, -0.2 );
+  const AlgebraicSymMatrix priorCov = matrix2( 4., 1., 3. );
+
+  vector< AlgebraicVector > data;
+  vector< AlgebraicSymMatrix > dataInfo;
+  data.push_back( vector2( 1., 2. ) ); dataInfo.push_back( matrix2( 2., 0.5, 1. ) );
+  data.push_back( vector2( 0.5, 1.5 ) ); dataInfo.push_back( matrix2( 1., -0.2, 3. ) );
+  data.push_back( vector2( -1., 0.3 ) ); dataInfo.push_back( matrix2( 0.5, 0.1, 0.7 ) );
+
+  vector< AlgebraicVector > jobParameters( data.size() );
+  vector< AlgebraicSymMatrix > jobCovariance( data.size() );
+  for ( unsigned int i = 0; i < data.size(); ++i )
+    fitJob( prior, priorCov, data[i], dataInfo[i], jobParameters[i], jobCovariance[i] );
+
+  // The fit of all data at once.
+  AlgebraicVector allData( 2, 0 );
+  AlgebraicSymMatrix allInfo( 2, 0 );
+  for ( unsigned int i = 0; i < data.size(); ++i ) { allData += dataInfo[i]*data[i]; allInfo += dataInfo[i]; }
+  AlgebraicSymMatrix expectedCov = inverse( inverse( priorCov ) + allInfo );
+  AlgebraicVector expectedParam = expectedCov*( inverse( priorCov )*prior + allData );
+
+  AlgebraicVector parameters;
+  AlgebraicSymMatrix covariance;
+
+  // Weighted merge of all jobs, with the prior removed.
+  KalmanAlignmentParameterMerger all;
+  for ( unsigned int i = 0; i < data.size(); ++i ) all.add( jobParameters[i], jobCovariance[i], true );
+  all.result( parameters, covariance, &prior, &priorCov );
+  check( all.weighted() && all.priorRemoved(), "all at once: weighted, prior removed" );
+  check( all.numberOfInputs() == 3, "all at once: number of inputs" );
+  check( equal( parameters, expectedParam ), "all at once: parameters" );
+  check( equal( covariance, expectedCov ), "all at once: covariance" );
+
+  // Without the prior, the merged covariance is too small.
+  all.result( parameters, covariance );
+  check( all.weighted() && !all.priorRemoved(), "no prior: weighted, prior kept" );
+  check( covariance[0][0] < expectedCov[0][0] && covariance[1][1] < expectedCov[1][1], "no prior: covariance too small" );
+
+  // Merging the first two jobs and then the result with the third one gives the same.
+  KalmanAlignmentParameterMerger group;
+  group.add( jobParameters[0], jobCovariance[0], true );
+  group.add( jobParameters[1], jobCovariance[1], true );
+  AlgebraicVector groupParameters;
+  AlgebraicSymMatrix groupCovariance;
+  group.result( groupParameters, groupCovariance, &prior, &priorCov );
+
+  KalmanAlignmentParameterMerger tree;
+  tree.add( groupParameters, groupCovariance, true );
+  tree.add( jobParameters[2], jobCovariance[2], true );
+  tree.result( parameters, covariance, &prior, &priorCov );
+  check( equal( parameters, expectedParam ), "tree merge: parameters" );
+  check( equal( covariance, expectedCov ), "tree merge: covariance" );
+
+  // A single input is returned unchanged.
+  KalmanAlignmentParameterMerger single;
+  single.add( jobParameters[0], jobCovariance[0], true );
+  single.result( parameters, covariance, &prior, &priorCov );
+  check( !single.priorRemoved(), "single input: prior kept" );
+  check( equal( parameters, jobParameters[0] ) && equal( covariance, jobCovariance[0] ), "single input: unchanged" );
+
+  // A prior that is tighter than the inputs cannot be removed.
+  KalmanAlignmentParameterMerger tight;
+  tight.add( jobParameters[0], jobCovariance[0], true );
+  tight.add( jobParameters[1], jobCovariance[1], true );
+  const AlgebraicSymMatrix tightCov = matrix2( 1e-3, 0., 1e-3 );
+  tight.result( parameters, covariance, &prior, &tightCov );
+  check( tight.weighted() && !tight.priorRemoved(), "tight prior: not removed" );
+  check( covariance[0][0] > 0. && covariance[1][1] > 0., "tight prior: positive covariance" );
+
+  // An input without invertible covariance makes the merge fall back to equal weights. The result
+  // is the mean with the covariance of the mean.
+  KalmanAlignmentParameterMerger unweighted;
+  unweighted.add( jobParameters[0], jobCovariance[0], true );
+  unweighted.add( jobParameters[1], AlgebraicSymMatrix( 2, 0 ), true );
+  unweighted.add( jobParameters[2], jobCovariance[2], true );
+  unweighted.result( parameters, covariance, &prior, &priorCov );
+  AlgebraicVector mean = ( jobParameters[0] + jobParameters[1] + jobParameters[2] )/3.;
+  AlgebraicSymMatrix meanCov = ( jobCovariance[0] + jobCovariance[2] )/9.;
+  check( !unweighted.weighted() && !unweighted.priorRemoved(), "fallback: equal weights" );
+  check( equal( parameters, mean ), "fallback: parameters" );
+  check( equal( covariance, meanCov ), "fallback: covariance" );
+
+  // The result of the fallback can still be merged with weights.
+  KalmanAlignmentParameterMerger again;
+  again.add( parameters, covariance, true );
+  again.add( jobParameters[0], jobCovariance[0], true );
+  again.result( parameters, covariance );
+  check( again.weighted(), "merge of a fallback result: weighted" );
+
+  // The weighted merge switched off.
+  KalmanAlignmentParameterMerger off;
+  off.add( jobParameters[0], jobCovariance[0], false );
+  off.add( jobParameters[1], jobCovariance[1], false );
+  off.result( parameters, covariance, &prior, &priorCov );
+  check( !off.weighted(), "switched off: equal weights" );
+  check( equal( parameters, ( jobParameters[0] + jobParameters[1] )/2. ), "switched off: parameters" );
+  check( equal( covariance, ( jobCovariance[0] + jobCovariance[1] )/4. ), "switched off: covariance" );
+
+  if ( theNumberOfFailures ) cout << theNumberOfFailures << " check(s) failed" << endl;
+  else cout << "All checks passed" << endl;
+
+  return theNumberOfFailures ? 1 : 0;
+}
@@ -0,0 +1,121 @@
+// Unit test of the graph sampling algorithms (see KalmanAlignmentSampling).
+
+#include "Alignment/KalmanAlignmentAlgorithm/interface/KalmanAlignmentSampling.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+static int theNumberOfFailures = 0;
+
+static void check( bool condition, const char* what )
+{
+  if ( condition ) return;
+  cout << "FAILED: " << what << endl;
+  ++theNumberOfFailures;
+}
+
+
+static void testLTTB( void )
+{
+  // A flat line with a single spike.
+  const unsigned int nData = 1000;
+  const unsigned int iSpike = 437;
+  vector< float > xData( nData );
+  vector< float > yData( nData, 1. );
+  for ( unsigned int i = 0; i < nData; ++i ) xData[i] = 0.5*i;
+  yData[iSpike] = 100.;
+
+  // Nothing to do for few points or less than 3 target points.
+  vector< float > x( xData.begin(), xData.begin() + 10 );
+  vector< float > y( yData.begin(), yData.begin() + 10 );
+  KalmanAlignmentSampling::reduceLTTB( x, y, 10 );
+  check( x.size() == 10 && y.size() == 10, "LTTB keeps graphs with at most n points" );
+
+  x = xData;
+  y = yData;
+  KalmanAlignmentSampling::reduceLTTB( x, y, 2 );
+  check( x.size() == nData, "LTTB needs at least 3 points" );
+
+  const unsigned int n = 50;
+  KalmanAlignmentSampling::reduceLTTB( x, y, n );
+  check( x.size() == n && y.size() == n, "LTTB reduces to n points" );
+  check( x.front() == xData.front() && x.back() == xData.back(), "LTTB keeps the first and the last point" );
+  check( is_sorted( x.begin(), x.end() ), "LTTB keeps the order of the points" );
+  check( find( y.begin(), y.end(), 100.f ) != y.end(), "LTTB keeps the spike" );
+
+  // Every selected point is one of the original points.
+  bool subset = true;
+  for ( unsigned int i = 0; i < x.size(); ++i )
+  {
+    const unsigned int iOriginal = static_cast< unsigned int >( 2.*x[i] + 0.5 );
+    subset = subset && iOriginal < nData && xData[iOriginal] == x[i] && yData[iOriginal] == y[i];
+  }
+  check( subset, "LTTB selects original points" );
+}
+
+
+static void testReservoir( void )
+{
+  // Same random index for the same graph and point, different ones for different graphs.
+  check( KalmanAlignmentSampling::reservoirIndex( 3, 12345 ) == KalmanAlignmentSampling::reservoirIndex( 3, 12345 ),
+	 "reservoir sampling is reproducible" );
+
+  unsigned int nDifferent = 0;
+  for ( int handle = 0; handle < 100; ++handle )
+    if ( KalmanAlignmentSampling::reservoirIndex( handle, 1000000 ) != KalmanAlignmentSampling::reservoirIndex( handle + 1, 1000000 ) ) ++nDifferent;
+  check( nDifferent > 95, "reservoir sampling depends on the graph" );
+
+  // Sample n out of nPoints points for many graphs. Every point must be kept with probability
+  // n/nPoints, checked in groups of points.
+  const unsigned int n = 10;
+  const unsigned int nPoints = 1000;
+  const unsigned int nGraphs = 2000;
+  const unsigned int nGroups = 10;
+
+  vector< double > kept( nGroups, 0. );
+  bool inRange = true;
+
+  for ( unsigned int iGraph = 0; iGraph < nGraphs; ++iGraph )
+  {
+    vector< unsigned long > reservoir;
+    for ( unsigned long iPoint = 0; iPoint < nPoints; ++iPoint )
+    {
+      if ( reservoir.size() < n ) { reservoir.push_back( iPoint ); continue; }
+
+      const unsigned long long j = KalmanAlignmentSampling::reservoirIndex( iGraph, iPoint );
+      inRange = inRange && j <= iPoint;
+      if ( j < n ) reservoir[j] = iPoint;
+    }
+
+    for ( unsigned int i = 0; i < reservoir.size(); ++i ) kept[reservoir[i]*nGroups/nPoints] += 1.;
+  }
+
+  check( inRange, "reservoir index within [0,iPoint]" );
+
+  const double expected = static_cast< double >( nGraphs )*n/nGroups;
+  for ( unsigned int iGroup = 0; iGroup < nGroups; ++iGroup )
+  {
+    // Within 5 standard deviations of the binomial expectation.
+    if ( fabs( kept[iGroup] - expected ) > 5.*sqrt( expected ) )
+    {
+      cout << "Group " << iGroup << ": " << kept[iGroup] << " points kept, expected " << expected << endl;
+      check( false, "reservoir sampling is uniform" );
+    }
+  }
+}
+
+
+int main( void )
+{
+  testLTTB();
+  testReservoir();
+
+  if ( theNumberOfFailures ) cout << theNumberOfFailures << " check(s) failed" << endl;
+  else cout << "All checks passed" << endl;
+
+  return theNumberOfFailures ? 1 : 0;
+}